@@ -0,0 +1,29 @@
+#pragma once
+#include "objLoader.h"
+#include "textureLoader.h"
+
+#include <vector>
+
+// a bundled scene as main() sets it up from its files (the scene cache is not used): materials, primitives, lights
+// and the camera of the xml. the primitives point into materials, a BenchScene stays where it was loaded
+struct BenchScene {
+	std::vector<tinyobj::material_t> materials;
+	PrimitiveStore prims;
+	std::vector<PrimRef> lightObjects;
+	int width = 0, height = 0;
+	float fovy = 0;
+	Ray cam;
+	Vec camUp;
+};
+
+// false if the files of the scene are missing or broken
+inline bool loadBenchScene(int modelSelect, BenchScene& scene)
+{
+	TextureLoader textureLoader;
+	if (!objStreamLoader(modelSelect, scene.materials, scene.prims, textureLoader, 0) ||
+		!xmlCameraAndCorrectMaterial(modelSelect, scene.width, scene.height, scene.fovy, scene.cam, scene.camUp, scene.materials, 0))
+		return false;
+	collectLights(scene.prims, scene.lightObjects);
+	textureLoader.finish(scene.prims);
+	return true;
+}
@@ -0,0 +1,428 @@
+#include "benchScene.h"
+#include "camera.h"
+#include "pathTracer.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <math.h>
+#include <memory>
+#include <string>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// benchmark of the bundled scenes, for tracking regressions and comparing the bvh variants.
+// every scene is loaded from its obj (see loadBenchScene), then for each bvh variant:
+//   primary: one camera ray per pixel, diffuse: a bounce off every primary hit as radiance() samples it,
+//   shadow: from every primary hit towards a random point of a random light, each traced alone and timed in Mrays/s,
+//   paths: spp full path traced samples per pixel through radiance(), in samples/s
+// the rays are made once per scene from the seed, so all variants trace the same rays and must report the same hits.
+// the path stage is repeatable for a seed with one thread, with more the threads share rand(): its noise and mean
+// luminance differ from run to run and the lock of rand() holds back samples/s, compare it with --threads 1
+//
+// usage: mcpt_bench [--scenes 1,2,3,4] [--bvh tree,mapped,q16,q8] [--scale 0.5] [--spp 1] [--seed 1] [--threads n]
+//                   [--json benchmark.json]
+// scenes as modelSelect of main (1: cornell-box, 2: veach-mis, 3: staircase, 4: test), run from the directory that
+// holds scenes/. scale shrinks the resolution of the scene xml. the results are printed as a table and written as json
+
+namespace {
+
+double millisecondsSince(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+struct RaySetResult {
+	long long rays = 0;
+	long long hits = 0;
+	double milliseconds = 0;
+	RenderCounters counters;
+};
+
+struct PathResult {
+	long long samples = 0;
+	double milliseconds = 0;
+	double meanLuminance = 0;
+	RenderCounters counters;
+};
+
+struct VariantResult {
+	std::string name;
+	bool built = false;
+	double buildMilliseconds = 0;
+	size_t nodeBytes = 0;
+	RaySetResult primary, diffuse, shadow;
+	PathResult paths;
+};
+
+struct SceneResult {
+	int modelSelect;
+	std::string name;
+	bool loaded = false;
+	double loadMilliseconds = 0;
+	size_t primitives = 0, lights = 0;
+	int width = 0, height = 0;
+	std::vector<VariantResult> variants;
+};
+
+RenderCounters sumThreadCounters()
+{
+	RenderCounters sum;
+	memset(&sum, 0, sizeof(sum));
+	for (auto& thread : allThreadCounters())
+		sum += thread;
+	return sum;
+}
+
+RaySetResult traceRays(const BVHTree& bvh, const std::vector<Ray>& rays)
+{
+	RaySetResult result;
+	int n = static_cast<int>(rays.size());
+	long long hits = 0;
+	resetThreadCounters();
+	auto start = std::chrono::steady_clock::now();
+#pragma omp parallel for schedule(dynamic, 256) reduction(+:hits)
+	for (int i = 0; i < n; i++)
+	{
+		Intersection intersection;
+		if (bvh.intersect(rays[i], intersection))
+			hits++;
+	}
+	result.milliseconds = millisecondsSince(start);
+	result.rays = n;
+	result.hits = hits;
+	result.counters = sumThreadCounters();
+	return result;
+}
+
+PathResult tracePaths(BVHTree& bvh, std::vector<PrimRef>& lightObjects, const PinholeCamera& camera, int spp, unsigned int seed)
+{
+	PathResult result;
+	int w = camera.width, h = camera.height;
+	double luminanceSum = 0;
+	srand(seed);
+	resetThreadCounters();
+	auto start = std::chrono::steady_clock::now();
+	for (int s = 0; s < spp; s++)
+	{
+#pragma omp parallel for schedule(dynamic) reduction(+:luminanceSum)
+		for (int y = 0; y < h; y++)
+		{
+			RenderCounters& counters = threadCounters();
+			for (int x = 0; x < w; x++)
+			{
+				uint64_t traced = counters.rays[0] + counters.rays[1];
+				luminanceSum += luminance(radiance(camera.ray(x, y), 0, bvh, lightObjects));
+				counters.countPath(counters.rays[0] + counters.rays[1] - traced);
+			}
+		}
+	}
+	result.milliseconds = millisecondsSince(start);
+	result.samples = static_cast<long long>(w) * h * spp;
+	result.meanLuminance = result.samples ? luminanceSum / result.samples : 0.0;
+	result.counters = sumThreadCounters();
+	return result;
+}
+
+// a random point on a light, the same distribution as sampleLight uses
+Vec lightPoint(const PrimitiveStore& prims, PrimRef light)
+{
+	if (light.type == objectType::sph)
+	{
+		const Sphere& sphere = prims.spheres[light.index];
+		float phi = PI * floatrand();
+		float sinPhi = std::sin(phi);
+		float theta = 2 * PI * floatrand();
+		return sphere.center + Vec(sinPhi * std::cos(theta), sinPhi * std::sin(theta), std::cos(phi)) * sphere.radius;
+	}
+	const Triangle& triangle = prims.triangles[light.index];
+	const Vec& v0 = prims.mesh.position(triangle.idx[0]);
+	Vec e01 = prims.mesh.position(triangle.idx[1]) - v0;
+	Vec e02 = prims.mesh.position(triangle.idx[2]) - v0;
+	float rand1 = floatrand();
+	float rand2 = floatrand();
+	if (rand1 + rand2 > 1) {
+		rand1 = 1.0f - rand1;
+		rand2 = 1.0f - rand2;
+	}
+	return v0 + e01 * rand1 + e02 * rand2;
+}
+
+// the primary rays of every pixel and the diffuse and shadow rays leaving their hits, made in order from seed
+void makeRays(const BVHTree& bvh, const std::vector<PrimRef>& lightObjects, const PinholeCamera& camera, unsigned int seed,
+	std::vector<Ray>& primary, std::vector<Ray>& diffuse, std::vector<Ray>& shadow)
+{
+	srand(seed);
+	primary.clear();
+	for (int y = 0; y < camera.height; y++)
+		for (int x = 0; x < camera.width; x++)
+			primary.push_back(camera.ray(x, y));
+
+	int n = static_cast<int>(primary.size());
+	std::vector<Intersection> hits(n);
+	std::vector<char> hit(n);
+#pragma omp parallel for schedule(dynamic, 256)
+	for (int i = 0; i < n; i++)
+		hit[i] = bvh.intersect(primary[i], hits[i]);
+
+	diffuse.clear();
+	shadow.clear();
+	for (int i = 0; i < n; i++)
+	{
+		if (!hit[i])
+			continue;
+		const Ray& r = primary[i];
+		const Intersection& intersection = hits[i];
+		// as the diffuse bounce of radiance
+		Vec w = intersection.normal.dot(r.direction) < 0 ? intersection.normal : intersection.normal * -1;
+		Vec u = ((fabs(w.x) > .1 ? Vec(0, 1) : Vec(1)).cross(w)).normalized();
+		Vec v = w.cross(u);
+		float theta = PI * floatrand(2);
+		float phi = PI * floatrand(0.5);
+		float sinphi = std::sin(phi);
+		diffuse.push_back(Ray(intersection.point, u * std::cos(theta) * sinphi + v * std::sin(theta) * sinphi + w * std::cos(phi)));
+
+		if (!lightObjects.empty())
+		{
+			PrimRef light = lightObjects[rand() % lightObjects.size()];
+			Vec target = lightPoint(*bvh.prims, light);
+			shadow.push_back(Ray(intersection.point, (target - intersection.point).normalized()));
+		}
+	}
+}
+
+std::vector<std::string> split(const std::string& text)
+{
+	std::vector<std::string> parts;
+	size_t start = 0;
+	while (start <= text.size())
+	{
+		size_t end = text.find(',', start);
+		if (end == std::string::npos)
+			end = text.size();
+		if (end > start)
+			parts.push_back(text.substr(start, end - start));
+		start = end + 1;
+	}
+	return parts;
+}
+
+double mraysPerSecond(const RaySetResult& result)
+{
+	return result.milliseconds > 0 ? result.rays / (result.milliseconds * 1000.0) : 0.0;
+}
+
+double perRay(uint64_t count, long long rays)
+{
+	return rays ? static_cast<double>(count) / rays : 0.0;
+}
+
+void writeRaySet(FILE* out, const char* name, const RaySetResult& result)
+{
+	fprintf(out, "\"%s\": {\"rays\": %lld, \"hits\": %lld, \"ms\": %.3f, \"mraysPerSecond\": %.4f, "
+		"\"nodesPerRay\": %.3f, \"primitiveTestsPerRay\": %.3f}",
+		name, result.rays, result.hits, result.milliseconds, mraysPerSecond(result),
+		perRay(result.counters.nodesVisited, result.rays),
+		perRay(result.counters.triangleTests + result.counters.sphereTests, result.rays));
+}
+
+void writeJson(FILE* out, const std::vector<SceneResult>& scenes, int threads, double scale, int spp, unsigned int seed)
+{
+	fprintf(out, "{\n  \"threads\": %d, \"scale\": %g, \"spp\": %d, \"seed\": %u,\n  \"scenes\": [", threads, scale, spp, seed);
+	for (size_t i = 0; i < scenes.size(); i++)
+	{
+		const SceneResult& scene = scenes[i];
+		fprintf(out, "%s\n    {\"scene\": \"%s\", \"modelSelect\": %d, \"loaded\": %s", i ? "," : "",
+			scene.name.c_str(), scene.modelSelect, scene.loaded ? "true" : "false");
+		if (scene.loaded)
+			fprintf(out, ", \"loadMs\": %.3f, \"primitives\": %zu, \"lights\": %zu, \"width\": %d, \"height\": %d",
+				scene.loadMilliseconds, scene.primitives, scene.lights, scene.width, scene.height);
+		fprintf(out, ", \"variants\": [");
+		for (size_t k = 0; k < scene.variants.size(); k++)
+		{
+			const VariantResult& variant = scene.variants[k];
+			fprintf(out, "%s\n      {\"bvh\": \"%s\", \"built\": %s", k ? "," : "", variant.name.c_str(), variant.built ? "true" : "false");
+			if (variant.built)
+			{
+				fprintf(out, ", \"buildMs\": %.3f, \"nodeBytes\": %zu,\n       ", variant.buildMilliseconds, variant.nodeBytes);
+				writeRaySet(out, "primary", variant.primary);
+				fprintf(out, ",\n       ");
+				writeRaySet(out, "diffuse", variant.diffuse);
+				fprintf(out, ",\n       ");
+				writeRaySet(out, "shadow", variant.shadow);
+				const PathResult& paths = variant.paths;
+				uint64_t rays = paths.counters.rays[0] + paths.counters.rays[1] + paths.counters.rays[2];
+				fprintf(out, ",\n       \"paths\": {\"samples\": %lld, \"ms\": %.3f, \"samplesPerSecond\": %.1f, \"mraysPerSecond\": %.4f, "
+					"\"raysPerSample\": %.3f, \"nodesPerRay\": %.3f, \"meanLuminance\": %.6f}",
+					paths.samples, paths.milliseconds, paths.milliseconds > 0 ? paths.samples / (paths.milliseconds / 1000.0) : 0.0,
+					paths.milliseconds > 0 ? rays / (paths.milliseconds * 1000.0) : 0.0,
+					paths.samples ? static_cast<double>(rays) / paths.samples : 0.0,
+					rays ? static_cast<double>(paths.counters.nodesVisited) / rays : 0.0, paths.meanLuminance);
+			}
+			fprintf(out, "}");
+		}
+		fprintf(out, "\n    ]}");
+	}
+	fprintf(out, "\n  ]\n}\n");
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+	std::vector<int> modelSelects = { 1, 2, 3, 4 };
+	std::vector<std::string> variantNames = { "tree", "mapped", "q16", "q8" };
+	double scale = 0.5;
+	int spp = 1;
+	unsigned int seed = 1;
+	int threads = 0;
+	std::string jsonFile = "benchmark.json";
+
+	for (int i = 1; i < argc; i++)
+	{
+		const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+		if (value == nullptr)
+		{
+			printf("missing value of %s\n", argv[i]);
+			return 1;
+		}
+		if (strcmp(argv[i], "--scenes") == 0)
+		{
+			modelSelects.clear();
+			for (auto& scene : split(value))
+				modelSelects.push_back(atoi(scene.c_str()));
+		}
+		else if (strcmp(argv[i], "--bvh") == 0)
+			variantNames = split(value);
+		else if (strcmp(argv[i], "--scale") == 0)
+			scale = atof(value);
+		else if (strcmp(argv[i], "--spp") == 0)
+			spp = atoi(value);
+		else if (strcmp(argv[i], "--seed") == 0)
+			seed = static_cast<unsigned int>(strtoul(value, nullptr, 10));
+		else if (strcmp(argv[i], "--threads") == 0)
+			threads = atoi(value);
+		else if (strcmp(argv[i], "--json") == 0)
+			jsonFile = value;
+		else
+		{
+			printf("unknown option %s\n", argv[i]);
+			return 1;
+		}
+		i++;
+	}
+#ifdef _OPENMP
+	if (threads > 0)
+		omp_set_num_threads(threads);
+	threads = omp_get_max_threads();
+#else
+	threads = 1;
+#endif
+
+	std::vector<SceneResult> scenes;
+	for (int modelSelect : modelSelects)
+	{
+		SceneResult scene;
+		scene.modelSelect = modelSelect;
+		scene.name = imageName(modelSelect).substr(1);
+
+		BenchScene loaded;
+		PrimitiveStore& prims = loaded.prims;
+		std::vector<PrimRef>& lightObjects = loaded.lightObjects;
+		auto start = std::chrono::steady_clock::now();
+		scene.loaded = loadBenchScene(modelSelect, loaded);
+		scene.loadMilliseconds = millisecondsSince(start);
+		if (!scene.loaded)
+		{
+			printf("%s: failed to load, skipped\n", scene.name.c_str());
+			scenes.push_back(scene);
+			continue;
+		}
+		scene.primitives = prims.size();
+		scene.lights = lightObjects.size();
+		scene.width = std::max(1, static_cast<int>(loaded.width * scale));
+		scene.height = std::max(1, static_cast<int>(loaded.height * scale));
+		PinholeCamera camera(loaded.cam, loaded.camUp, loaded.fovy, scene.width, scene.height);
+		printf("%s: %zu primitives, loaded in %.1f ms, %dx%d pixels\n", scene.name.c_str(), scene.primitives,
+			scene.loadMilliseconds, scene.width, scene.height);
+
+		std::vector<Ray> primary, diffuse, shadow;
+		for (auto& name : variantNames)
+		{
+			VariantResult variant;
+			variant.name = name;
+			std::string mappedFile = scene.name + ".bench.bvh";
+			std::unique_ptr<BVHTree> bvh;
+			// the build picks its split axes with rand(), every variant gets the same tree
+			srand(seed);
+			start = std::chrono::steady_clock::now();
+			if (name == "tree" || name == "q16" || name == "q8")
+			{
+				bvh.reset(new BVHTree(prims));
+				variant.built = name == "tree" || bvh->quantize(name == "q16" ? 16 : 8);
+				variant.buildMilliseconds = millisecondsSince(start);
+			}
+			else if (name == "mapped")
+			{
+				// mapping the file of a tree, what a render with bvhFile does from its second run on
+				BVHTree(prims).saveFile(mappedFile);
+				start = std::chrono::steady_clock::now();
+				bvh.reset(new BVHTree(prims, std::vector<LinearBVHNode>(), mappedFile));
+				variant.buildMilliseconds = millisecondsSince(start);
+				variant.built = bvh->isMapped();
+			}
+			else
+				printf("  unknown bvh variant %s, skipped\n", name.c_str());
+			if (!variant.built)
+			{
+				scene.variants.push_back(variant);
+				std::remove(mappedFile.c_str());
+				continue;
+			}
+			variant.nodeBytes = bvh->nodeMemoryBytes();
+
+			if (primary.empty())
+				makeRays(*bvh, lightObjects, camera, seed, primary, diffuse, shadow);
+			variant.primary = traceRays(*bvh, primary);
+			variant.diffuse = traceRays(*bvh, diffuse);
+			variant.shadow = traceRays(*bvh, shadow);
+			variant.paths = tracePaths(*bvh, lightObjects, camera, spp, seed);
+			scene.variants.push_back(variant);
+			bvh.reset();
+			std::remove(mappedFile.c_str());
+		}
+		scenes.push_back(scene);
+	}
+
+	printf("\n%-12s %-7s %9s %9s %9s %9s %9s %11s %9s\n", "scene", "bvh", "build ms", "nodes MB",
+		"primary", "diffuse", "shadow", "samples/s", "nodes/ray");
+	for (auto& scene : scenes)
+		for (auto& variant : scene.variants)
+		{
+			if (!variant.built)
+				continue;
+			const PathResult& paths = variant.paths;
+			printf("%-12s %-7s %9.1f %9.2f %9.3f %9.3f %9.3f %11.0f %9.1f\n", scene.name.c_str(), variant.name.c_str(),
+				variant.buildMilliseconds, variant.nodeBytes / (1024.0 * 1024.0),
+				mraysPerSecond(variant.primary), mraysPerSecond(variant.diffuse), mraysPerSecond(variant.shadow),
+				paths.milliseconds > 0 ? paths.samples / (paths.milliseconds / 1000.0) : 0.0,
+				perRay(variant.primary.counters.nodesVisited, variant.primary.rays));
+		}
+	printf("(rays in Mrays/s, nodes/ray of the primary rays, %d threads)\n", threads);
+
+	FILE* out = fopen(jsonFile.c_str(), "w");
+	if (out == nullptr)
+	{
+		printf("failed to write %s\n", jsonFile.c_str());
+		return 1;
+	}
+	writeJson(out, scenes, threads, scale, spp, seed);
+	fclose(out);
+	printf("results written to %s\n", jsonFile.c_str());
+	return 0;
+}
@@ -0,0 +1,336 @@
+#include "benchScene.h"
+#include "camera.h"
+#include "checkpoint.h"
+#include "imageError.h"
+#include "pathTracer.h"
+#include "region.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// image quality regression harness: renders the bundled scenes at fixed seeds and compares the image after every
+// doubling of the sample passes with a stored high spp reference, recording rmse and relMSE against render time.
+// a change to sampling or traversal should leave the converged image alone (the error keeps falling towards 0 and
+// matches the curve before the change at equal spp), and an estimator is better when it reaches an error in less
+// time: efficiency is 1 / (relMSE * seconds) of the last point.
+//
+// usage: mcpt_quality [--scenes 2,3,4] [--seeds 1,2] [--spp 64] [--seconds 0] [--scale 0.25] [--threads n]
+//                     [--references references] [--make-references 1024] [--max-relmse x] [--json quality.json]
+// the references are checkpoints, <references>/<scene>W<width>H<height>.tmpData, so any render of the scene at that
+// resolution can serve as one: --make-references n renders them here with n passes, a full resolution (--scale 1)
+// reference can also come from main with --distribute and be copied there. runs with a seed of the reference share
+// its noise and are flagged: one from main carries its renderSeed (1, as the default --seeds, so pick others), a merge
+// has seed 0 and the seeds of its workers are not known. seconds > 0 stops a run after that much
+// render time even before spp passes. the runs are repeatable for a seed with one thread, with more the threads
+// share rand() and the noise differs from run to run. with --max-relmse the exit code is 1 if any run ends above it
+//
+// the results are printed as a table and written as json
+
+namespace {
+
+// far from the seeds of the runs, so the noise of the reference has nothing to do with theirs
+const unsigned int referenceSeed = 0x5eed5eed;
+
+struct CurvePoint {
+	int spp;
+	double seconds;
+	ImageError error;
+};
+
+struct Run {
+	unsigned int seed;
+	std::vector<CurvePoint> curve;
+};
+
+struct SceneQuality {
+	std::string name;
+	bool loaded = false;
+	std::string referenceFile;
+	// passes of the reference, 0 if there is none, and its seed (0 for a merge)
+	int referenceSamples = 0;
+	unsigned int referenceSeed = 0;
+	int width = 0, height = 0;
+	std::vector<Run> runs;
+};
+
+// one sample of every pixel added to c, which holds the sum of the samples divided by smax as main accumulates it
+void renderPass(BVHTree& bvh, std::vector<PrimRef>& lightObjects, const PinholeCamera& camera, int smax,
+	std::vector<Vec>& c, std::vector<uint32_t>& pixelSamples)
+{
+	int w = camera.width, h = camera.height;
+	float recipSpp = 1.0f / smax;
+#pragma omp parallel for schedule(dynamic)
+	for (int y = 0; y < h; y++)
+		for (int x = 0; x < w; x++)
+		{
+			Vec r = radiance(camera.ray(x, y), 0, bvh, lightObjects);
+			c[y * w + x] = c[y * w + x] + r * recipSpp;
+			pixelSamples[y * w + x]++;
+		}
+}
+
+std::vector<std::string> split(const std::string& text)
+{
+	std::vector<std::string> parts;
+	size_t start = 0;
+	while (start <= text.size())
+	{
+		size_t end = text.find(',', start);
+		if (end == std::string::npos)
+			end = text.size();
+		if (end > start)
+			parts.push_back(text.substr(start, end - start));
+		start = end + 1;
+	}
+	return parts;
+}
+
+double efficiency(const CurvePoint& point)
+{
+	return point.error.relMse > 0 && point.seconds > 0 ? 1.0 / (point.error.relMse * point.seconds) : 0.0;
+}
+
+void writeJson(FILE* out, const std::vector<SceneQuality>& scenes, int threads, double scale)
+{
+	fprintf(out, "{\n  \"threads\": %d, \"scale\": %g,\n  \"scenes\": [", threads, scale);
+	for (size_t i = 0; i < scenes.size(); i++)
+	{
+		const SceneQuality& scene = scenes[i];
+		fprintf(out, "%s\n    {\"scene\": \"%s\", \"loaded\": %s, \"width\": %d, \"height\": %d, \"reference\": \"%s\", "
+			"\"referenceSamples\": %d, \"referenceSeed\": %u, \"runs\": [", i ? "," : "", scene.name.c_str(),
+			scene.loaded ? "true" : "false", scene.width, scene.height, scene.referenceFile.c_str(), scene.referenceSamples,
+			scene.referenceSeed);
+		for (size_t k = 0; k < scene.runs.size(); k++)
+		{
+			const Run& run = scene.runs[k];
+			fprintf(out, "%s\n      {\"seed\": %u", k ? "," : "", run.seed);
+			if (!run.curve.empty())
+			{
+				const CurvePoint& last = run.curve.back();
+				fprintf(out, ", \"spp\": %d, \"seconds\": %.4f, \"rmse\": %.8g, \"relMse\": %.8g, \"efficiency\": %.8g",
+					last.spp, last.seconds, last.error.rmse, last.error.relMse, efficiency(last));
+			}
+			fprintf(out, ",\n       \"curve\": [");
+			for (size_t p = 0; p < run.curve.size(); p++)
+			{
+				const CurvePoint& point = run.curve[p];
+				fprintf(out, "%s{\"spp\": %d, \"seconds\": %.4f, \"rmse\": %.8g, \"relMse\": %.8g}", p ? ", " : "",
+					point.spp, point.seconds, point.error.rmse, point.error.relMse);
+			}
+			fprintf(out, "]}");
+		}
+		fprintf(out, "\n    ]}");
+	}
+	fprintf(out, "\n  ]\n}\n");
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+	std::vector<int> modelSelects = { 1, 2, 3, 4 };
+	std::vector<unsigned int> seeds = { 1 };
+	int spp = 64;
+	double seconds = 0;
+	double scale = 0.25;
+	int threads = 0;
+	std::string referenceDir = "references";
+	int referenceSpp = 0;
+	double maxRelMse = 0;
+	std::string jsonFile = "quality.json";
+
+	for (int i = 1; i < argc; i++)
+	{
+		const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+		if (value == nullptr)
+		{
+			printf("missing value of %s\n", argv[i]);
+			return 1;
+		}
+		if (strcmp(argv[i], "--scenes") == 0)
+		{
+			modelSelects.clear();
+			for (auto& scene : split(value))
+				modelSelects.push_back(atoi(scene.c_str()));
+		}
+		else if (strcmp(argv[i], "--seeds") == 0)
+		{
+			seeds.clear();
+			for (auto& seed : split(value))
+				seeds.push_back(static_cast<unsigned int>(strtoul(seed.c_str(), nullptr, 10)));
+		}
+		else if (strcmp(argv[i], "--spp") == 0)
+			spp = std::max(1, atoi(value));
+		else if (strcmp(argv[i], "--seconds") == 0)
+			seconds = atof(value);
+		else if (strcmp(argv[i], "--scale") == 0)
+			scale = atof(value);
+		else if (strcmp(argv[i], "--threads") == 0)
+			threads = atoi(value);
+		else if (strcmp(argv[i], "--references") == 0)
+			referenceDir = value;
+		else if (strcmp(argv[i], "--make-references") == 0)
+			referenceSpp = atoi(value);
+		else if (strcmp(argv[i], "--max-relmse") == 0)
+			maxRelMse = atof(value);
+		else if (strcmp(argv[i], "--json") == 0)
+			jsonFile = value;
+		else
+		{
+			printf("unknown option %s\n", argv[i]);
+			return 1;
+		}
+		i++;
+	}
+#ifdef _OPENMP
+	if (threads > 0)
+		omp_set_num_threads(threads);
+	threads = omp_get_max_threads();
+#else
+	threads = 1;
+#endif
+
+	std::vector<SceneQuality> scenes;
+	bool failed = false;
+	for (int modelSelect : modelSelects)
+	{
+		SceneQuality quality;
+		quality.name = imageName(modelSelect).substr(1);
+		BenchScene scene;
+		quality.loaded = loadBenchScene(modelSelect, scene);
+		if (!quality.loaded)
+		{
+			printf("%s: failed to load, skipped\n", quality.name.c_str());
+			scenes.push_back(quality);
+			continue;
+		}
+		int w = quality.width = std::max(1, static_cast<int>(scene.width * scale));
+		int h = quality.height = std::max(1, static_cast<int>(scene.height * scale));
+		size_t n = static_cast<size_t>(w) * h;
+		PinholeCamera camera(scene.cam, scene.camUp, scene.fovy, w, h);
+		// the split axes of the build come from rand(), seeded as at the start of main
+		srand(1);
+		BVHTree bvh(scene.prims);
+		Region frame = { 0, 0, w, h };
+
+		char name[64];
+		snprintf(name, sizeof(name), "/%sW%dH%d.tmpData", quality.name.c_str(), w, h);
+		quality.referenceFile = referenceDir + name;
+		CheckpointInfo expect;
+		expect.width = w;
+		expect.height = h;
+		expect.sceneHash = checkpointSceneHash(modelSelect, scene.fovy, scene.cam, scene.camUp, scene.materials, scene.prims);
+
+		std::vector<Vec> c(n);
+		std::vector<uint32_t> pixelSamples(n, 0);
+		if (referenceSpp > 0)
+		{
+			printf("%s: rendering the reference, %d spp at %dx%d\n", quality.name.c_str(), referenceSpp, w, h);
+			srand(referenceSeed);
+			for (int s = 1; s <= referenceSpp; s++)
+			{
+				renderPass(bvh, scene.lightObjects, camera, referenceSpp, c, pixelSamples);
+				if (s % 16 == 0)
+					printf("  %d / %d spp\n", s, referenceSpp);
+			}
+			CheckpointInfo reference = expect;
+			reference.seed = referenceSeed;
+			reference.samples = referenceSpp;
+			reference.smax = referenceSpp;
+			if (!writeCheckpoint(quality.referenceFile, reference, c.data(), pixelSamples.data()))
+				printf("%s: failed to write %s (does the directory exist?)\n", quality.name.c_str(), quality.referenceFile.c_str());
+		}
+
+		CheckpointInfo header;
+		if (!readCheckpointInfo(quality.referenceFile, header))
+		{
+			printf("%s: no reference %s, make one with --make-references\n", quality.name.c_str(), quality.referenceFile.c_str());
+			scenes.push_back(quality);
+			continue;
+		}
+		expect.smax = header.smax;
+		if (!readCheckpoint(quality.referenceFile, expect, header, c.data(), pixelSamples.data()))
+		{
+			printf("%s: %s is not a reference of this scene at %dx%d\n", quality.name.c_str(), quality.referenceFile.c_str(), w, h);
+			scenes.push_back(quality);
+			continue;
+		}
+		quality.referenceSamples = header.samples;
+		quality.referenceSeed = header.seed;
+		std::vector<Vec> reference = regionMeans(c.data(), pixelSamples.data(), header.smax, w, frame);
+		printf("%s: reference of %d spp, %dx%d, seed %u\n", quality.name.c_str(), header.samples, w, h, header.seed);
+		// a merge does not know the seeds of its parts, main --distribute gives its workers renderSeed + k * 65536
+		if (header.seed == 0)
+			printf("  the reference is a merge of renders with their own seeds, runs with one of those seeds share its noise "
+				"and their errors come out too low\n");
+
+		for (unsigned int seed : seeds)
+		{
+			// a resumed render continues from its seed + the passes already done, so the passes of the reference
+			// may come from any seed up to that
+			if (header.seed != 0 && seed >= header.seed && seed - header.seed <= static_cast<unsigned int>(header.samples))
+				printf("  seed %u is among the seeds of the reference (%u, resumed up to %u), its errors come out too low\n",
+					seed, header.seed, header.seed + header.samples);
+			Run run;
+			run.seed = seed;
+			std::fill(c.begin(), c.end(), Vec());
+			std::fill(pixelSamples.begin(), pixelSamples.end(), 0);
+			srand(seed);
+			double renderSeconds = 0;
+			for (int s = 1; s <= spp; s++)
+			{
+				auto start = std::chrono::steady_clock::now();
+				renderPass(bvh, scene.lightObjects, camera, spp, c, pixelSamples);
+				renderSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+				bool last = s == spp || (seconds > 0 && renderSeconds >= seconds);
+				// a point per doubling of the passes, evenly spaced on the usual log-log plot
+				if ((s & (s - 1)) == 0 || last)
+				{
+					std::vector<Vec> image = regionMeans(c.data(), pixelSamples.data(), spp, w, frame);
+					run.curve.push_back({ s, renderSeconds, imageError(image.data(), reference.data(), n) });
+				}
+				if (last)
+					break;
+			}
+			const CurvePoint& end = run.curve.back();
+			printf("  seed %u: %d spp in %.2f s, rmse %.5f, relMSE %.5f\n", seed, end.spp, end.seconds, end.error.rmse, end.error.relMse);
+			if (maxRelMse > 0 && end.error.relMse > maxRelMse)
+			{
+				printf("  FAILED: relMSE %.5f is above %.5f\n", end.error.relMse, maxRelMse);
+				failed = true;
+			}
+			quality.runs.push_back(run);
+		}
+		scenes.push_back(quality);
+	}
+
+	printf("\n%-12s %10s %6s %9s %10s %10s %11s\n", "scene", "seed", "spp", "seconds", "rmse", "relMSE", "efficiency");
+	for (auto& scene : scenes)
+		for (auto& run : scene.runs)
+		{
+			const CurvePoint& end = run.curve.back();
+			printf("%-12s %10u %6d %9.2f %10.5f %10.5f %11.3f\n", scene.name.c_str(), run.seed, end.spp, end.seconds,
+				end.error.rmse, end.error.relMse, efficiency(end));
+		}
+	printf("(efficiency is 1 / (relMSE * seconds), higher reaches the same error sooner, %d threads)\n", threads);
+
+	FILE* out = fopen(jsonFile.c_str(), "w");
+	if (out == nullptr)
+	{
+		printf("failed to write %s\n", jsonFile.c_str());
+		return 1;
+	}
+	writeJson(out, scenes, threads, scale);
+	fclose(out);
+	printf("results written to %s\n", jsonFile.c_str());
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include "bvh.h"
+#include "imageOutput.h"
+#include "region.h"
+
+#include <vector>
+
+// what the camera ray of a sample hits first, filled in by radiance() when it is given one
+struct AovSample {
+	bool hit = false;
+	// diffuse color times texture, the transmittance of glass, the emission of a light
+	Vec albedo;
+	// shading normal, turned towards the camera
+	Vec normal;
+	float depth = 0.0f;
+	const tinyobj::material_t* material = nullptr;
+	PrimRef prim;
+};
+
+// arbitrary output variables: per pixel feature images of the first hits, for denoising and debugging.
+// albedo, normal and depth are the means over the samples that hit something, the ids are those of the first such sample.
+// the luminance of every sample is kept as well, for the variance of the pixels
+class AovBuffers {
+public:
+	// materials is the vector the primitives point into, ids are indices into it. primitive ids count the triangles
+	// of prims first and then the spheres
+	AovBuffers(int width, int height, const std::vector<tinyobj::material_t>& materials, const PrimitiveStore& prims);
+
+	// a sample of pixel with its radiance. not thread safe for one pixel, fine for the render loop where a pixel
+	// belongs to one thread per pass
+	void add(int pixel, const AovSample& sample, const Vec& radiance);
+
+	// the means, 0 where nothing was hit
+	Vec albedo(int pixel) const;
+	Vec normal(int pixel) const;
+	float depth(int pixel) const;
+	// -1 where nothing was hit
+	int materialId(int pixel) const { return materialIds[pixel]; }
+	int primId(int pixel) const { return primIds[pixel]; }
+	// variance of the mean luminance of the pixel, how noisy it still is. 0 below two samples
+	float variance(int pixel) const;
+
+	// A<scene>.albedo, .normal, .depth, .materialId and .primId of bounds, as settings.hdr says or pfm when that is none.
+	// the ids are written as floats, exact up to 2^24, so they always go to pfm
+	void save(int modelSelect, const Region& bounds, const OutputSettings& settings) const;
+
+	int width, height;
+
+private:
+	const tinyobj::material_t* materialBase;
+	int triangleNum;
+	std::vector<Vec> albedoSum, normalSum;
+	std::vector<float> depthSum;
+	std::vector<uint32_t> hits;
+	std::vector<float> lumSum, lumSquareSum;
+	std::vector<uint32_t> samples;
+	std::vector<int32_t> materialIds, primIds;
+};
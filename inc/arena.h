@@ -0,0 +1,87 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// bump allocator that lives as long as a scene.
+// memory is cut from big cache line aligned blocks and given back all at once by release() or the destructor,
+// the destructors of the objects created in it are never run, so only trivially destructible data goes here
+class Arena {
+public:
+	explicit Arena(size_t blockSize = 1 << 20) : blockSize(blockSize), current(nullptr), remaining(0), used(0), reserved(0) {}
+	~Arena() { release(); }
+
+	Arena(const Arena&) = delete;
+	Arena& operator=(const Arena&) = delete;
+
+	void* allocate(size_t bytes, size_t align = alignof(std::max_align_t)) {
+		size_t pad = padding(align);
+		if (current == nullptr || pad + bytes > remaining) {
+			// a request bigger than a block gets a block of its own
+			newBlock(std::max(bytes, blockSize));
+			pad = padding(align);
+		}
+		char* ret = current + pad;
+		current = ret + bytes;
+		remaining -= pad + bytes;
+		used += bytes;
+		return ret;
+	}
+
+	template <typename T, typename... Args>
+	T* create(Args&&... args) {
+		static_assert(std::is_trivially_destructible<T>::value, "Arena never runs destructors");
+		return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+	}
+
+	template <typename T>
+	T* allocArray(size_t n) {
+		static_assert(std::is_trivially_destructible<T>::value, "Arena never runs destructors");
+		return static_cast<T*>(allocate(n * sizeof(T), alignof(T)));
+	}
+
+	// one-shot teardown of everything allocated so far
+	void release() {
+		for (void* block : blocks)
+			std::free(block);
+		blocks.clear();
+		current = nullptr;
+		remaining = 0;
+		used = 0;
+		reserved = 0;
+	}
+
+	size_t bytesUsed() const { return used; }
+	size_t bytesReserved() const { return reserved; }
+
+private:
+	static constexpr size_t blockAlign = 64;
+
+	size_t padding(size_t align) const {
+		return (align - reinterpret_cast<uintptr_t>(current) % align) % align;
+	}
+
+	void newBlock(size_t bytes) {
+		// over-allocate so the start of the block can be moved to a cache line boundary
+		void* block = std::malloc(bytes + blockAlign);
+		if (block == nullptr)
+			throw std::bad_alloc();
+		blocks.push_back(block);
+		uintptr_t start = (reinterpret_cast<uintptr_t>(block) + blockAlign - 1) & ~(uintptr_t)(blockAlign - 1);
+		current = reinterpret_cast<char*>(start);
+		remaining = bytes;
+		reserved += bytes;
+	}
+
+	size_t blockSize;
+	std::vector<void*> blocks;
+	char* current;
+	size_t remaining;
+	size_t used;
+	size_t reserved;
+};
@@ -1,6 +1,10 @@
 #pragma once
 #include "third/tinyobjloader/tiny_obj_loader.h"
+#include "arena.h"
+#include "mappedFile.h"
 #include <cmath>
+#include <cstdint>
+#include <string>
 #include <vector>
 
 
@@ -32,13 +36,19 @@ struct Vec {
 };
 
 inline float vecMax(const Vec& v) { return std::max(std::max(v.x, v.y), v.z); }
+// rec. 709 luminance of a linear rgb color
+inline float luminance(const Vec& v) { return 0.2126f * v.x + 0.7152f * v.y + 0.0722f * v.z; }
 
 struct Ray {
 	Vec origin;
 	Vec direction;
 	float tMin, tMax;
+	// ray cone of the path, only used to pick texture mip levels: its width at the origin and how fast it widens
+	// per unit of distance (radians). 0, 0 is an infinitely thin ray that reads the full resolution
+	float coneWidth, coneSpread;
 	Ray(const Vec& origin = { 0,0,0 }, const Vec& direction = { 0,0,0 }, float tMin = 1e-6, float tMax = 1e10)
-		: origin(origin), direction(direction), tMin(tMin), tMax(tMax) {}
+		: origin(origin), direction(direction), tMin(tMin), tMax(tMax), coneWidth(0), coneSpread(0) {}
+	Ray cone(float width, float spread) const { Ray r = *this; r.coneWidth = width; r.coneSpread = spread; return r; }
 	// ϾԭΪtĵ
 	Vec at(float t) const { return origin + direction * t; }
 };
@@ -64,45 +74,93 @@ enum objectType : int
 	sph = 20
 };
 
+// reference to a primitive: which typed array of the PrimitiveStore and the index in it
+struct PrimRef {
+	objectType type;
+	int index;
+	PrimRef(objectType type = objectType::tri, int index = -1) : type(type), index(index) {}
+};
+
 class BVHTree;
-class Object;
+class PrimitiveStore;
 
 struct Intersection {
 	float t; // ߲
 	tinyobj::material_t* material;
-	Object* object;
+	PrimRef prim;
+	// barycentric coordinates of the hit in a triangle: the weights of its second and third vertex, 0 for a sphere
+	float u, v;
 	Vec point; // λ
 	Vec normal; // 㴦ķ
 
 	// ĬϹ캯
-	Intersection() : t(INFINITY), material(nullptr), object(nullptr) {}
+	Intersection() : t(INFINITY), material(nullptr), u(0), v(0) {}
 
 	// ȽϺ
 	bool operator<(const Intersection& other) const { return t < other.t; }
 };
 
+enum class TextureFilter : int
+{
+	nearest,	// one texel of the full resolution image
+	bilinear,	// 4 texels of the mip level closest to the ray footprint
+	trilinear	// 8 texels, blended between the two mip levels around the footprint
+};
+
+enum class TextureLayout : int
+{
+	scanline,	// rows of c channel texels, as stbi_load gives them
+	tiled		// 4x4 texel tiles of 4 channels (grey spread over rgb), one 64 byte cache line per tile
+};
+
+// one level of a mip pyramid
+struct MipLevel {
+	int w, h;
+	// tiles per row in the tiled layout, 0 for scanlines
+	int tilesX;
+	unsigned char* photo;
+};
+
+class TextureCache;
+
 struct Texture
 {
 	int w, h, c;
+	// the full resolution image, laid out like levels[0]. nullptr when the texels come from a TextureCache
 	unsigned char* photo;
+	// levels[0] is the image itself, every next level halves both sides down to 1x1 (PrimitiveStore::setPixels)
+	int levelNum;
+	MipLevel* levels;
+	// set for a texture paged from a tile file, the levels then have sizes but no pixels
+	TextureCache* cache;
+	int cacheFile;
 	Texture(int width, int height, int channels, unsigned char* photoData) :
-		w(width), h(height), c(channels), photo(photoData) {}
+		w(width), h(height), c(channels), photo(photoData), levelNum(0), levels(nullptr), cache(nullptr), cacheFile(-1) {}
+
+	// lod is log2 of the ray footprint in texels of the full resolution image, ignored by nearest
+	Vec sample(float u, float v, float lod, TextureFilter filter) const;
+
+	bool tiled() const { return levelNum > 0 && levels[0].tilesX != 0; }
+	// bytes of one texel of a level and where texel x, y of it is stored
+	int texelBytes(const MipLevel& level) const { return level.tilesX != 0 ? 4 : c; }
+	const unsigned char* texelAddress(const MipLevel& level, int x, int y) const {
+		if (level.tilesX == 0)
+			return level.photo + c * (static_cast<size_t>(y) * level.w + x);
+		size_t tile = static_cast<size_t>(y >> 2) * level.tilesX + (x >> 2);
+		return level.photo + 4 * (16 * tile + 4 * (y & 3) + (x & 3));
+	}
+	// the full resolution image as w * h scanline texels of c channels, whatever the layout
+	void copyScanline(unsigned char* out) const;
+
+private:
+	Vec texel(const MipLevel& level, int x, int y) const;
+	Vec bilinear(const MipLevel& level, float u, float v) const;
 };
 
+// data shared by every primitive, there is no virtual function:
+// primitives live by value in the typed arrays of PrimitiveStore and are dispatched by PrimRef
 class Object {
 public:
-	virtual AABB getBoundingBox() = 0;
-	// computer the intersection
-	virtual bool intersect(const Ray& ray, Intersection& intersection) = 0;
-	// while it is a light object, sample it from a intersection
-	virtual float sampleLight(const Vec& point, const BVHTree& bvh) = 0;
-
-	virtual float getArea() = 0;
-
-	virtual objectType getType() = 0;
-
-	virtual Vec getTextureByPoint(const Vec& point) = 0;
-
 	tinyobj::material_t* material;
 	Texture* texture;
 };
@@ -126,38 +184,105 @@ public:
 	}
 
 
-	virtual AABB getBoundingBox()override;
-	virtual bool intersect(const Ray& ray, Intersection& intersection) override;
-	virtual float sampleLight(const Vec& point, const BVHTree& bvh) override;
-	virtual float getArea() override;
-	virtual Vec getTextureByPoint(const Vec& point) override;
-	objectType getType() override { return objectType::sph; }
+	AABB getBoundingBox() const;
+	// computer the intersection
+	bool intersect(const Ray& ray, Intersection& intersection) const;
+	// while it is a light object, sample it from a intersection
+	float sampleLight(const Vec& point, const BVHTree& bvh) const;
+	float getArea() const;
+	Vec getTextureByPoint(const Vec& point) const;
+	objectType getType() const { return objectType::sph; }
 };
 
+// vertex buffers shared by all the triangles of the scene.
+// every vertex has a position and a uv (0,0 when the obj shape has no texcoords)
+struct TriangleMesh {
+	std::vector<Vec> positions;
+	std::vector<float> texcoords;
+
+	uint32_t addVertex(const float p[3], float u = 0, float v = 0) {
+		positions.push_back(Vec(p));
+		texcoords.push_back(u);
+		texcoords.push_back(v);
+		return static_cast<uint32_t>(positions.size() - 1);
+	}
+	const Vec& position(uint32_t i) const { return positions[i]; }
+	Vec uv(uint32_t i) const { return Vec(texcoords[2 * i], texcoords[2 * i + 1], 0); }
+	size_t memoryBytes() const { return positions.size() * sizeof(Vec) + texcoords.size() * sizeof(float); }
+};
+
+// a triangle only keeps the index triple into the TriangleMesh of its PrimitiveStore
 class Triangle : public Object {
 public:
-	Vec v0, v1, v2;
-	Vec uv0, uv1, uv2;
-	Triangle(float f0[3], float f1[3], float f2[3],Vec uvv0,Vec uvv1,Vec uvv2, tinyobj::material_t* mat, Texture* tex = nullptr) :
-		v0(f0), v1(f1), v2(f2), uv0(uvv0), uv1(uvv1), uv2(uvv2) {
+	uint32_t idx[3];
+	Triangle(uint32_t i0, uint32_t i1, uint32_t i2, tinyobj::material_t* mat, Texture* tex = nullptr) {
+		idx[0] = i0;
+		idx[1] = i1;
+		idx[2] = i2;
 		material = mat;
 		texture = tex;
 	}
 
-	Triangle(const Vec& v0, const Vec& v1, const Vec& v2,tinyobj::material_t* mat) :
-		v0(v0), v1(v1), v2(v2){
-		material = mat;
-		texture = nullptr;
+	AABB getBoundingBox(const TriangleMesh& mesh) const;
+	bool intersect(const TriangleMesh& mesh, const Ray& ray, Intersection& intersection) const;
+	float sampleLight(const TriangleMesh& mesh, const Vec& point, const BVHTree& bvh) const;
+	float getArea(const TriangleMesh& mesh) const;
+	// texture at the barycentric coordinates u, v of a hit (see Intersection),
+	// footprint: width of the ray cone on the surface there, in world units
+	Vec getTexture(const TriangleMesh& mesh, float u, float v, float footprint, TextureFilter filter) const;
+	Vec getNormal(const TriangleMesh& mesh) const {
+		const Vec& v0 = mesh.position(idx[0]);
+		return (mesh.position(idx[1]) - v0).cross(mesh.position(idx[2]) - v0).normalized();
+	}
+
+	objectType getType() const { return objectType::tri; }
+};
+
+// owns every primitive of the scene, one array per type.
+// the BVH leaves only keep a PrimRef, calls are dispatched by a switch on the type
+class PrimitiveStore {
+public:
+	TriangleMesh mesh;
+	std::vector<Triangle> triangles;
+	std::vector<Sphere> spheres;
+	// textures and their pixels, freed together with the scene
+	Arena arena;
+
+	PrimitiveStore() {}
+	PrimitiveStore(const PrimitiveStore&) = delete;
+	PrimitiveStore& operator=(const PrimitiveStore&) = delete;
+
+	// every texture created by addTexture, in creation order
+	std::vector<Texture*> textures;
+	// how getTexture reads the textures
+	TextureFilter textureFilter = TextureFilter::trilinear;
+	// how the textures created from now on store their texels
+	TextureLayout textureLayout = TextureLayout::scanline;
+
+	Texture* addTexture(int width, int height, int channels, const unsigned char* data) {
+		textures.push_back(arena.create<Texture>(0, 0, 0, nullptr));
+		setPixels(textures.back(), width, height, channels, data);
+		return textures.back();
 	}
+	// gives texture a copy of the scanline image data in textureLayout and builds its mip levels, all in the arena
+	void setPixels(Texture* texture, int width, int height, int channels, const unsigned char* data);
 
-	virtual AABB getBoundingBox()override;
-	virtual bool intersect(const Ray& ray, Intersection& intersection) override;
-	virtual float sampleLight(const Vec& point, const BVHTree& bvh) override;
-	virtual float getArea()override;
-	virtual Vec getTextureByPoint(const Vec& point) override;
-	Vec getNormal() { return (v1 - v0).cross(v2 - v0).normalized(); }
+	PrimRef add(const Triangle& triangle) { triangles.push_back(triangle); return PrimRef(objectType::tri, static_cast<int>(triangles.size()) - 1); }
+	PrimRef add(const Sphere& sphere) { spheres.push_back(sphere); return PrimRef(objectType::sph, static_cast<int>(spheres.size()) - 1); }
+	size_t size() const { return triangles.size() + spheres.size(); }
 
-	virtual objectType getType() override { return objectType::tri; }
+	const Object& get(PrimRef ref) const {
+		if (ref.type == objectType::tri) return triangles[ref.index];
+		return spheres[ref.index];
+	}
+
+	AABB getBoundingBox(PrimRef ref) const;
+	bool intersect(PrimRef ref, const Ray& ray, Intersection& intersection) const;
+	float sampleLight(PrimRef ref, const Vec& point, const BVHTree& bvh) const;
+	float getArea(PrimRef ref) const;
+	// texture color where intersection hit its primitive.
+	// footprint: width of the ray cone there, 0 reads the full resolution
+	Vec getTexture(const Intersection& intersection, float footprint = 0) const;
 };
 
 
@@ -166,18 +291,91 @@ public:
 	AABB box; // AABBʾΧ
 	BVHNode* left; // 
 	BVHNode* right; // 
-	Object* object; // ָ
+	PrimRef prim; // ָ
 	bool isLeaf; // ǷΪҶڵ
 
-	BVHNode(std::vector<Object*>& objects, int start, int end);
+	BVHNode(std::vector<PrimRef>& refs, const PrimitiveStore& prims, Arena& arena, int start, int end);
+	BVHNode() : left(nullptr), right(nullptr), isLeaf(false) {}
+};
+
+// pointer free copy of a BVHNode tree, stored depth first: an inner node is directly followed by
+// its left subtree and secondChild is the index of its right child. a leaf has secondChild == -1
+struct LinearBVHNode {
+	float min[3], max[3];
+	int32_t secondChild;
+	int32_t primType;
+	int32_t primIndex;
+};
+
+// compressed inner node: the boxes of both children are stored with Q (uint8_t or uint16_t) per coordinate,
+// as a number of steps of (parent extent / max(Q)) inward from the parent box, rounded outward so they stay conservative.
+// traversal dequantizes the child boxes on the fly from the already dequantized parent box
+template <typename Q>
+struct QuantizedBVHNode {
+	Q lo[2][3]; // steps from parent min up to child min
+	Q hi[2][3]; // steps from parent max down to child max
+	// >= 0: index of an inner node; < 0: leaf, -(child + 1) is an index into QuantizedBVH::leafPrims
+	int32_t child[2];
+};
+
+template <typename Q>
+class QuantizedBVH {
+public:
+	AABB rootBox;
+	std::vector<QuantizedBVHNode<Q>> nodes;
+	std::vector<PrimRef> leafPrims;
+
+	void build(const BVHNode* root);
+	bool intersect(const BVHTree& bvh, const Ray& ray, Intersection& intersection) const;
+	size_t memoryBytes() const { return nodes.size() * sizeof(QuantizedBVHNode<Q>) + leafPrims.size() * sizeof(PrimRef); }
+
+private:
+	int32_t buildNode(const BVHNode* node, const AABB& box);
 };
 
 class BVHTree {
 public:
 	BVHNode* root;
-	BVHTree(std::vector<Object*>& objects) { root = new BVHNode(objects, 0, objects.size()); }
+	const PrimitiveStore* prims;
+	// every BVHNode is allocated here, depth first, and freed with the tree
+	Arena arena;
+	BVHTree(const PrimitiveStore& prims);
+	// rebuild the tree from flattened nodes (e.g. read from a cache) instead of sorting the primitives again.
+	// with a mappedFile, the nodes of that file are traversed in place if it matches prims,
+	// otherwise the tree is built as usual and written there for the next run
+	BVHTree(const PrimitiveStore& prims, const std::vector<LinearBVHNode>& nodes, const std::string& mappedFile = "");
+
+	void flatten(std::vector<LinearBVHNode>& nodes) const;
+
+	// flat file of LinearBVHNode behind a small header, made to be mapped by mapFile
+	bool saveFile(const std::string& path) const;
+	// map a file written by saveFile and traverse it without any deserialization. the file is checked against prims first:
+	// primitive counts, tree structure, every primitive in exactly one leaf and every box enclosing its children
+	bool mapFile(const std::string& path);
+	bool isMapped() const { return linearNodes != nullptr; }
+
+	// 0: traverse the BVHNode tree, 8 or 16: build and traverse the quantized nodes instead
+	bool quantize(int bits);
+	int quantizedBits() const { return quantBits; }
+	size_t nodeMemoryBytes() const;
 
 	bool intersect(const Ray& ray, Intersection& intersection) const;
+	// test one primitive and keep it in intersection if it is the nearest so far
+	bool intersectLeaf(PrimRef prim, const Ray& ray, Intersection& intersection) const;
 	void depthInfo(BVHNode* root, int depth, int& maxdepth, int& alldepth)const;
+
+private:
+	// sort the primitives of prims into a new tree
+	void build();
+	bool intersectLinear(const Ray& ray, Intersection& intersection) const;
+
+	// nodes of a mapped file, root is nullptr while they are used
+	MappedFile mapping;
+	const LinearBVHNode* linearNodes = nullptr;
+	int32_t linearNodeNum = 0;
+
+	int quantBits = 0;
+	QuantizedBVH<uint8_t> qbvh8;
+	QuantizedBVH<uint16_t> qbvh16;
 };
 
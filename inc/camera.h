@@ -0,0 +1,28 @@
+#pragma once
+#include "bvh.h"
+
+// the camera of the scene xml: eye and view direction in cam, fovy the half angle of the view in degrees.
+// pixel 0, 0 is the left bottom one, as in c and the bitmap
+class PinholeCamera {
+public:
+	PinholeCamera(const Ray& cam, const Vec& camUp, float fovy, int width, int height);
+
+	// the ray through a random point of pixel x, y, two floatrand() per call
+	Ray ray(int x, int y) const
+	{
+		float r1 = floatrand(1) - 0.5;
+		float r2 = floatrand(1) - 0.5;
+		Vec d = cxIncure * (r1 + x - width / 2) +
+			cyIncure * (r2 + y - height / 2) + czIncure;
+		return Ray(origin + d, d.normalized()).cone(cyIncure.length(), pixelSpread);
+	}
+
+	int width, height;
+
+private:
+	Vec origin;
+	// xyz increment;
+	Vec cyIncure, cxIncure, czIncure;
+	// angle a pixel covers, the spread of the ray cones of the camera rays
+	float pixelSpread;
+};
@@ -0,0 +1,92 @@
+#pragma once
+#include "bvh.h"
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// the progressive accumulation saved to tmpData while rendering, so a render can be resumed or merged with another one.
+// c holds the sum of the samples divided by smax, pixelSamples how many samples each pixel got.
+// the file starts with a header naming the render it belongs to and ends the header with a checksum of the whole file,
+// a resume is refused unless resolution, scene hash and seed all match
+struct CheckpointInfo {
+	int width = 0, height = 0;
+	// checkpointSceneHash of the scene and camera
+	uint64_t sceneHash = 0;
+	// seed of the first sample pass
+	uint32_t seed = 0;
+	// sample passes done
+	int samples = 0;
+	// the pass count the accumulation is normalized to
+	int smax = 0;
+};
+
+// tmpData/<scene>W<width>H<height>.tmpData
+std::string checkpointPath(int modelSelect, int width, int height);
+
+// hash of everything that changes the image of a pixel: camera, materials and the extent and size of the geometry
+uint64_t checkpointSceneHash(int modelSelect, float fovy, const Ray& cam, const Vec& camUp,
+	const std::vector<tinyobj::material_t>& materials, const PrimitiveStore& prims);
+
+// c and pixelSamples hold info.width * info.height entries. written to fileName.tmp and renamed over fileName,
+// so a crash while writing leaves the previous checkpoint as it was
+bool writeCheckpoint(const std::string& fileName, const CheckpointInfo& info, const Vec c[], const uint32_t pixelSamples[]);
+
+// the header of a checkpoint, false if it is not one of this version
+bool readCheckpointInfo(const std::string& fileName, CheckpointInfo& info);
+
+// reads a checkpoint of the render described by expect into c and pixelSamples and rescales it to expect.smax.
+// false, leaving c and pixelSamples alone, if the file is missing, damaged or belongs to another render
+// (a sceneHash or seed of 0 in expect matches any). info gets the header of the file
+bool readCheckpoint(const std::string& fileName, const CheckpointInfo& expect, CheckpointInfo& info, Vec c[], uint32_t pixelSamples[]);
+
+// writes checkpoints on a thread of its own from a copy of the accumulation, so the render threads go on while it reaches
+// the disk. when snapshots come faster than the disk takes them, only the newest one waiting is written
+class CheckpointWriter {
+public:
+	// called on the writer thread with the snapshot once it is written, e.g. to save a bitmap of it
+	typedef std::function<void(const CheckpointInfo& info, const Vec c[], const uint32_t pixelSamples[])> Saved;
+
+	CheckpointWriter();
+	// writes the snapshot still waiting, if any
+	~CheckpointWriter();
+
+	CheckpointWriter(const CheckpointWriter&) = delete;
+	CheckpointWriter& operator=(const CheckpointWriter&) = delete;
+
+	// copies c and pixelSamples (info.width * info.height each) and returns. with an empty fileName only saved runs
+	void submit(const std::string& fileName, const CheckpointInfo& info, const Vec c[], const uint32_t pixelSamples[],
+		const Saved& saved = Saved());
+
+	// blocks until everything submitted so far is written
+	void wait();
+	// time the writer thread spent on the snapshots done so far (the files and the saved runs), and how many there were
+	double milliseconds();
+	size_t writes();
+
+private:
+	struct Snapshot {
+		std::string fileName;
+		CheckpointInfo info;
+		std::vector<Vec> c;
+		std::vector<uint32_t> pixelSamples;
+		Saved saved;
+	};
+
+	void work();
+
+	// pending is filled by submit, the writer swaps it with writing and writes that without holding the lock
+	Snapshot pending, writing;
+	bool hasPending;
+	bool busy;
+	bool stopping;
+	size_t dropped;
+	double busyMilliseconds;
+	size_t writeCount;
+	std::mutex lock;
+	std::condition_variable submitted, written;
+	std::thread worker;
+};
@@ -0,0 +1,22 @@
+#pragma once
+#include "aov.h"
+
+#include <vector>
+
+struct DenoiseSettings {
+	// passes of the filter, pass i reads taps 2^i pixels apart, 5 passes reach 2 * (1 + 2 + 4 + 8 + 16) = 62 pixels
+	int iterations = 5;
+	// how many standard deviations of a pixel's noise a neighbour's luminance may differ by and still count
+	float sigmaColor = 4.0f;
+	// exponent on the cosine between the normals
+	float sigmaNormal = 128.0f;
+	// how far off the depth gradient a neighbour may lie
+	float sigmaDepth = 1.0f;
+};
+
+// edge-avoiding a-trous wavelet filter (Dammertz et al. 2010) with the luminance weights scaled by the per-pixel
+// variance as in SVGF (Schied et al. 2017): noisy pixels are smoothed hard, converged ones and edges in the
+// normals, depth and albedo are kept. the illumination is filtered, i.e. color divided by albedo, so textures stay sharp.
+// color is the mean image of bounds (see regionMeans), aovs the buffers of the same render; rows run in parallel
+void denoise(const std::vector<Vec>& color, const AovBuffers& aovs, const Region& bounds, std::vector<Vec>& result,
+	const DenoiseSettings& settings = DenoiseSettings());
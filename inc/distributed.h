@@ -0,0 +1,21 @@
+#pragma once
+#include "checkpoint.h"
+
+#include <string>
+#include <vector>
+
+// one frame rendered by several processes: every worker renders sample passes of its own with a seed of its own into a
+// checkpoint, and the checkpoints are merged into one image, weighted by the samples every pixel really got.
+// workers on other machines are started by hand with --worker, their checkpoints brought over and merged with --merge
+
+// merges checkpoints of the same scene and resolution into output (its seed is 0, it mixes several).
+// inputs that can't be read, belong to another render or repeat a seed already merged are left out with a message.
+// image gets the mean of every pixel, info the header of output. false if nothing was merged
+bool mergeCheckpoints(const std::vector<std::string>& inputs, const std::string& output, std::vector<Vec>& image, CheckpointInfo& info);
+
+// runs workers copies of program with --worker, each rendering passes sample passes on threads threads (0 shares the
+// hardware threads out) into tmpData/<scene>Worker<i>.tmpData. worker i gets seed baseSeed + (i + 1) * 65536, far
+// enough apart that a resumed worker (which reseeds with its seed + the passes done) never takes another one's seed.
+// whenever a worker finishes, the checkpoints so far are merged into tmpData/<scene>Merged.tmpData and the bitmap of
+// the scene. false if no worker finished
+bool runDistributed(const std::string& program, int modelSelect, int workers, int passes, unsigned int baseSeed, int threads = 0);
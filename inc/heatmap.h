@@ -0,0 +1,44 @@
+#pragma once
+#include "bvh.h"
+#include "region.h"
+#include "stats.h"
+
+#include <vector>
+
+// which rays of a sample the traversal cost heatmap counts
+enum class HeatmapRays : int
+{
+	none,		// no heatmap, render as usual
+	primary,	// the camera ray only, one bvh walk per sample
+	paths		// the whole path of the sample: camera, extension and shadow rays
+};
+
+// blue (0) over cyan, green and yellow to red (1), t is clamped
+Vec falseColor(float t);
+
+// the bvh work of the rays of every pixel, for finding the parts of a scene that are expensive to trace.
+// it is taken from the counters of the thread (see RenderCounters) before and after the rays of a sample
+class TraversalHeatmap {
+public:
+	TraversalHeatmap(int width, int height);
+
+	// one sample of pixel: what the counters of the calling thread gained since before was copied. not thread safe
+	// for one pixel, fine for the render loop where a pixel belongs to one thread per pass
+	void add(int pixel, const RenderCounters& before);
+
+	// means per sample
+	float nodes(int pixel) const;
+	float primitiveTests(int pixel) const;
+	float rays(int pixel) const;
+
+	// A<scene>.heatmap.nodes.bmp and .tests.bmp of bounds in false color, red at the 99th percentile of the region so a
+	// few outliers don't wash the rest out, and A<scene>.heatmap.pfm with the mean nodes, primitive tests and rays per
+	// sample in r, g and b. prints the means and the scales of the bitmaps
+	void save(int modelSelect, const Region& bounds) const;
+
+	int width, height;
+
+private:
+	std::vector<float> nodeSum, testSum, raySum;
+	std::vector<uint32_t> samples;
+};
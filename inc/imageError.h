@@ -0,0 +1,14 @@
+#pragma once
+#include "bvh.h"
+
+#include <cstddef>
+
+// how far an image is from a reference of the same size, over all pixels and channels
+struct ImageError {
+	double rmse = 0;
+	// mean of (x - ref)^2 / (ref^2 + epsilon), relative so dark and bright parts of the image count alike
+	double relMse = 0;
+};
+
+// n pixels of image against the same n of reference, the pixels are summed in parallel
+ImageError imageError(const Vec image[], const Vec reference[], size_t n, double epsilon = 1e-2);
@@ -0,0 +1,53 @@
+#pragma once
+#include "bvh.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// linear float images written straight from the accumulator, next to the 8 bit bitmap, for compositing and tonemapping
+// elsewhere. image is width * height rgb, rows from the bottom up like c
+enum class HdrFormat : int
+{
+	none,
+	pfm,	// portable float map: raw 32 bit floats
+	exr		// OpenEXR scanline file of 16 bit half floats, optionally run length compressed
+};
+
+enum class Tonemap : int
+{
+	clamp,		// values above 1 are cut off, as the bitmap always was
+	reinhard,	// x / (1 + x) per channel, highlights roll off and never clip
+	aces		// Narkowicz's fit of the ACES filmic curve, more contrast than reinhard
+};
+
+// how the images of a render are written
+struct OutputSettings {
+	// for the bitmap only, the float images stay linear
+	Tonemap tonemap = Tonemap::clamp;
+	// in stops, the linear values are scaled by 2^exposure before tonemapping
+	float exposure = 0.0f;
+	HdrFormat hdr = HdrFormat::none;
+	// run length compression of the exr lines
+	bool hdrCompress = true;
+};
+
+// the pixel data of a 24 bit bitmap: bgr rows padded to 4 bytes, every value scaled by scale, exposed, tonemapped and
+// gamma encoded, rounded as toInt does. the rows are done in parallel, the gamma curve comes from a table
+void encodeBitmap(const Vec c[], int width, int height, float scale, const OutputSettings& settings, std::vector<uint8_t>& data);
+
+// nearest half float, rounded to even. too large values become infinity, nan stays nan
+uint16_t floatToHalf(float f);
+
+bool savePFM(const std::string& fileName, const Vec image[], int width, int height);
+
+// compress: every scanline is run length encoded the way OpenEXR's RLE_COMPRESSION does it (kept raw when that
+// doesn't make it smaller). the lines are converted and encoded in parallel and written in order
+bool saveEXR(const std::string& fileName, const Vec image[], int width, int height, bool compress = true);
+
+// A<scene>, the name of the images of a scene without extension
+std::string imageName(int modelSelect);
+
+// A<scene><suffix>.pfm or .exr, named like the bitmap. nothing for HdrFormat::none
+bool saveHdr(int modelSelect, HdrFormat format, const Vec image[], int width, int height, bool compress = true,
+	const std::string& suffix = "");
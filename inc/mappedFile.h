@@ -0,0 +1,65 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+
+// read-only memory mapping of a whole file (MapViewOfFile on windows, mmap elsewhere)
+class MappedFile {
+public:
+	MappedFile() : ptr(nullptr), length(0), handle(nullptr) {}
+	~MappedFile() { close(); }
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool open(const std::string& path);
+	void close();
+	void swap(MappedFile& other) {
+		std::swap(ptr, other.ptr);
+		std::swap(length, other.length);
+		std::swap(handle, other.handle);
+	}
+
+	// drop the pages of [offset, offset + size) from the memory of the process, they are read from the file again
+	// if touched. only a hint, for a file read once from front to back
+	void release(size_t offset, size_t size);
+
+	bool isOpen() const { return ptr != nullptr; }
+	const char* data() const { return ptr; }
+	size_t size() const { return length; }
+
+private:
+	const char* ptr;
+	size_t length;
+	// the file mapping object on windows, unused elsewhere
+	void* handle;
+};
+
+// a file read at any offset, from any number of threads at once through one handle
+// (pread, ReadFile with an offset on windows). the position of the handle is never used
+class RandomAccessFile {
+public:
+	RandomAccessFile() : handle(nullptr) {}
+	~RandomAccessFile() { close(); }
+
+	RandomAccessFile(const RandomAccessFile&) = delete;
+	RandomAccessFile& operator=(const RandomAccessFile&) = delete;
+
+	bool open(const std::string& path);
+	void close();
+	bool isOpen() const { return handle != nullptr; }
+	// false unless all size bytes at offset were read
+	bool read(uint64_t offset, size_t size, void* out) const;
+
+private:
+	// the file handle on windows, the descriptor + 1 elsewhere
+	void* handle;
+};
+
+// a name next to path for writing a file that is renamed over path once complete. it holds the id of the process,
+// so processes writing the same file at once (the workers of --distribute on a cold cache) never share one
+std::string tmpFileName(const std::string& path);
+
+// size and last modification time of a file, false if it can't be found
+bool fileStamp(const std::string& path, uint64_t& size, int64_t& mtime);
@@ -1,8 +1,10 @@
 #pragma once
 
 #include "bvh.h"
+#include "imageOutput.h"
 #include "third/tinyobjloader/tiny_obj_loader.h"
 
+class TextureLoader;
 
 inline float clamp(float x) { return x < 0 ? 0 : x>1 ? 1 : x; }
 inline Vec clamp(Vec v) {
@@ -12,14 +14,19 @@ inline Vec clamp(Vec v) {
 }
 inline int toInt(float x) { return int(pow(clamp(x), 1 / 2.2) * 255 + .5); }
 
+// the textures are only requested from textures, they have no pixels before its finish()
 bool transferTinyobjToTriangle(std::vector<tinyobj::shape_t>& shapes,
-	std::vector<Object*>& objects,
-	std::vector<Object*>& lightObjects,
+	PrimitiveStore& prims,
+	std::vector<PrimRef>& lightObjects,
 	std::vector<tinyobj::material_t>& materials,
+	TextureLoader& textures,
 	int detailPrint = 0);
 
 bool printInfo(const std::vector<tinyobj::shape_t>& shapes, const std::vector<tinyobj::material_t>& materials, bool triangulate = true, int detail = false);
 
+// obj, its directory and the xml camera file of a scene, false for an unknown modelSelect
+bool scenePaths(int modelSelect, std::string& objFile, std::string& basePath, std::string& xmlFile);
+
 bool xmlCameraAndCorrectMaterial(int modelSelect, int& width, int& height, float& fovy, Ray& cam, Vec& camUp, std::vector<tinyobj::material_t>& materials, int detailPrint = 0);
 
 bool loadObj(const char* fileName,
@@ -27,13 +34,25 @@ bool loadObj(const char* fileName,
 	std::vector<tinyobj::material_t>& materials,
 	const char* basePath = NULL,
 	int detailPrint = true,
-	unsigned int flags = 1);
+	unsigned int flags = 1,
+	bool parallelParse = true);
 
 bool objLoader(int modelSelect,
 	std::vector<tinyobj::shape_t>& shapes,
 	std::vector<tinyobj::material_t>& materials,
 	int detailPrint);
 
+// loads a scene straight into prims through streamObjToPrimitives.
+// the textures are only requested from textures, they have no pixels before its finish()
+bool objStreamLoader(int modelSelect,
+	std::vector<tinyobj::material_t>& materials,
+	PrimitiveStore& prims,
+	TextureLoader& textures,
+	int detailPrint);
+
+// the lights transferTinyobjToTriangle would have listed for prims
+void collectLights(const PrimitiveStore& prims, std::vector<PrimRef>& lightObjects);
+
 
 #pragma pack(push, 1)
 struct BitmapFileHeader {
@@ -65,14 +84,13 @@ struct Bitmap {
 };
 #pragma pack(pop)
 
-void writeArrToFile(const int modelSelect, const Vec c[],const int spp, const int smax, const int width, const int height,std::string fileName = "");
-
-bool readArrFromFile(const int modelSelect, Vec c[], int& spp, int& smax,const int width, const int height, std::string fileName = "");
-
-void save_bitmap(const int modelSelect, const Vec c[], const int width, const int height, float completePercent = 1.0, std::string fileName = "");
+// rows padded to 4 bytes as the format wants, so any width works. c is divided by completePercent and then
+// exposed, tonemapped and gamma encoded as settings say
+void save_bitmap(const int modelSelect, const Vec c[], const int width, const int height, float completePercent = 1.0, std::string fileName = "",
+	const OutputSettings& settings = OutputSettings());
 
-// save file according to completePercent;
-void fixFile(const int modelSelect, int smax, float completePercent);
+// bitmap of the checkpoint of a width x height render, however far it got
+void fixFile(const int modelSelect, const int width, const int height);
 
-// merge two tmpData file and give a pitcutre "unclear.bmp"
-bool mergeFile(const char* file1, const char* file2, const char* outputFile, const int width, const int height,int &smax,float completePercent = 1.0);
+// merge two checkpoints of one scene rendered with different seeds (see mergeCheckpoints) and give a pitcutre "unclear_image.bmp"
+bool mergeFile(const char* file1, const char* file2, const char* outputFile);
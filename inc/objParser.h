@@ -0,0 +1,37 @@
+#pragma once
+#include "third/tinyobjloader/tiny_obj_loader.h"
+#include "bvh.h"
+
+#include <functional>
+#include <string>
+#include <vector>
+
+// drop-in for tinyobj::LoadObj that gives the same shapes and materials.
+// the obj is mapped and cut into chunks at line boundaries, the vertex and face lines of the chunks are parsed
+// in parallel and then stitched together in file order, where groups, usemtl and mtllib are handled as tinyobj does.
+// chunks is the number of pieces to cut the file into, 0 picks one per hardware thread (times a few, for balance)
+bool parallelLoadObj(std::vector<tinyobj::shape_t>& shapes,
+	std::vector<tinyobj::material_t>& materials,
+	std::string& err,
+	const char* fileName,
+	const char* mtlBasePath = NULL,
+	unsigned int flags = 1,
+	int chunks = 0);
+
+// streaming alternative to LoadObj + transferTinyobjToTriangle, no tinyobj shape is ever built: the chunks are parsed
+// a few at a time (one per thread) and their faces become triangles of prims before the next ones are parsed, so the
+// faces of only a few chunks are alive at once. the positions and texcoords of the whole file are kept until the end,
+// as a face may use any vertex before it.
+// prims.mesh gets one vertex per distinct (position, texcoord) pair, normals are not kept.
+// loadTexture(materialId) gives the texture of the triangles of a material whose corners all have texcoords,
+// it is called once per material, the first time such a triangle is seen.
+// shapeStart receives the index of the first triangle of every g/o shape, faces without a material are skipped.
+// the triangles point into materials, it must not change size afterwards
+bool streamObjToPrimitives(const char* fileName,
+	const char* mtlBasePath,
+	std::vector<tinyobj::material_t>& materials,
+	PrimitiveStore& prims,
+	std::vector<size_t>& shapeStart,
+	std::string& err,
+	const std::function<Texture*(int)>& loadTexture,
+	int chunks = 0);
@@ -0,0 +1,9 @@
+#pragma once
+#include "aov.h"
+#include "bvh.h"
+
+#include <vector>
+
+// the light coming back along r. depth is the number of surfaces the path hit before r, 0 for camera rays.
+// aov, given for camera rays only, receives what the ray hits first
+Vec radiance(const Ray& r, int depth, BVHTree& bvh, std::vector<PrimRef>& lightObjects, AovSample* aov = nullptr);
@@ -0,0 +1,32 @@
+#pragma once
+#include "bvh.h"
+#include "imageOutput.h"
+
+#include <vector>
+
+// a rectangle of pixels to render, x0 <= x < x1 and y0 <= y < y1, y counted from the bottom row as c and the bitmap are
+struct Region {
+	int x0, y0, x1, y1;
+};
+
+// a run of pixels of one row, the unit of work of a sample pass
+struct PixelSpan {
+	int y, x0, x1;
+};
+
+// the pixels of the union of regions, clipped to the frame, as runs sorted by row. a pixel covered by several
+// regions is in one run only. the whole frame, a run per row, when regions is empty
+std::vector<PixelSpan> regionSpans(const std::vector<Region>& regions, int width, int height);
+
+// the smallest region holding all spans
+Region spanBounds(const std::vector<PixelSpan>& spans);
+
+// the mean of every pixel of bounds, row by row: c (the sum of the samples divided by smax) divided by the samples
+// of the pixel, 0 where it has none
+std::vector<Vec> regionMeans(const Vec c[], const uint32_t pixelSamples[], int smax, int width, const Region& bounds);
+
+// saves bounds of c as the bitmap of the scene, and as a float image if settings ask for one. every pixel is divided by
+// its own sample count (c holds the sum of the samples divided by smax), so pixels that got different numbers of samples
+// come out right; no samples is black
+void saveRegionImage(int modelSelect, const Vec c[], const uint32_t pixelSamples[], int smax, int width, const Region& bounds,
+	const OutputSettings& settings = OutputSettings());
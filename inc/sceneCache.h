@@ -0,0 +1,24 @@
+#pragma once
+#include "bvh.h"
+
+#include <string>
+#include <vector>
+
+// binary snapshot of everything main() builds before rendering: camera, materials, geometry, decoded textures and the bvh.
+// it lives in tmpData/<scene>.sceneCache and remembers the size and modification time of every input file
+// (obj, mtl, xml, textures), so touching any of them makes loadSceneCache fail and the scene is parsed again
+
+// true if an up to date cache was read, everything is left empty otherwise
+bool loadSceneCache(int modelSelect, int& width, int& height, float& fovy, Ray& cam, Vec& camUp,
+	std::vector<tinyobj::material_t>& materials,
+	PrimitiveStore& prims,
+	std::vector<PrimRef>& lightObjects,
+	std::vector<LinearBVHNode>& bvhNodes,
+	int detailPrint = 0);
+
+// materials must be the vector the primitives of prims point into. nothing is saved while textures are paged from a TextureCache
+bool saveSceneCache(int modelSelect, int width, int height, float fovy, const Ray& cam, const Vec& camUp,
+	const std::vector<tinyobj::material_t>& materials,
+	const PrimitiveStore& prims,
+	const std::vector<PrimRef>& lightObjects,
+	const std::vector<LinearBVHNode>& bvhNodes);
@@ -0,0 +1,83 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+enum class RayKind : int {
+	// from the camera through a pixel
+	camera,
+	// the next segment of a path after a bounce
+	extension,
+	// from a surface towards a point on a light
+	shadow
+};
+
+// what the render threads did, each thread counts into its own block (see threadCounters) so nothing is shared
+// while rendering. rays are counted where they are traced, the bvh counts its own work per intersect call
+struct RenderCounters {
+	// paths with more segments go into the last bucket
+	static const int maxPathLength = 8;
+
+	uint64_t rays[3];
+	// bvh nodes (leaves included) whose box a ray entered
+	uint64_t nodesVisited;
+	uint64_t triangleTests;
+	uint64_t sphereTests;
+	// camera samples by the number of segments (camera and extension rays) of their path, 0: none traced
+	uint64_t pathLengths[maxPathLength + 1];
+
+	void countRay(RayKind kind) { rays[static_cast<int>(kind)]++; }
+	void countPath(uint64_t segments) { pathLengths[segments < maxPathLength ? segments : maxPathLength]++; }
+	uint64_t paths() const;
+	RenderCounters& operator+=(const RenderCounters& other);
+};
+
+// the counters of the calling thread, zeroed when the thread first asks. they stay alive after the thread exits
+RenderCounters& registerThreadCounters();
+inline RenderCounters& threadCounters()
+{
+	thread_local RenderCounters* counters = &registerThreadCounters();
+	return *counters;
+}
+
+// the counters of every thread that counted so far, in the order they first did
+std::vector<RenderCounters> allThreadCounters();
+// zeroes the counters of all threads. not while other threads are counting
+void resetThreadCounters();
+
+// wall time spent in the stages of a run (load, bvh build, render, io, ...) together with the thread counters,
+// printed as a table and written as json at the end of the run
+class RenderStats {
+public:
+	// times a stage until end() or the next begin(), a stage that runs more than once adds up
+	void begin(const std::string& stage);
+	void end();
+	// time of a stage measured elsewhere, e.g. of a background thread, over runs runs. it overlaps the stages timed
+	// by begin() and end(), so it is listed apart and left out of the total
+	void add(const std::string& stage, double milliseconds, int runs = 1);
+	double milliseconds(const std::string& stage) const;
+
+	// a value of the run to go into the report, e.g. the scene and the samples per pixel
+	void set(const std::string& key, const std::string& value);
+	void set(const std::string& key, double value);
+
+	// the stages, the sums of the thread counters and the balance of the threads
+	void print() const;
+	// the same as json, with every thread listed. false if path can't be written
+	bool writeJson(const std::string& path) const;
+
+private:
+	struct Stage {
+		std::string name;
+		double milliseconds;
+		int runs;
+		bool background;
+	};
+
+	std::vector<Stage> stages;
+	std::vector<std::pair<std::string, std::string>> values;
+	// the stage begin() started, -1 for none
+	int current = -1;
+	std::chrono::steady_clock::time_point started;
+};
@@ -0,0 +1,90 @@
+#pragma once
+#include "bvh.h"
+#include "mappedFile.h"
+
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// texels of textures that are not kept in memory: every image is converted once into a file of square rgba tiles
+// for all its mip levels (tmpData/<image>.<hash>.tiles, rebuilt when the image changes), and the tiles the render
+// touches are read from there on demand. at most budgetBytes of tiles stay in memory, the least recently used
+// tile of a shard goes first. the tiles are spread over independently locked shards so render threads rarely wait,
+// and every thread keeps copies of the last tiles it used (threadTileNum of them, 256 KB with 32x32 tiles, on top
+// of the budget), so the texels of a filter footprint are mostly read without a lock. tile files are read outside the
+// locks, through one handle per file
+class TextureCache {
+public:
+	explicit TextureCache(size_t budgetBytes, int tileSize = 32);
+
+	TextureCache(const TextureCache&) = delete;
+	TextureCache& operator=(const TextureCache&) = delete;
+
+	// the tile file of an image, decoded and written if it is missing or older than the image.
+	// safe to call from several threads for different images, false if the image can't be decoded
+	bool prepare(const std::string& imagePath, std::string& tileFile);
+
+	// makes texture read its texels from a prepared tile file through this cache: sizes and mip levels are filled in,
+	// there are no pixels. false if the file can't be read (it is kept open until the cache goes). not safe while
+	// other threads fetch
+	bool attach(const std::string& tileFile, Texture* texture, PrimitiveStore& prims);
+
+	// rgba of texel x, y of a mip level
+	void fetch(int file, int level, int x, int y, unsigned char rgba[4]);
+
+	void printStats() const;
+
+private:
+	struct Tile {
+		uint64_t key;
+		std::vector<unsigned char> texels;
+	};
+
+	struct Shard {
+		std::mutex lock;
+		// most recently used first
+		std::list<Tile> lru;
+		std::unordered_map<uint64_t, std::list<Tile>::iterator> tiles;
+		size_t bytes = 0;
+		size_t peakBytes = 0;
+		uint64_t hits = 0, misses = 0, evictions = 0, readErrors = 0;
+	};
+
+	// fetches of one thread and how many of them its own tiles served, only written by that thread
+	struct ThreadStats {
+		uint64_t fetches = 0, hits = 0;
+	};
+	struct ThreadTiles;
+	static ThreadTiles& threadTiles();
+	// copies tile key into out, from its shard or else from the tile file
+	void loadTile(uint64_t key, int file, uint64_t offset, unsigned char* out);
+
+	struct LevelInfo {
+		int w, h, tilesX;
+		uint64_t offset;
+	};
+
+	struct FileInfo {
+		std::string path;
+		std::vector<LevelInfo> levels;
+		std::unique_ptr<RandomAccessFile> file;
+	};
+
+	static const int shardNum = 16;
+	static const int threadTileNum = 64;
+
+	size_t budget;
+	int tileSize;
+	size_t tileBytes;
+	std::vector<FileInfo> files;
+	Shard shards[shardNum];
+	// tells the tiles a thread copied from this cache from those of an earlier one at the same address
+	uint64_t generation;
+	std::mutex threadLock;
+	std::deque<ThreadStats> threadStats;
+};
@@ -0,0 +1,67 @@
+#pragma once
+#include "bvh.h"
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class TextureCache;
+
+// decodes the texture images of a scene on a small pool of worker threads while the rest of the scene is built.
+// every path is decoded once, however many materials use it. request() hands out the Texture at once, its pixels
+// only arrive in finish(), so nothing may read a requested texture before finish() returned
+class TextureLoader {
+public:
+	// threads: most decodes running at once, 0 for one per hardware thread. workers are started by the first requests.
+	// with a cache the images are turned into its tile files instead and the textures read through it
+	explicit TextureLoader(int threads = 0, TextureCache* cache = nullptr);
+	~TextureLoader();
+
+	TextureLoader(const TextureLoader&) = delete;
+	TextureLoader& operator=(const TextureLoader&) = delete;
+
+	// the Texture of path in prims, decoding starts in the background the first time a path is asked for
+	Texture* request(const std::string& path, PrimitiveStore& prims);
+
+	// waits for the decodes, copies the pixels into the arena of prims and takes the textures that failed to load
+	// off the primitives (as if they had none) and off prims.textures
+	void finish(PrimitiveStore& prims, int detailPrint = 0);
+
+private:
+	struct Job {
+		std::string path;
+		Texture* texture;
+		// stbi_load result, handed over to the arena by finish()
+		unsigned char* data;
+		int w, h, c;
+		// set instead of data when the texture goes through the cache
+		std::string tileFile;
+		bool prepared;
+		bool failed;
+		bool done;
+		double milliseconds;
+	};
+
+	void work();
+
+	int maxThreads;
+	TextureCache* cache;
+	std::vector<std::thread> workers;
+	std::vector<std::unique_ptr<Job>> jobs;
+	std::map<std::string, Job*> byPath;
+	std::deque<Job*> queue;
+	std::mutex lock;
+	std::condition_variable queued, decoded;
+	size_t doneNum;
+	size_t reused;
+	bool stopping;
+};
+
+// texel fetch throughput of every texture of prims, laid out as scanlines and as tiles, printed as a table.
+// both coherent (a texel or so apart, as neighbouring pixels) and random uv sequences are timed
+void benchmarkTexelFetch(const PrimitiveStore& prims, int fetches = 1 << 22);
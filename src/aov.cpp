@@ -0,0 +1,82 @@
+#include "aov.h"
+
+#include <algorithm>
+
+
+AovBuffers::AovBuffers(int width, int height, const std::vector<tinyobj::material_t>& materials, const PrimitiveStore& prims) :
+	width(width), height(height), materialBase(materials.data()), triangleNum(static_cast<int>(prims.triangles.size()))
+{
+	size_t n = static_cast<size_t>(width) * height;
+	albedoSum.resize(n);
+	normalSum.resize(n);
+	depthSum.resize(n, 0.0f);
+	hits.resize(n, 0);
+	lumSum.resize(n, 0.0f);
+	lumSquareSum.resize(n, 0.0f);
+	samples.resize(n, 0);
+	materialIds.resize(n, -1);
+	primIds.resize(n, -1);
+}
+
+void AovBuffers::add(int pixel, const AovSample& sample, const Vec& radiance)
+{
+	float lum = luminance(radiance);
+	lumSum[pixel] += lum;
+	lumSquareSum[pixel] += lum * lum;
+	samples[pixel]++;
+	if (!sample.hit)
+		return;
+	albedoSum[pixel] = albedoSum[pixel] + sample.albedo;
+	normalSum[pixel] = normalSum[pixel] + sample.normal;
+	depthSum[pixel] += sample.depth;
+	if (hits[pixel]++ == 0)
+	{
+		materialIds[pixel] = sample.material != nullptr ? static_cast<int32_t>(sample.material - materialBase) : -1;
+		primIds[pixel] = sample.prim.type == objectType::sph ? triangleNum + sample.prim.index : sample.prim.index;
+	}
+}
+
+Vec AovBuffers::albedo(int pixel) const
+{
+	return hits[pixel] != 0 ? albedoSum[pixel] * (1.0f / hits[pixel]) : Vec();
+}
+
+Vec AovBuffers::normal(int pixel) const
+{
+	// the mean of unit normals is shorter on edges, it stays that way so edges show
+	return hits[pixel] != 0 ? normalSum[pixel] * (1.0f / hits[pixel]) : Vec();
+}
+
+float AovBuffers::depth(int pixel) const
+{
+	return hits[pixel] != 0 ? depthSum[pixel] / hits[pixel] : 0.0f;
+}
+
+float AovBuffers::variance(int pixel) const
+{
+	uint32_t n = samples[pixel];
+	if (n < 2)
+		return 0.0f;
+	float mean = lumSum[pixel] / n;
+	return std::max(lumSquareSum[pixel] / n - mean * mean, 0.0f) / (n - 1);
+}
+
+void AovBuffers::save(int modelSelect, const Region& bounds, const OutputSettings& settings) const
+{
+	int w = bounds.x1 - bounds.x0, h = bounds.y1 - bounds.y0;
+	if (w <= 0 || h <= 0)
+		return;
+	HdrFormat format = settings.hdr == HdrFormat::none ? HdrFormat::pfm : settings.hdr;
+	std::vector<Vec> image(static_cast<size_t>(w) * h);
+	auto write = [&](const char* name, HdrFormat fmt, Vec(*value)(const AovBuffers&, int)) {
+		for (int y = 0; y < h; y++)
+			for (int x = 0; x < w; x++)
+				image[static_cast<size_t>(y) * w + x] = value(*this, (bounds.y0 + y) * width + bounds.x0 + x);
+		saveHdr(modelSelect, fmt, image.data(), w, h, settings.hdrCompress, name);
+	};
+	write(".albedo", format, [](const AovBuffers& aov, int i) { return aov.albedo(i); });
+	write(".normal", format, [](const AovBuffers& aov, int i) { return aov.normal(i); });
+	write(".depth", format, [](const AovBuffers& aov, int i) { float d = aov.depth(i); return Vec(d, d, d); });
+	write(".materialId", HdrFormat::pfm, [](const AovBuffers& aov, int i) { float id = static_cast<float>(aov.materialId(i)); return Vec(id, id, id); });
+	write(".primId", HdrFormat::pfm, [](const AovBuffers& aov, int i) { float id = static_cast<float>(aov.primId(i)); return Vec(id, id, id); });
+}
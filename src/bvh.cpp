@@ -1,7 +1,12 @@
 #include "bvh.h"
+#include "stats.h"
+#include "textureCache.h"
 
 #include <stack>
 #include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <limits>
 
 
 bool AABB::intersect(const Ray& ray) const {
@@ -54,7 +59,7 @@ AABB AABB::merge(const AABB& a, const AABB& b) {
 }
 
 
-BVHNode::BVHNode(std::vector<Object*>& objects, int start, int end) {
+BVHNode::BVHNode(std::vector<PrimRef>& refs, const PrimitiveStore& prims, Arena& arena, int start, int end) {
 	// 캯Ϊʼλ
 	int axis = rand() % 3; // ѡָ
 	int numTriangles = end - start;
@@ -62,40 +67,352 @@ BVHNode::BVHNode(std::vector<Object*>& objects, int start, int end) {
 	if (numTriangles == 1) {
 		// ֻһֱӽöΪҶڵ
 		isLeaf = true;
-		object = objects[start];
-		box = object->getBoundingBox();
+		prim = refs[start];
+		box = prims.getBoundingBox(prim);
 		left = right = nullptr;
 	}
 	else if (numTriangles == 2) {
 		// ֻ󣬽Ϊ
 		isLeaf = false;
-		left = new BVHNode(objects, start, start + 1);
-		right = new BVHNode(objects, start + 1, end);
+		left = arena.create<BVHNode>(refs, prims, arena, start, start + 1);
+		right = arena.create<BVHNode>(refs, prims, arena, start + 1, end);
 		box = AABB::merge(left->box, right->box);
 	}
 	else {
 		// ж󣬰շָǽ
 		// Ϊlambdaʽ
-		std::sort(objects.begin() + start, objects.begin() + end, [axis](Object* a, Object* b) {
-			return a->getBoundingBox().min[axis] < b->getBoundingBox().min[axis];
+		std::sort(refs.begin() + start, refs.begin() + end, [axis, &prims](PrimRef a, PrimRef b) {
+			return prims.getBoundingBox(a).min[axis] < prims.getBoundingBox(b).min[axis];
 			});
 
 		// ֳ飬ֱ
 		int mid = start + numTriangles / 2;
-		left = new BVHNode(objects, start, mid);
-		right = new BVHNode(objects, mid, end);
+		left = arena.create<BVHNode>(refs, prims, arena, start, mid);
+		right = arena.create<BVHNode>(refs, prims, arena, mid, end);
 		box = AABB::merge(left->box, right->box);
 		isLeaf = false;
 	}
 }
 
 
+BVHTree::BVHTree(const PrimitiveStore& prims) : prims(&prims)
+{
+	build();
+}
+
+void BVHTree::build()
+{
+	std::vector<PrimRef> refs;
+	refs.reserve(prims->size());
+	for (int i = 0; i < static_cast<int>(prims->triangles.size()); i++)
+		refs.push_back(PrimRef(objectType::tri, i));
+	for (int i = 0; i < static_cast<int>(prims->spheres.size()); i++)
+		refs.push_back(PrimRef(objectType::sph, i));
+	root = arena.create<BVHNode>(refs, *prims, arena, 0, static_cast<int>(refs.size()));
+}
+
+
+static int32_t flattenNode(const BVHNode* node, std::vector<LinearBVHNode>& nodes)
+{
+	int32_t index = static_cast<int32_t>(nodes.size());
+	nodes.push_back(LinearBVHNode());
+	LinearBVHNode& linear = nodes[index];
+	linear.min[0] = node->box.min.x; linear.min[1] = node->box.min.y; linear.min[2] = node->box.min.z;
+	linear.max[0] = node->box.max.x; linear.max[1] = node->box.max.y; linear.max[2] = node->box.max.z;
+	linear.secondChild = -1;
+	linear.primType = node->isLeaf ? node->prim.type : 0;
+	linear.primIndex = node->isLeaf ? node->prim.index : -1;
+	if (!node->isLeaf) {
+		flattenNode(node->left, nodes);
+		int32_t second = flattenNode(node->right, nodes);
+		nodes[index].secondChild = second;
+	}
+	return index;
+}
+
+static BVHNode* unflattenNode(const std::vector<LinearBVHNode>& nodes, int32_t index, Arena& arena)
+{
+	const LinearBVHNode& linear = nodes[index];
+	BVHNode* node = arena.create<BVHNode>();
+	node->box = AABB(Vec(linear.min), Vec(linear.max));
+	node->isLeaf = linear.secondChild < 0;
+	if (node->isLeaf) {
+		node->prim = PrimRef(static_cast<objectType>(linear.primType), linear.primIndex);
+	}
+	else {
+		node->left = unflattenNode(nodes, index + 1, arena);
+		node->right = unflattenNode(nodes, linear.secondChild, arena);
+	}
+	return node;
+}
+
+BVHTree::BVHTree(const PrimitiveStore& prims, const std::vector<LinearBVHNode>& nodes, const std::string& mappedFile) :
+	root(nullptr), prims(&prims)
+{
+	if (!mappedFile.empty() && mapFile(mappedFile))
+		return;
+
+	if (nodes.empty())
+		build();
+	else
+		root = unflattenNode(nodes, 0, arena);
+
+	if (!mappedFile.empty())
+		saveFile(mappedFile);
+}
+
+void BVHTree::flatten(std::vector<LinearBVHNode>& nodes) const
+{
+	nodes.clear();
+	if (linearNodes != nullptr)
+		nodes.assign(linearNodes, linearNodes + linearNodeNum);
+	else
+		flattenNode(root, nodes);
+}
+
+
+// bump it whenever LinearBVHNode or this header changes
+static const uint32_t bvhFileVersion = 1;
+static const char bvhFileMagic[8] = { 'M', 'C', 'P', 'T', 'B', 'V', 'H', '\0' };
+static const uint32_t bvhByteOrderMark = 0x01020304;
+
+// 64 bytes so the nodes behind it start on a cache line of the (page aligned) mapping
+struct BVHFileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t byteOrder;
+	uint32_t nodeSize;
+	uint32_t nodeNum;
+	uint32_t triangleNum;
+	uint32_t sphereNum;
+	float min[3], max[3];
+	uint32_t reserved[2];
+};
+static_assert(sizeof(BVHFileHeader) == 64, "BVHFileHeader is written as raw bytes");
+
+bool BVHTree::saveFile(const std::string& path) const
+{
+	std::vector<LinearBVHNode> nodes;
+	flatten(nodes);
+	if (nodes.empty())
+		return false;
+
+	BVHFileHeader header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, bvhFileMagic, sizeof(bvhFileMagic));
+	header.version = bvhFileVersion;
+	header.byteOrder = bvhByteOrderMark;
+	header.nodeSize = sizeof(LinearBVHNode);
+	header.nodeNum = static_cast<uint32_t>(nodes.size());
+	header.triangleNum = static_cast<uint32_t>(prims->triangles.size());
+	header.sphereNum = static_cast<uint32_t>(prims->spheres.size());
+	std::memcpy(header.min, nodes[0].min, sizeof(header.min));
+	std::memcpy(header.max, nodes[0].max, sizeof(header.max));
+
+	// written next to the target (under a name of this process) and renamed, a process mapping the old file keeps its copy
+	std::string tmpPath = tmpFileName(path);
+	std::ofstream file(tmpPath, std::ios::binary);
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	file.write(reinterpret_cast<const char*>(nodes.data()), nodes.size() * sizeof(LinearBVHNode));
+	file.close();
+	if (!file) {
+		std::remove(tmpPath.c_str());
+		return false;
+	}
+	std::remove(path.c_str());
+	return std::rename(tmpPath.c_str(), path.c_str()) == 0;
+}
+
+static inline bool boxContains(const LinearBVHNode& outer, const AABB& inner)
+{
+	for (int a = 0; a < 3; a++) {
+		// the boxes were merged from the same floats, a tiny slack only absorbs -0/+0 and fmin/fmax quirks
+		float slack = 1e-6f * std::max(std::abs(outer.min[a]), std::abs(outer.max[a]));
+		if (inner.min[a] < outer.min[a] - slack || inner.max[a] > outer.max[a] + slack)
+			return false;
+	}
+	return true;
+}
+
+static bool validLinearNodes(const LinearBVHNode* nodes, int32_t nodeNum, const PrimitiveStore& prims)
+{
+	std::vector<char> triangleSeen(prims.triangles.size(), 0), sphereSeen(prims.spheres.size(), 0);
+	std::vector<char> nodeSeen(nodeNum, 0);
+	// (node, depth), intersectLinear has a fixed stack of 128 entries so deeper trees are refused
+	std::vector<std::pair<int32_t, int>> stack(1, std::make_pair(0, 0));
+	int32_t visited = 0;
+	while (!stack.empty()) {
+		int32_t index = stack.back().first;
+		int depth = stack.back().second;
+		stack.pop_back();
+		if (depth > 100)
+			return false;
+		// children always come after their parent, so a node reached twice means a broken file, not a cycle
+		if (nodeSeen[index])
+			return false;
+		nodeSeen[index] = 1;
+		visited++;
+
+		const LinearBVHNode& node = nodes[index];
+		for (int a = 0; a < 3; a++)
+			if (!std::isfinite(node.min[a]) || !std::isfinite(node.max[a]) || node.min[a] > node.max[a])
+				return false;
+		if (node.secondChild < 0) {
+			std::vector<char>* seen = node.primType == objectType::tri ? &triangleSeen :
+				node.primType == objectType::sph ? &sphereSeen : nullptr;
+			if (seen == nullptr || node.primIndex < 0 || node.primIndex >= static_cast<int32_t>(seen->size()) || (*seen)[node.primIndex])
+				return false;
+			(*seen)[node.primIndex] = 1;
+			if (!boxContains(node, prims.getBoundingBox(PrimRef(static_cast<objectType>(node.primType), node.primIndex))))
+				return false;
+			continue;
+		}
+
+		if (node.secondChild <= index + 1 || node.secondChild >= nodeNum)
+			return false;
+		for (int32_t child : { index + 1, node.secondChild }) {
+			const LinearBVHNode& c = nodes[child];
+			if (!boxContains(node, AABB(Vec(c.min), Vec(c.max))))
+				return false;
+			stack.push_back(std::make_pair(child, depth + 1));
+		}
+	}
+	// every node reachable from the root and every primitive in a leaf
+	return visited == nodeNum &&
+		std::find(triangleSeen.begin(), triangleSeen.end(), 0) == triangleSeen.end() &&
+		std::find(sphereSeen.begin(), sphereSeen.end(), 0) == sphereSeen.end();
+}
+
+bool BVHTree::mapFile(const std::string& path)
+{
+	MappedFile file;
+	if (!file.open(path) || file.size() < sizeof(BVHFileHeader))
+		return false;
+
+	BVHFileHeader header;
+	std::memcpy(&header, file.data(), sizeof(header));
+	if (std::memcmp(header.magic, bvhFileMagic, sizeof(bvhFileMagic)) != 0 || header.version != bvhFileVersion ||
+		header.byteOrder != bvhByteOrderMark || header.nodeSize != sizeof(LinearBVHNode) || header.nodeNum == 0 ||
+		file.size() != sizeof(BVHFileHeader) + static_cast<size_t>(header.nodeNum) * sizeof(LinearBVHNode))
+	{
+		printf("bvh file %s is from another version or incomplete\n", path.c_str());
+		return false;
+	}
+	if (header.triangleNum != prims->triangles.size() || header.sphereNum != prims->spheres.size())
+	{
+		printf("bvh file %s was built for %u triangles and %u spheres, the scene has %zd and %zd\n", path.c_str(),
+			header.triangleNum, header.sphereNum, prims->triangles.size(), prims->spheres.size());
+		return false;
+	}
+
+	const LinearBVHNode* nodes = reinterpret_cast<const LinearBVHNode*>(file.data() + sizeof(BVHFileHeader));
+	int32_t nodeNum = static_cast<int32_t>(header.nodeNum);
+	if (std::memcmp(header.min, nodes[0].min, sizeof(header.min)) != 0 || std::memcmp(header.max, nodes[0].max, sizeof(header.max)) != 0 ||
+		!validLinearNodes(nodes, nodeNum, *prims))
+	{
+		printf("bvh file %s does not match the primitives of the scene\n", path.c_str());
+		return false;
+	}
+
+	// the file is good, drop whatever tree there was and traverse the mapping from now on
+	mapping.swap(file);
+	arena.release();
+	root = nullptr;
+	quantize(0);
+	linearNodes = nodes;
+	linearNodeNum = nodeNum;
+	return true;
+}
+
+bool BVHTree::quantize(int bits)
+{
+	qbvh8 = QuantizedBVH<uint8_t>();
+	qbvh16 = QuantizedBVH<uint16_t>();
+	quantBits = 0;
+
+	// a single primitive has no inner node to compress, a mapped file is traversed as it is
+	if (root == nullptr || root->isLeaf || (bits != 8 && bits != 16))
+		return bits == 0;
+
+	if (bits == 8)
+		qbvh8.build(root);
+	else
+		qbvh16.build(root);
+	quantBits = bits;
+	return true;
+}
+
+size_t BVHTree::nodeMemoryBytes() const
+{
+	if (quantBits == 8)
+		return qbvh8.memoryBytes();
+	if (quantBits == 16)
+		return qbvh16.memoryBytes();
+	if (linearNodes != nullptr)
+		return linearNodeNum * sizeof(LinearBVHNode);
+	return arena.bytesUsed();
+}
+
+namespace {
+
+// the work of one intersect call, added to the counters of the thread when the call returns
+struct TraversalWork {
+	uint32_t nodes = 0, triangles = 0, spheres = 0;
+
+	void leaf(PrimRef prim) {
+		nodes++;
+		if (prim.type == objectType::tri)
+			triangles++;
+		else
+			spheres++;
+	}
+
+	~TraversalWork() {
+		RenderCounters& counters = threadCounters();
+		counters.nodesVisited += nodes;
+		counters.triangleTests += triangles;
+		counters.sphereTests += spheres;
+	}
+};
+
+}
+
+bool BVHTree::intersectLeaf(PrimRef prim, const Ray& ray, Intersection& intersection) const
+{
+	Intersection temp;
+	if (!prims->intersect(prim, ray, temp))
+		return false;
+	temp.prim = prim;
+
+	// if two face conplane but temp is a light
+	if (std::abs(intersection.t - temp.t) < 1e-3 && temp.t) {
+		if (floatMax(temp.material->emission) > floatMax(intersection.material->emission)) {
+			intersection = temp;
+			return true;
+		}
+	}
+	// 1e-3 ensure the ray go out a triangle
+	else if (temp.t < intersection.t && temp.t> 1e-3) {
+		intersection = temp;
+		return true;
+	}
+	return false;
+}
+
 bool BVHTree::intersect(const Ray& ray, Intersection& intersection) const {
+	if (quantBits == 8)
+		return qbvh8.intersect(*this, ray, intersection);
+	if (quantBits == 16)
+		return qbvh16.intersect(*this, ray, intersection);
+	if (linearNodes != nullptr)
+		return intersectLinear(ray, intersection);
+
 	// жϹBVHĽ
 	if (!root->box.intersect(ray)) {
 		return false;
 	}
 
+	TraversalWork work;
 	bool hit = false;
 	std::stack<BVHNode*> stack;
 	stack.push(root);
@@ -104,26 +421,13 @@ bool BVHTree::intersect(const Ray& ray, Intersection& intersection) const {
 		stack.pop();
 
 		if (node->isLeaf) {
+			work.leaf(node->prim);
 			// Ҷڵ㣬Ƿཻ
-			Intersection temp;
-			if (node->object->intersect(ray, temp)) {
-
-				// if two face conplane but temp is a light
-				if (abs(intersection.t - temp.t) < 1e-3 && temp.t) {
-					if (floatMax(temp.material->emission) > floatMax(intersection.material->emission)) {
-						intersection = temp;
-						hit = true;
-						continue;
-					}
-				}
-				// 1e-3 ensure the ray go out a triangle
-				else if (temp.t < intersection.t && temp.t> 1e-3) {
-					intersection = temp;
-					hit = true;
-				}
-			}
+			if (intersectLeaf(node->prim, ray, intersection))
+				hit = true;
 		}
 		else {
+			work.nodes++;
 			// Ҷڵ㣬ջ
 			if (node->left->box.intersect(ray)) {
 				stack.push(node->left);
@@ -136,6 +440,162 @@ bool BVHTree::intersect(const Ray& ray, Intersection& intersection) const {
 	return hit;
 }
 
+// same walk as above over the mapped nodes: left child at index + 1, right child at secondChild
+bool BVHTree::intersectLinear(const Ray& ray, Intersection& intersection) const
+{
+	if (!AABB(Vec(linearNodes[0].min), Vec(linearNodes[0].max)).intersect(ray))
+		return false;
+
+	TraversalWork work;
+	bool hit = false;
+	// the tree is a median split, its depth is about log2 of the primitive count
+	int32_t stack[128];
+	int top = 0;
+	stack[top++] = 0;
+	while (top > 0) {
+		int32_t index = stack[--top];
+		const LinearBVHNode& node = linearNodes[index];
+
+		if (node.secondChild < 0) {
+			PrimRef prim(static_cast<objectType>(node.primType), node.primIndex);
+			work.leaf(prim);
+			if (intersectLeaf(prim, ray, intersection))
+				hit = true;
+		}
+		else {
+			work.nodes++;
+			const LinearBVHNode& left = linearNodes[index + 1];
+			const LinearBVHNode& right = linearNodes[node.secondChild];
+			if (AABB(Vec(left.min), Vec(left.max)).intersect(ray))
+				stack[top++] = index + 1;
+			if (AABB(Vec(right.min), Vec(right.max)).intersect(ray))
+				stack[top++] = node.secondChild;
+		}
+	}
+	return hit;
+}
+
+// child box of a quantized node, min is counted up from the parent min and max down from the parent max,
+// so the extreme steps give back the parent bounds exactly
+template <typename Q>
+static inline AABB dequantize(const AABB& parent, const Vec& scale, const Q lo[3], const Q hi[3])
+{
+	return AABB(
+		Vec(parent.min.x + scale.x * lo[0], parent.min.y + scale.y * lo[1], parent.min.z + scale.z * lo[2]),
+		Vec(parent.max.x - scale.x * hi[0], parent.max.y - scale.y * hi[1], parent.max.z - scale.z * hi[2]));
+}
+
+// size of one quantization step along each axis of box
+template <typename Q>
+static inline Vec quantizationStep(const AABB& box)
+{
+	return (box.max - box.min) * (1.0f / static_cast<float>(std::numeric_limits<Q>::max()));
+}
+
+template <typename Q>
+void QuantizedBVH<Q>::build(const BVHNode* root)
+{
+	nodes.clear();
+	leafPrims.clear();
+	rootBox = root->box;
+	buildNode(root, rootBox);
+}
+
+// box is the dequantized box of node as traversal will see it, children are quantized against it
+template <typename Q>
+int32_t QuantizedBVH<Q>::buildNode(const BVHNode* node, const AABB& box)
+{
+	if (node->isLeaf) {
+		leafPrims.push_back(node->prim);
+		return -static_cast<int32_t>(leafPrims.size());
+	}
+
+	const float steps = static_cast<float>(std::numeric_limits<Q>::max());
+	int32_t index = static_cast<int32_t>(nodes.size());
+	nodes.push_back(QuantizedBVHNode<Q>());
+
+	const BVHNode* children[2] = { node->left, node->right };
+	const Vec scale = quantizationStep<Q>(box);
+	AABB childBoxes[2];
+	for (int c = 0; c < 2; c++) {
+		const AABB& exact = children[c]->box;
+		Q lo[3], hi[3];
+		for (int a = 0; a < 3; a++) {
+			float extent = box.max[a] - box.min[a];
+			float l = extent > 0 ? std::floor((exact.min[a] - box.min[a]) / extent * steps) : 0;
+			float h = extent > 0 ? std::floor((box.max[a] - exact.max[a]) / extent * steps) : 0;
+			lo[a] = static_cast<Q>(std::min(std::max(l, 0.0f), steps));
+			hi[a] = static_cast<Q>(std::min(std::max(h, 0.0f), steps));
+		}
+		// step back until float rounding can not cut into the exact box, with a few ulps of margin
+		// in case traversal code is compiled with different contraction (fma) than this one
+		for (int a = 0; a < 3; a++) {
+			float tolerance = 4 * std::numeric_limits<float>::epsilon() * std::max(std::abs(box.min[a]), std::abs(box.max[a]));
+			while (lo[a] > 0 && dequantize(box, scale, lo, hi).min[a] > exact.min[a] - tolerance)
+				lo[a]--;
+			while (hi[a] > 0 && dequantize(box, scale, lo, hi).max[a] < exact.max[a] + tolerance)
+				hi[a]--;
+		}
+		for (int a = 0; a < 3; a++) {
+			nodes[index].lo[c][a] = lo[a];
+			nodes[index].hi[c][a] = hi[a];
+		}
+		childBoxes[c] = dequantize(box, scale, lo, hi);
+	}
+
+	int32_t left = buildNode(node->left, childBoxes[0]);
+	int32_t right = buildNode(node->right, childBoxes[1]);
+	nodes[index].child[0] = left;
+	nodes[index].child[1] = right;
+	return index;
+}
+
+template <typename Q>
+bool QuantizedBVH<Q>::intersect(const BVHTree& bvh, const Ray& ray, Intersection& intersection) const
+{
+	if (!rootBox.intersect(ray))
+		return false;
+
+	// plain data so the stack below is not default constructed on every call
+	struct Entry {
+		int32_t node;
+		float min[3], max[3];
+	};
+	// the tree is a median split, its depth is about log2 of the primitive count
+	Entry stack[128];
+	int top = 0;
+	stack[top++] = { 0, { rootBox.min.x, rootBox.min.y, rootBox.min.z }, { rootBox.max.x, rootBox.max.y, rootBox.max.z } };
+
+	TraversalWork work;
+	bool hit = false;
+	while (top > 0) {
+		const Entry& entry = stack[--top];
+		const QuantizedBVHNode<Q>& node = nodes[entry.node];
+		work.nodes++;
+		const AABB box(Vec(entry.min), Vec(entry.max));
+		const Vec scale = quantizationStep<Q>(box);
+
+		for (int c = 0; c < 2; c++) {
+			AABB childBox = dequantize(box, scale, node.lo[c], node.hi[c]);
+			if (!childBox.intersect(ray))
+				continue;
+			if (node.child[c] < 0) {
+				work.leaf(leafPrims[-node.child[c] - 1]);
+				if (bvh.intersectLeaf(leafPrims[-node.child[c] - 1], ray, intersection))
+					hit = true;
+			}
+			else {
+				stack[top++] = { node.child[c], { childBox.min.x, childBox.min.y, childBox.min.z }, { childBox.max.x, childBox.max.y, childBox.max.z } };
+			}
+		}
+	}
+	return hit;
+}
+
+template class QuantizedBVH<uint8_t>;
+template class QuantizedBVH<uint16_t>;
+
+
 void BVHTree::depthInfo(BVHNode* root, int depth, int& maxdepth, int& alldepth) const
 {
 	if (root == nullptr)
@@ -153,21 +613,74 @@ void BVHTree::depthInfo(BVHNode* root, int depth, int& maxdepth, int& alldepth)
 }
 
 
-AABB Triangle::getBoundingBox()
+AABB PrimitiveStore::getBoundingBox(PrimRef ref) const
+{
+	switch (ref.type) {
+	case objectType::tri: return triangles[ref.index].getBoundingBox(mesh);
+	case objectType::sph: return spheres[ref.index].getBoundingBox();
+	}
+	return AABB();
+}
+
+bool PrimitiveStore::intersect(PrimRef ref, const Ray& ray, Intersection& intersection) const
+{
+	switch (ref.type) {
+	case objectType::tri: return triangles[ref.index].intersect(mesh, ray, intersection);
+	case objectType::sph: return spheres[ref.index].intersect(ray, intersection);
+	}
+	return false;
+}
+
+float PrimitiveStore::sampleLight(PrimRef ref, const Vec& point, const BVHTree& bvh) const
+{
+	switch (ref.type) {
+	case objectType::tri: return triangles[ref.index].sampleLight(mesh, point, bvh);
+	case objectType::sph: return spheres[ref.index].sampleLight(point, bvh);
+	}
+	return 0;
+}
+
+float PrimitiveStore::getArea(PrimRef ref) const
+{
+	switch (ref.type) {
+	case objectType::tri: return triangles[ref.index].getArea(mesh);
+	case objectType::sph: return spheres[ref.index].getArea();
+	}
+	return 0;
+}
+
+Vec PrimitiveStore::getTexture(const Intersection& intersection, float footprint) const
+{
+	PrimRef ref = intersection.prim;
+	switch (ref.type) {
+	case objectType::tri: return triangles[ref.index].getTexture(mesh, intersection.u, intersection.v, footprint, textureFilter);
+	case objectType::sph: return spheres[ref.index].getTextureByPoint(intersection.point);
+	}
+	return Vec(1, 1, 1);
+}
+
+
+AABB Triangle::getBoundingBox(const TriangleMesh& mesh) const
 {
+	const Vec& v0 = mesh.position(idx[0]);
+	const Vec& v1 = mesh.position(idx[1]);
+	const Vec& v2 = mesh.position(idx[2]);
 	AABB box;
-	box.min.x = std::min(std::min(this->v0[0], this->v1[0]), this->v2[0]);
-	box.min.y = std::min(std::min(this->v0[1], this->v1[1]), this->v2[1]);
-	box.min.z = std::min(std::min(this->v0[2], this->v1[2]), this->v2[2]);
-	box.max.x = std::max(std::max(this->v0[0], this->v1[0]), this->v2[0]);
-	box.max.y = std::max(std::max(this->v0[1], this->v1[1]), this->v2[1]);
-	box.max.z = std::max(std::max(this->v0[2], this->v1[2]), this->v2[2]);
+	box.min.x = std::min(std::min(v0[0], v1[0]), v2[0]);
+	box.min.y = std::min(std::min(v0[1], v1[1]), v2[1]);
+	box.min.z = std::min(std::min(v0[2], v1[2]), v2[2]);
+	box.max.x = std::max(std::max(v0[0], v1[0]), v2[0]);
+	box.max.y = std::max(std::max(v0[1], v1[1]), v2[1]);
+	box.max.z = std::max(std::max(v0[2], v1[2]), v2[2]);
 	return box;
 }
 
 
-bool Triangle::intersect(const Ray& ray, Intersection& intersection)
+bool Triangle::intersect(const TriangleMesh& mesh, const Ray& ray, Intersection& intersection) const
 {
+	const Vec& v0 = mesh.position(idx[0]);
+	const Vec& v1 = mesh.position(idx[1]);
+	const Vec& v2 = mesh.position(idx[2]);
 	const Vec e1 = v1 - v0;
 	const Vec e2 = v2 - v0;
 	const Vec p = ray.direction.cross(e2);
@@ -203,13 +716,17 @@ bool Triangle::intersect(const Ray& ray, Intersection& intersection)
 	intersection.material = this->material;
 	intersection.point = ray.at(t_hit);
 	intersection.normal = e1.cross(e2).normalized();
-	intersection.object = this;
+	intersection.u = u;
+	intersection.v = v;
 
 	return true;
 }
 
-float Triangle::sampleLight(const Vec& point, const BVHTree& bvh)
+float Triangle::sampleLight(const TriangleMesh& mesh, const Vec& point, const BVHTree& bvh) const
 {
+	const Vec& v0 = mesh.position(idx[0]);
+	const Vec& v1 = mesh.position(idx[1]);
+	const Vec& v2 = mesh.position(idx[2]);
 
 	// get a random point
 	Vec e01 = v1 - v0;
@@ -229,6 +746,7 @@ float Triangle::sampleLight(const Vec& point, const BVHTree& bvh)
 	Intersection inte;
 
 	//not hit
+	threadCounters().countRay(RayKind::shadow);
 	if (bvh.intersect(Ray(point, (line * -1.0).normalized()), inte) == false)
 		return 0;
 	//float a = (inte.point - randPoint).length();
@@ -245,53 +763,197 @@ float Triangle::sampleLight(const Vec& point, const BVHTree& bvh)
 	return area * cos / distance;
 }
 
-float Triangle::getArea()
+float Triangle::getArea(const TriangleMesh& mesh) const
 {
-	Vec e01 = v1 - v0;
-	Vec e02 = v2 - v0;
+	const Vec& v0 = mesh.position(idx[0]);
+	Vec e01 = mesh.position(idx[1]) - v0;
+	Vec e02 = mesh.position(idx[2]) - v0;
 	Vec cross_product = e01.cross(e02);
 	return 0.5f * cross_product.length();
 }
 
-Vec Triangle::getTextureByPoint(const Vec& point)
+Vec Triangle::getTexture(const TriangleMesh& mesh, float u, float v, float footprint, TextureFilter filter) const
 {	
+	const Vec uv0 = mesh.uv(idx[0]);
+	const Vec uv1 = mesh.uv(idx[1]);
+	const Vec uv2 = mesh.uv(idx[2]);
+	Vec uv = uv0 * (1.0f - u - v) + uv1 * u + uv2 * v;
+
+	// ray cone lod: the texel density of the triangle (texels of the full image per unit of area) times the footprint
+	float lod = -INFINITY;
+	if (footprint > 0 && filter != TextureFilter::nearest)
+	{
+		const Vec& v0 = mesh.position(idx[0]);
+		float areaABC = (mesh.position(idx[1]) - v0).cross(mesh.position(idx[2]) - v0).length();
+		Vec duv1 = uv1 - uv0;
+		Vec duv2 = uv2 - uv0;
+		// twice the uv area in texels, like areaABC is twice the area
+		float texelArea = std::fabs(duv1.x * duv2.y - duv1.y * duv2.x) * texture->w * texture->h;
+		if (texelArea > 0 && areaABC > 0)
+			lod = std::log2(footprint * std::sqrt(texelArea / areaABC));
+	}
+	return texture->sample(uv.x, uv.y, lod, filter);
+}
 
-	Vec e1 = v1 - v0;
-	Vec e2 = v2 - v0;
-	Vec e3 = v1 - v2;
-	float areaABC = e1.cross(e2).length();
-	float alpha = (e3.cross(point - v2)).length() / areaABC;
-	float beta = (e2.cross(point - v0)).length() / areaABC;
-	float gamma = 1.0 - alpha - beta;
-
-
-
-	float u = alpha * uv0[0] + beta * uv1[0] + gamma * uv2[0];
-	float v = alpha * uv0[1] + beta * uv1[1] + gamma * uv2[1];
-	
-
-	while (u < 0.0f)
-		u++;
+Vec Texture::sample(float u, float v, float lod, TextureFilter filter) const
+{
+	if (filter == TextureFilter::nearest || levelNum == 0)
+	{
+		while (u < 0.0f)
+			u++;
+
+		while (v < 0.0f)
+			v++;
+
+		// pointе
+		int x = static_cast<int>((u * w + 0.5)) % w;
+		int y = static_cast<int>((v * h + 0.5)) % h;
+		MipLevel full = { w, h, 0, photo };
+		return texel(levelNum > 0 ? levels[0] : full, x, y) * (1.0 / 255.0);
+	}
 
-	while (v < 0.0f)
-		v++;
+	u -= std::floor(u);
+	v -= std::floor(v);
+	float level = std::min(std::max(lod, 0.0f), static_cast<float>(levelNum - 1));
+	if (filter == TextureFilter::bilinear)
+		return bilinear(levels[static_cast<int>(level + 0.5f)], u, v) * (1.0 / 255.0);
+
+	int fine = static_cast<int>(level);
+	float t = level - fine;
+	Vec color = bilinear(levels[fine], u, v);
+	if (t > 0 && fine + 1 < levelNum)
+		color = color * (1 - t) + bilinear(levels[fine + 1], u, v) * t;
+	return color * (1.0 / 255.0);
+}
 
-	// pointе
-	int x = static_cast<int>((u * texture->w + 0.5))% texture->w;
-	int y = static_cast<int>((v * texture->h + 0.5))% texture->h;
+Vec Texture::texel(const MipLevel& level, int x, int y) const
+{
+	if (cache != nullptr)
+	{
+		unsigned char rgba[4];
+		cache->fetch(cacheFile, static_cast<int>(&level - levels), x, y, rgba);
+		return Vec(rgba[0], rgba[1], rgba[2]);
+	}
+	const unsigned char* p = texelAddress(level, x, y);
+	return level.tilesX != 0 || c >= 3 ? Vec(p[0], p[1], p[2]) : Vec(p[0], p[0], p[0]);
+}
 
+// texel centers sit on multiples of 1 / w as in the nearest lookup, the image repeats
+Vec Texture::bilinear(const MipLevel& level, float u, float v) const
+{
+	float fx = u * level.w;
+	float fy = v * level.h;
+	int x0 = static_cast<int>(fx);
+	int y0 = static_cast<int>(fy);
+	float tx = fx - x0;
+	float ty = fy - y0;
+	// u, v are in [0, 1], 1 only by rounding
+	if (x0 >= level.w)
+		x0 -= level.w;
+	if (y0 >= level.h)
+		y0 -= level.h;
+	int x1 = x0 + 1 == level.w ? 0 : x0 + 1;
+	int y1 = y0 + 1 == level.h ? 0 : y0 + 1;
+	return (texel(level, x0, y0) * (1 - tx) + texel(level, x1, y0) * tx) * (1 - ty) +
+		(texel(level, x0, y1) * (1 - tx) + texel(level, x1, y1) * tx) * ty;
+}
 
+void Texture::copyScanline(unsigned char* out) const
+{
+	const MipLevel& full = levels[0];
+	for (int y = 0; y < h; y++)
+		for (int x = 0; x < w; x++)
+		{
+			const unsigned char* p = texelAddress(full, x, y);
+			unsigned char* q = out + c * (static_cast<size_t>(y) * w + x);
+			if (full.tilesX == 0 || c >= 3)
+				std::copy(p, p + c, q);
+			else
+			{
+				q[0] = p[0];
+				if (c == 2)
+					q[1] = p[3];
+			}
+		}
+}
 
-	int index = texture->c * (x + y * texture->w);
+void PrimitiveStore::setPixels(Texture* texture, int width, int height, int channels, const unsigned char* data)
+{
+	bool tiled = textureLayout == TextureLayout::tiled;
+	int levelNum = 1;
+	for (int w = width, h = height; w > 1 || h > 1; w = std::max(1, w / 2), h = std::max(1, h / 2))
+		levelNum++;
+
+	// tiled levels are padded to whole tiles, the padding is never read
+	auto newLevel = [&](int w, int h) {
+		MipLevel level;
+		level.w = w;
+		level.h = h;
+		level.tilesX = tiled ? (w + 3) / 4 : 0;
+		size_t bytes = tiled ? static_cast<size_t>(level.tilesX) * ((h + 3) / 4) * 64 : static_cast<size_t>(w) * h * channels;
+		level.photo = arena.allocArray<unsigned char>(bytes);
+		if (tiled)
+			std::fill(level.photo, level.photo + bytes, 0);
+		return level;
+	};
+
+	MipLevel* levels = arena.allocArray<MipLevel>(levelNum);
+	levels[0] = newLevel(width, height);
+	*texture = Texture(width, height, channels, levels[0].photo);
+	texture->levels = levels;
+	texture->levelNum = levelNum;
+
+	if (!tiled)
+		std::copy(data, data + static_cast<size_t>(width) * height * channels, levels[0].photo);
+	else
+	{
+		for (int y = 0; y < height; y++)
+			for (int x = 0; x < width; x++)
+			{
+				const unsigned char* p = data + channels * (static_cast<size_t>(y) * width + x);
+				unsigned char* q = const_cast<unsigned char*>(texture->texelAddress(levels[0], x, y));
+				if (channels >= 3)
+				{
+					q[0] = p[0];
+					q[1] = p[1];
+					q[2] = p[2];
+					q[3] = channels == 4 ? p[3] : 255;
+				}
+				else
+				{
+					q[0] = q[1] = q[2] = p[0];
+					q[3] = channels == 2 ? p[1] : 255;
+				}
+			}
+	}
 
-	return Vec(
-		texture->photo[index + 0],
-		texture->photo[index + 1],
-		texture->photo[index + 2]
-	) * (1.0 / 255.0);
+	// every level is the box filtered previous one: the average of the 2x2 block under each texel,
+	// clamped at a side of length 1
+	for (int l = 1; l < levelNum; l++)
+	{
+		const MipLevel& src = levels[l - 1];
+		levels[l] = newLevel(std::max(1, src.w / 2), std::max(1, src.h / 2));
+		const MipLevel& dst = levels[l];
+		int bytes = texture->texelBytes(dst);
+		for (int y = 0; y < dst.h; y++)
+		{
+			int y0 = std::min(2 * y, src.h - 1), y1 = std::min(2 * y + 1, src.h - 1);
+			for (int x = 0; x < dst.w; x++)
+			{
+				int x0 = std::min(2 * x, src.w - 1), x1 = std::min(2 * x + 1, src.w - 1);
+				const unsigned char* p00 = texture->texelAddress(src, x0, y0);
+				const unsigned char* p01 = texture->texelAddress(src, x1, y0);
+				const unsigned char* p10 = texture->texelAddress(src, x0, y1);
+				const unsigned char* p11 = texture->texelAddress(src, x1, y1);
+				unsigned char* out = const_cast<unsigned char*>(texture->texelAddress(dst, x, y));
+				for (int k = 0; k < bytes; k++)
+					out[k] = static_cast<unsigned char>((p00[k] + p01[k] + p10[k] + p11[k] + 2) / 4);
+			}
+		}
+	}
 }
 
-AABB Sphere::getBoundingBox()
+AABB Sphere::getBoundingBox() const
 {
 	AABB box;
 	box.min.x = this->center[0] - radius;
@@ -304,7 +966,7 @@ AABB Sphere::getBoundingBox()
 }
 
 
-bool Sphere::intersect(const Ray& ray, Intersection& intersection) {
+bool Sphere::intersect(const Ray& ray, Intersection& intersection) const {
 
 	Vec op = center - ray.origin;  // p-o
 	// Solve t^2*d.d + 2*t*(o-p).d + (o-p).(o-p)-R^2 = 0
@@ -334,11 +996,10 @@ bool Sphere::intersect(const Ray& ray, Intersection& intersection) {
 	intersection.point = ray.origin + ray.direction * intersection.t;
 	intersection.normal = (intersection.point - center).normalized();
 	intersection.material = this->material;
-	intersection.object = this;
 	return true;
 }
 
-float Sphere::sampleLight(const Vec& point, const BVHTree& bvh)
+float Sphere::sampleLight(const Vec& point, const BVHTree& bvh) const
 {
 	// get a random point
 	float phi = PI * floatrand();
@@ -350,6 +1011,7 @@ float Sphere::sampleLight(const Vec& point, const BVHTree& bvh)
 	Vec line = point - randPoint;
 
 	// not hit
+	threadCounters().countRay(RayKind::shadow);
 	if (bvh.intersect(Ray(point, (line * -1.).normalized()), inte) == false)
 		return 0;
 
@@ -364,12 +1026,12 @@ float Sphere::sampleLight(const Vec& point, const BVHTree& bvh)
 	return area * cos / distance;
 }
 
-float Sphere::getArea()
+float Sphere::getArea() const
 {
 	return 4.0f * PI * radius * radius * radius / 3.0f;
 }
 
-Vec Sphere::getTextureByPoint(const Vec& point)
+Vec Sphere::getTextureByPoint(const Vec& point) const
 {
 	return Vec(1, 1, 1);
 }
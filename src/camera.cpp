@@ -0,0 +1,18 @@
+#include "camera.h"
+
+#include <cmath>
+
+
+PinholeCamera::PinholeCamera(const Ray& cam, const Vec& camUp, float fovy, int width, int height) :
+	width(width), height(height), origin(cam.origin)
+{
+	Vec cv = cam.direction;
+	Vec cu = camUp - cv * (camUp.dot(cv));
+	Vec cw = cv.cross(cu).normalized();
+	float near = 0.1f;
+	float tanFovy = std::tan(fovy * PI / 180.0f);
+	czIncure = cv * near;
+	cyIncure = cu * (tanFovy * near / static_cast<float>(height));
+	cxIncure = cw * cyIncure.length();
+	pixelSpread = cyIncure.length() / near;
+}
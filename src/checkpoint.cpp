@@ -0,0 +1,318 @@
+#include "checkpoint.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+
+
+// bump it whenever the layout below changes, older checkpoints are refused
+static const uint32_t checkpointVersion = 2;
+static const char checkpointMagic[8] = { 'M', 'C', 'P', 'T', 'C', 'K', 'P', '\0' };
+// written as a number, reads back differently on a machine with another byte order
+static const uint32_t byteOrderMark = 0x01020304;
+
+static_assert(sizeof(Vec) == 3 * sizeof(float), "Vec is written as raw floats");
+
+// followed by width * height Vec and width * height uint32 sample counts
+struct CheckpointHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t byteOrder;
+	int32_t width, height;
+	uint64_t sceneHash;
+	uint32_t seed;
+	int32_t samples;
+	int32_t smax;
+	int32_t reserved;
+	// fnv-1a of the file with this field zeroed
+	uint64_t checksum;
+};
+
+static const uint64_t fnvBasis = 14695981039346656037ull;
+
+static uint64_t fnv1a(uint64_t hash, const void* data, size_t n)
+{
+	const unsigned char* p = static_cast<const unsigned char*>(data);
+	for (size_t i = 0; i < n; i++)
+	{
+		hash ^= p[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+template <typename T>
+static uint64_t fnv1a(uint64_t hash, const T& value) { return fnv1a(hash, &value, sizeof(T)); }
+
+
+std::string checkpointPath(int modelSelect, int width, int height)
+{
+	std::string filename;
+	if (modelSelect == 1) filename = "tmpData/cornell_box";
+	else if (modelSelect == 2) filename = "tmpData/veach_mis";
+	else if (modelSelect == 3) filename = "tmpData/staircase";
+	else if (modelSelect == 4) filename = "tmpData/test";
+	else filename = "tmpData/unclear_image";
+	return filename + "W" + std::to_string(width) + "H" + std::to_string(height) + ".tmpData";
+}
+
+uint64_t checkpointSceneHash(int modelSelect, float fovy, const Ray& cam, const Vec& camUp,
+	const std::vector<tinyobj::material_t>& materials, const PrimitiveStore& prims)
+{
+	uint64_t hash = fnv1a(fnvBasis, modelSelect);
+	hash = fnv1a(hash, fovy);
+	hash = fnv1a(hash, cam.origin);
+	hash = fnv1a(hash, cam.direction);
+	hash = fnv1a(hash, camUp);
+	for (auto& m : materials)
+	{
+		hash = fnv1a(hash, m.name.data(), m.name.size());
+		for (const float* f3 : { m.ambient, m.diffuse, m.specular, m.transmittance, m.emission })
+			hash = fnv1a(hash, f3, 3 * sizeof(float));
+		hash = fnv1a(hash, m.shininess);
+		hash = fnv1a(hash, m.ior);
+		hash = fnv1a(hash, m.dissolve);
+		hash = fnv1a(hash, m.diffuse_texname.data(), m.diffuse_texname.size());
+	}
+
+	// the loaders may order vertices and triangles differently, so only order free properties of the geometry go in
+	Vec lo(INFINITY, INFINITY, INFINITY), hi(-INFINITY, -INFINITY, -INFINITY);
+	for (auto& p : prims.mesh.positions)
+	{
+		lo = Vec(std::min(lo.x, p.x), std::min(lo.y, p.y), std::min(lo.z, p.z));
+		hi = Vec(std::max(hi.x, p.x), std::max(hi.y, p.y), std::max(hi.z, p.z));
+	}
+	hash = fnv1a(hash, lo);
+	hash = fnv1a(hash, hi);
+	hash = fnv1a(hash, static_cast<uint64_t>(prims.triangles.size()));
+	hash = fnv1a(hash, static_cast<uint64_t>(prims.spheres.size()));
+	return hash;
+}
+
+static uint64_t checksum(CheckpointHeader header, const Vec c[], const uint32_t pixelSamples[])
+{
+	size_t n = static_cast<size_t>(header.width) * header.height;
+	header.checksum = 0;
+	uint64_t hash = fnv1a(fnvBasis, header);
+	hash = fnv1a(hash, c, n * sizeof(Vec));
+	return fnv1a(hash, pixelSamples, n * sizeof(uint32_t));
+}
+
+bool writeCheckpoint(const std::string& fileName, const CheckpointInfo& info, const Vec c[], const uint32_t pixelSamples[])
+{
+	CheckpointHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, checkpointMagic, sizeof(checkpointMagic));
+	header.version = checkpointVersion;
+	header.byteOrder = byteOrderMark;
+	header.width = info.width;
+	header.height = info.height;
+	header.sceneHash = info.sceneHash;
+	header.seed = info.seed;
+	header.samples = info.samples;
+	header.smax = info.smax;
+	header.checksum = checksum(header, c, pixelSamples);
+
+	size_t n = static_cast<size_t>(info.width) * info.height;
+	std::string tmpName = fileName + ".tmp";
+	std::ofstream file(tmpName, std::ios::binary | std::ios::trunc);
+	if (!file) {
+		printf("can't open %s\n", tmpName.c_str());
+		return false;
+	}
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	file.write(reinterpret_cast<const char*>(c), n * sizeof(Vec));
+	file.write(reinterpret_cast<const char*>(pixelSamples), n * sizeof(uint32_t));
+	file.close();
+	if (!file) {
+		printf("can't write %s\n", tmpName.c_str());
+		std::remove(tmpName.c_str());
+		return false;
+	}
+
+	// replaces the old checkpoint in one step, there is no moment without a complete one on disk
+#ifdef _WIN32
+	bool renamed = MoveFileExA(tmpName.c_str(), fileName.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+	bool renamed = std::rename(tmpName.c_str(), fileName.c_str()) == 0;
+#endif
+	if (!renamed) {
+		printf("can't rename %s\n", tmpName.c_str());
+		std::remove(tmpName.c_str());
+	}
+	return renamed;
+}
+
+static bool readHeader(std::ifstream& file, const std::string& fileName, CheckpointHeader& header)
+{
+	if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+		memcmp(header.magic, checkpointMagic, sizeof(checkpointMagic)) != 0)
+	{
+		printf("%s is not a checkpoint (or one from before the checkpoint header), ignored\n", fileName.c_str());
+		return false;
+	}
+	if (header.version != checkpointVersion || header.byteOrder != byteOrderMark)
+	{
+		printf("%s is a checkpoint of another version or byte order, ignored\n", fileName.c_str());
+		return false;
+	}
+	if (header.width <= 0 || header.height <= 0 || header.samples < 0 || header.smax <= 0)
+	{
+		printf("%s is damaged, ignored\n", fileName.c_str());
+		return false;
+	}
+	return true;
+}
+
+static void toInfo(const CheckpointHeader& header, CheckpointInfo& info)
+{
+	info.width = header.width;
+	info.height = header.height;
+	info.sceneHash = header.sceneHash;
+	info.seed = header.seed;
+	info.samples = header.samples;
+	info.smax = header.smax;
+}
+
+bool readCheckpointInfo(const std::string& fileName, CheckpointInfo& info)
+{
+	std::ifstream file(fileName, std::ios::binary);
+	CheckpointHeader header;
+	if (!file || !readHeader(file, fileName, header))
+		return false;
+	toInfo(header, info);
+	return true;
+}
+
+bool readCheckpoint(const std::string& fileName, const CheckpointInfo& expect, CheckpointInfo& info, Vec c[], uint32_t pixelSamples[])
+{
+	std::ifstream file(fileName, std::ios::binary);
+	CheckpointHeader header;
+	if (!file || !readHeader(file, fileName, header))
+		return false;
+
+	if (header.width != expect.width || header.height != expect.height)
+	{
+		printf("%s is a %dx%d render, not %dx%d, ignored\n", fileName.c_str(), header.width, header.height, expect.width, expect.height);
+		return false;
+	}
+	if (expect.sceneHash != 0 && header.sceneHash != expect.sceneHash)
+	{
+		printf("%s was rendered from another scene or camera, ignored\n", fileName.c_str());
+		return false;
+	}
+	if (expect.seed != 0 && header.seed != expect.seed)
+	{
+		printf("%s was rendered with seed %u, not %u, ignored\n", fileName.c_str(), header.seed, expect.seed);
+		return false;
+	}
+
+	// read aside, so a damaged file leaves the caller's buffers as they were
+	size_t n = static_cast<size_t>(header.width) * header.height;
+	std::unique_ptr<Vec[]> color(new Vec[n]);
+	std::unique_ptr<uint32_t[]> samples(new uint32_t[n]);
+	char extra;
+	if (!file.read(reinterpret_cast<char*>(color.get()), n * sizeof(Vec)) ||
+		!file.read(reinterpret_cast<char*>(samples.get()), n * sizeof(uint32_t)) ||
+		file.read(&extra, 1) || checksum(header, color.get(), samples.get()) != header.checksum)
+	{
+		printf("%s is damaged (checksum mismatch), ignored\n", fileName.c_str());
+		return false;
+	}
+
+	float scale = static_cast<float>(header.smax) / static_cast<float>(expect.smax);
+	for (size_t i = 0; i < n; i++)
+		c[i] = color[i] * scale;
+	memcpy(pixelSamples, samples.get(), n * sizeof(uint32_t));
+	toInfo(header, info);
+	return true;
+}
+
+
+CheckpointWriter::CheckpointWriter() :
+	hasPending(false), busy(false), stopping(false), dropped(0), busyMilliseconds(0), writeCount(0)
+{
+	worker = std::thread(&CheckpointWriter::work, this);
+}
+
+CheckpointWriter::~CheckpointWriter()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	submitted.notify_one();
+	worker.join();
+	if (dropped != 0)
+		printf("%zd checkpoints were skipped, the disk was slower than the render\n", dropped);
+}
+
+void CheckpointWriter::submit(const std::string& fileName, const CheckpointInfo& info, const Vec c[], const uint32_t pixelSamples[],
+	const Saved& saved)
+{
+	size_t n = static_cast<size_t>(info.width) * info.height;
+	std::lock_guard<std::mutex> guard(lock);
+	if (hasPending)
+		dropped++;
+	pending.fileName = fileName;
+	pending.info = info;
+	pending.c.assign(c, c + n);
+	pending.pixelSamples.assign(pixelSamples, pixelSamples + n);
+	pending.saved = saved;
+	hasPending = true;
+	submitted.notify_one();
+}
+
+void CheckpointWriter::wait()
+{
+	std::unique_lock<std::mutex> guard(lock);
+	written.wait(guard, [this] { return !hasPending && !busy; });
+}
+
+double CheckpointWriter::milliseconds()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return busyMilliseconds;
+}
+
+size_t CheckpointWriter::writes()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return writeCount;
+}
+
+void CheckpointWriter::work()
+{
+	std::unique_lock<std::mutex> guard(lock);
+	for (;;) {
+		submitted.wait(guard, [this] { return stopping || hasPending; });
+		if (!hasPending)
+			return;
+		std::swap(pending, writing);
+		hasPending = false;
+		busy = true;
+
+		guard.unlock();
+		auto start = std::chrono::steady_clock::now();
+		bool ok = writing.fileName.empty() ||
+			writeCheckpoint(writing.fileName, writing.info, writing.c.data(), writing.pixelSamples.data());
+		if (ok && writing.saved)
+			writing.saved(writing.info, writing.c.data(), writing.pixelSamples.data());
+		double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		guard.lock();
+		busyMilliseconds += elapsed;
+		writeCount++;
+
+		busy = false;
+		written.notify_all();
+	}
+}
@@ -0,0 +1,125 @@
+#include "denoise.h"
+
+#include <algorithm>
+#include <cmath>
+
+
+void denoise(const std::vector<Vec>& color, const AovBuffers& aovs, const Region& bounds, std::vector<Vec>& result,
+	const DenoiseSettings& settings)
+{
+	int w = bounds.x1 - bounds.x0, h = bounds.y1 - bounds.y0;
+	size_t n = static_cast<size_t>(std::max(w, 0)) * std::max(h, 0);
+	result = color;
+	if (n == 0 || color.size() != n)
+		return;
+
+	// the guides, and the color without its albedo: what is left is smooth lighting where the filter can average freely
+	std::vector<Vec> albedo(n), normal(n), illum(n);
+	std::vector<float> depth(n), variance(n);
+#pragma omp parallel for
+	for (int y = 0; y < h; y++)
+		for (int x = 0; x < w; x++)
+		{
+			size_t i = static_cast<size_t>(y) * w + x;
+			int pixel = (bounds.y0 + y) * aovs.width + bounds.x0 + x;
+			Vec a = aovs.albedo(pixel);
+			// channels without albedo aren't divided
+			albedo[i] = Vec(a.x > 0.01f ? a.x : 1.0f, a.y > 0.01f ? a.y : 1.0f, a.z > 0.01f ? a.z : 1.0f);
+			illum[i] = Vec(color[i].x / albedo[i].x, color[i].y / albedo[i].y, color[i].z / albedo[i].z);
+			Vec nrm = aovs.normal(pixel);
+			float len = nrm.length();
+			normal[i] = len > 0 ? nrm * (1.0f / len) : Vec();
+			depth[i] = aovs.depth(pixel);
+			float la = luminance(albedo[i]);
+			variance[i] = aovs.variance(pixel) / (la * la);
+		}
+
+	// how fast the depth changes per pixel, so a sloped floor isn't mistaken for an edge
+	std::vector<float> depthSlope(n);
+#pragma omp parallel for
+	for (int y = 0; y < h; y++)
+		for (int x = 0; x < w; x++)
+		{
+			size_t i = static_cast<size_t>(y) * w + x;
+			float dx = std::fabs(depth[y * w + std::min(x + 1, w - 1)] - depth[y * w + std::max(x - 1, 0)]) * 0.5f;
+			float dy = std::fabs(depth[std::min(y + 1, h - 1) * w + x] - depth[std::max(y - 1, 0) * w + x]) * 0.5f;
+			depthSlope[i] = std::max(dx, dy);
+		}
+
+	static const float kernel[3] = { 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+	std::vector<Vec> nextIllum(n);
+	std::vector<float> nextVariance(n), blurred(n);
+	for (int iteration = 0; iteration < settings.iterations; iteration++)
+	{
+		int step = 1 << iteration;
+
+		// the variance itself is noisy, a 3x3 blur of it sets the luminance tolerance
+#pragma omp parallel for
+		for (int y = 0; y < h; y++)
+			for (int x = 0; x < w; x++)
+			{
+				float sum = 0, weight = 0;
+				for (int dy = -1; dy <= 1; dy++)
+					for (int dx = -1; dx <= 1; dx++)
+					{
+						int qx = x + dx, qy = y + dy;
+						if (qx < 0 || qx >= w || qy < 0 || qy >= h)
+							continue;
+						float k = (dx == 0 ? 0.5f : 0.25f) * (dy == 0 ? 0.5f : 0.25f);
+						sum += k * variance[static_cast<size_t>(qy) * w + qx];
+						weight += k;
+					}
+				blurred[static_cast<size_t>(y) * w + x] = sum / weight;
+			}
+
+#pragma omp parallel for schedule(dynamic)
+		for (int y = 0; y < h; y++)
+			for (int x = 0; x < w; x++)
+			{
+				size_t p = static_cast<size_t>(y) * w + x;
+				float lp = luminance(illum[p]);
+				float colorScale = 1.0f / (settings.sigmaColor * std::sqrt(blurred[p]) + 1e-4f);
+				float depthScale = 1.0f / (settings.sigmaDepth * depthSlope[p] * step + 1e-3f);
+				bool hitP = normal[p].x != 0 || normal[p].y != 0 || normal[p].z != 0;
+
+				Vec sum;
+				float weightSum = 0, varianceSum = 0;
+				for (int dy = -2; dy <= 2; dy++)
+				{
+					int qy = y + dy * step;
+					if (qy < 0 || qy >= h)
+						continue;
+					for (int dx = -2; dx <= 2; dx++)
+					{
+						int qx = x + dx * step;
+						if (qx < 0 || qx >= w)
+							continue;
+						size_t q = static_cast<size_t>(qy) * w + qx;
+						float weight = kernel[std::abs(dx)] * kernel[std::abs(dy)];
+						if (q != p)
+						{
+							bool hitQ = normal[q].x != 0 || normal[q].y != 0 || normal[q].z != 0;
+							// nothing hit on one side only is an edge against the background
+							if (hitP != hitQ)
+								continue;
+							float wn = hitP ? std::pow(std::max(normal[p].dot(normal[q]), 0.0f), settings.sigmaNormal) : 1.0f;
+							float wz = std::fabs(depth[p] - depth[q]) * depthScale / std::sqrt(static_cast<float>(dx * dx + dy * dy));
+							float wl = std::fabs(lp - luminance(illum[q])) * colorScale;
+							float a = std::fabs(albedo[p].x - albedo[q].x) + std::fabs(albedo[p].y - albedo[q].y) + std::fabs(albedo[p].z - albedo[q].z);
+							weight *= wn * std::exp(-wz - wl - a * 10.0f);
+						}
+						sum = sum + illum[q] * weight;
+						weightSum += weight;
+						varianceSum += weight * weight * variance[q];
+					}
+				}
+				nextIllum[p] = sum * (1.0f / weightSum);
+				nextVariance[p] = varianceSum / (weightSum * weightSum);
+			}
+		illum.swap(nextIllum);
+		variance.swap(nextVariance);
+	}
+
+	for (size_t i = 0; i < n; i++)
+		result[i] = illum[i].mult(albedo[i]);
+}
@@ -0,0 +1,133 @@
+#include "distributed.h"
+#include "objLoader.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+
+
+bool mergeCheckpoints(const std::vector<std::string>& inputs, const std::string& output, std::vector<Vec>& image, CheckpointInfo& info)
+{
+	// the headers first: what belongs together and the sample count everything is normalized to
+	std::vector<std::string> files;
+	std::vector<CheckpointInfo> infos;
+	int total = 0;
+	for (auto& input : inputs)
+	{
+		CheckpointInfo in;
+		if (!readCheckpointInfo(input, in))
+			continue;
+		if (!infos.empty() && (in.width != infos[0].width || in.height != infos[0].height || in.sceneHash != infos[0].sceneHash))
+		{
+			printf("%s belongs to another render than %s, left out\n", input.c_str(), files[0].c_str());
+			continue;
+		}
+		// a seed of 0 is an earlier merge
+		auto sameSeed = std::find_if(infos.begin(), infos.end(), [&](const CheckpointInfo& i) { return in.seed != 0 && i.seed == in.seed; });
+		if (sameSeed != infos.end())
+		{
+			printf("%s has the seed of %s, its samples would be counted twice, left out\n", input.c_str(), files[sameSeed - infos.begin()].c_str());
+			continue;
+		}
+		files.push_back(input);
+		infos.push_back(in);
+		total += in.samples;
+	}
+	if (files.empty() || total == 0)
+	{
+		printf("no samples to merge\n");
+		return false;
+	}
+
+	CheckpointInfo expect;
+	expect.width = infos[0].width;
+	expect.height = infos[0].height;
+	expect.sceneHash = infos[0].sceneHash;
+	expect.smax = total;
+	size_t n = static_cast<size_t>(expect.width) * expect.height;
+	std::vector<Vec> sum(n), part(n);
+	std::vector<uint32_t> count(n, 0), partCount(n);
+	info = expect;
+	info.samples = 0;
+	for (auto& file : files)
+	{
+		CheckpointInfo got;
+		if (!readCheckpoint(file, expect, got, part.data(), partCount.data()))
+			continue;
+		for (size_t i = 0; i < n; i++)
+		{
+			sum[i] = sum[i] + part[i];
+			count[i] += partCount[i];
+		}
+		info.samples += got.samples;
+	}
+	if (info.samples == 0)
+		return false;
+
+	// sum holds the samples divided by total, every pixel is divided by the samples it really got instead
+	image.resize(n);
+	for (size_t i = 0; i < n; i++)
+		image[i] = count[i] != 0 ? sum[i] * (static_cast<float>(total) / static_cast<float>(count[i])) : Vec();
+	return output.empty() || writeCheckpoint(output, info, sum.data(), count.data());
+}
+
+static std::string scenePrefix(int modelSelect)
+{
+	if (modelSelect == 1) return "tmpData/cornell_box";
+	else if (modelSelect == 2) return "tmpData/veach_mis";
+	else if (modelSelect == 3) return "tmpData/staircase";
+	else if (modelSelect == 4) return "tmpData/test";
+	return "tmpData/unclear_image";
+}
+
+bool runDistributed(const std::string& program, int modelSelect, int workers, int passes, unsigned int baseSeed, int threads)
+{
+	if (threads <= 0)
+		threads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()) / std::max(1, workers));
+	std::string prefix = scenePrefix(modelSelect);
+	std::string mergedFile = prefix + "Merged.tmpData";
+
+	std::mutex lock;
+	std::vector<std::string> finished;
+	auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> waiting;
+	for (int i = 0; i < workers; i++)
+	{
+		std::string file = prefix + "Worker" + std::to_string(i) + ".tmpData";
+		unsigned int seed = baseSeed + (i + 1) * 65536u;
+		std::string command = "\"" + program + "\" --worker " + std::to_string(seed) + " " + std::to_string(passes) + " " +
+			file + " " + std::to_string(threads);
+#ifdef _WIN32
+		// cmd.exe drops the first and the last quote of a command that starts with one
+		command = "\"" + command + "\"";
+#endif
+		printf("worker %d: %s\n", i, command.c_str());
+
+		// a thread per worker waits for it, so the checkpoints are merged in the order the workers finish
+		waiting.emplace_back([&, i, file, command]() {
+			int status = std::system(command.c_str());
+			std::lock_guard<std::mutex> guard(lock);
+			double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			if (status != 0)
+			{
+				printf("worker %d failed (exit status %d) after %.1f s\n", i, status, seconds);
+				return;
+			}
+			finished.push_back(file);
+			std::vector<Vec> image;
+			CheckpointInfo info;
+			if (!mergeCheckpoints(finished, mergedFile, image, info))
+				return;
+			printf("worker %d finished after %.1f s, %zd of %d merged (%d spp) into %s\n",
+				i, seconds, finished.size(), workers, info.samples, mergedFile.c_str());
+			save_bitmap(modelSelect, image.data(), info.width, info.height);
+			printf("\n");
+		});
+	}
+	for (auto& thread : waiting)
+		thread.join();
+	return !finished.empty();
+}
@@ -0,0 +1,91 @@
+#include "heatmap.h"
+#include "objLoader.h"
+
+#include <algorithm>
+
+
+Vec falseColor(float t)
+{
+	static const Vec stops[5] = { Vec(0, 0, 1), Vec(0, 1, 1), Vec(0, 1, 0), Vec(1, 1, 0), Vec(1, 0, 0) };
+	t = std::min(std::max(t, 0.0f), 1.0f) * 4.0f;
+	int i = std::min(static_cast<int>(t), 3);
+	float f = t - i;
+	return stops[i] * (1 - f) + stops[i + 1] * f;
+}
+
+TraversalHeatmap::TraversalHeatmap(int width, int height) :
+	width(width), height(height)
+{
+	size_t n = static_cast<size_t>(width) * height;
+	nodeSum.resize(n, 0.0f);
+	testSum.resize(n, 0.0f);
+	raySum.resize(n, 0.0f);
+	samples.resize(n, 0);
+}
+
+void TraversalHeatmap::add(int pixel, const RenderCounters& before)
+{
+	const RenderCounters& after = threadCounters();
+	nodeSum[pixel] += static_cast<float>(after.nodesVisited - before.nodesVisited);
+	testSum[pixel] += static_cast<float>(after.triangleTests + after.sphereTests - before.triangleTests - before.sphereTests);
+	float rays = 0;
+	for (int k = 0; k < 3; k++)
+		rays += static_cast<float>(after.rays[k] - before.rays[k]);
+	raySum[pixel] += rays;
+	samples[pixel]++;
+}
+
+float TraversalHeatmap::nodes(int pixel) const
+{
+	return samples[pixel] ? nodeSum[pixel] / samples[pixel] : 0.0f;
+}
+
+float TraversalHeatmap::primitiveTests(int pixel) const
+{
+	return samples[pixel] ? testSum[pixel] / samples[pixel] : 0.0f;
+}
+
+float TraversalHeatmap::rays(int pixel) const
+{
+	return samples[pixel] ? raySum[pixel] / samples[pixel] : 0.0f;
+}
+
+void TraversalHeatmap::save(int modelSelect, const Region& bounds) const
+{
+	int w = bounds.x1 - bounds.x0, h = bounds.y1 - bounds.y0;
+	if (w <= 0 || h <= 0)
+		return;
+	size_t n = static_cast<size_t>(w) * h;
+	std::vector<Vec> raw(n);
+	for (int y = 0; y < h; y++)
+		for (int x = 0; x < w; x++)
+		{
+			int pixel = (bounds.y0 + y) * width + bounds.x0 + x;
+			raw[static_cast<size_t>(y) * w + x] = Vec(nodes(pixel), primitiveTests(pixel), rays(pixel));
+		}
+	std::string name = imageName(modelSelect) + ".heatmap";
+	savePFM(name + ".pfm", raw.data(), w, h);
+
+	auto write = [&](const char* what, float Vec::* channel) {
+		std::vector<float> values(n);
+		double sum = 0;
+		for (size_t i = 0; i < n; i++)
+		{
+			values[i] = raw[i].*channel;
+			sum += values[i];
+		}
+		std::vector<float> sorted = values;
+		size_t rank = std::min(n - 1, n * 99 / 100);
+		std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+		float scale = std::max(sorted[rank], 1.0f);
+		float peak = *std::max_element(values.begin(), values.end());
+
+		std::vector<Vec> image(n);
+		for (size_t i = 0; i < n; i++)
+			image[i] = falseColor(values[i] / scale);
+		save_bitmap(modelSelect, image.data(), w, h, 1.0f, name + "." + what + ".bmp");
+		printf("\n%-16s mean %8.1f per sample, max %8.1f, red at %.1f\n", what, sum / n, peak, scale);
+	};
+	write("nodes", &Vec::x);
+	write("tests", &Vec::y);
+}
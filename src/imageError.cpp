@@ -0,0 +1,27 @@
+#include "imageError.h"
+
+#include <cmath>
+
+
+ImageError imageError(const Vec image[], const Vec reference[], size_t n, double epsilon)
+{
+	ImageError error;
+	if (n == 0)
+		return error;
+	double squares = 0, relative = 0;
+	int count = static_cast<int>(n);
+#pragma omp parallel for reduction(+:squares, relative)
+	for (int i = 0; i < count; i++)
+	{
+		for (int k = 0; k < 3; k++)
+		{
+			double ref = reference[i][k];
+			double d = image[i][k] - ref;
+			squares += d * d;
+			relative += d * d / (ref * ref + epsilon);
+		}
+	}
+	error.rmse = std::sqrt(squares / (3.0 * n));
+	error.relMse = relative / (3.0 * n);
+	return error;
+}
@@ -0,0 +1,308 @@
+#include "imageOutput.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+
+uint16_t floatToHalf(float f)
+{
+	uint32_t bits;
+	memcpy(&bits, &f, sizeof(bits));
+	uint16_t sign = static_cast<uint16_t>((bits >> 16) & 0x8000);
+	uint32_t exponent = (bits >> 23) & 0xff;
+	uint32_t mantissa = bits & 0x7fffff;
+
+	if (exponent == 0xff)
+		return sign | 0x7c00 | (mantissa != 0 ? 0x200 | (mantissa >> 13) : 0);
+	int e = static_cast<int>(exponent) - 127 + 15;
+	if (e >= 0x1f)
+		return sign | 0x7c00;
+	if (e <= 0) {
+		// denormal half, or zero when even the leading one is shifted out
+		if (e < -10)
+			return sign;
+		mantissa |= 0x800000;
+		int shift = 14 - e;
+		uint32_t half = mantissa >> shift;
+		uint32_t rest = mantissa & ((1u << shift) - 1);
+		uint32_t halfway = 1u << (shift - 1);
+		if (rest > halfway || (rest == halfway && (half & 1)))
+			half++;
+		return sign | static_cast<uint16_t>(half);
+	}
+	uint32_t half = (static_cast<uint32_t>(e) << 10) | (mantissa >> 13);
+	uint32_t rest = mantissa & 0x1fff;
+	// a carry out of the mantissa bumps the exponent, up to infinity, which is what rounding should do
+	if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+		half++;
+	return sign | static_cast<uint16_t>(half);
+}
+
+// gamma 2.2 to 8 bit, rounded as int(pow(x, 1 / 2.2) * 255 + .5) but without calling pow: the top 16 bits of a float
+// (exponent and 7 mantissa bits) pick a table entry with the byte of the lowest float in that range. an entry covers
+// so small a range that the byte can only grow by one inside it, which the threshold of the next byte tells
+class GammaTable {
+public:
+	GammaTable() {
+		threshold[0] = 0.0f;
+		threshold[256] = 2.0f;
+		for (int v = 1; v < 256; v++)
+		{
+			float t = static_cast<float>(std::pow((v - 0.5) / 255.0, 2.2));
+			while (t > 0 && byteOf(t) >= v)
+				t = std::nextafter(t, 0.0f);
+			while (byteOf(t) < v)
+				t = std::nextafter(t, 1.0f);
+			threshold[v] = t;
+		}
+		for (uint32_t i = 0; i < tableSize; i++)
+		{
+			uint32_t bits = i << 16;
+			float lo;
+			memcpy(&lo, &bits, sizeof(lo));
+			table[i] = static_cast<uint8_t>(byteOf(lo));
+		}
+	}
+
+	uint8_t operator()(float x) const {
+		// nan goes to 0 as well
+		if (!(x > 0.0f))
+			return 0;
+		if (x >= 1.0f)
+			return 255;
+		uint32_t bits;
+		memcpy(&bits, &x, sizeof(bits));
+		uint8_t v = table[bits >> 16];
+		return x >= threshold[v + 1] ? v + 1 : v;
+	}
+
+private:
+	static int byteOf(float x) { return static_cast<int>(std::pow(x, 1 / 2.2) * 255 + .5); }
+
+	// every float below 1 has its top 16 bits below that of 1.0f
+	static const uint32_t tableSize = 0x3f80;
+	uint8_t table[tableSize];
+	// the lowest float of every byte, and one above 1 after 255
+	float threshold[257];
+};
+
+void encodeBitmap(const Vec c[], int width, int height, float scale, const OutputSettings& settings, std::vector<uint8_t>& data)
+{
+	static const GammaTable gamma;
+	size_t stride = (static_cast<size_t>(width) * 3 + 3) & ~static_cast<size_t>(3);
+	data.assign(stride * height, 0);
+	float k = scale * std::pow(2.0f, settings.exposure);
+	Tonemap op = settings.tonemap;
+
+#pragma omp parallel for schedule(dynamic)
+	for (int y = 0; y < height; y++)
+	{
+		// the curve over the floats of the row first, a loop the compiler can vectorize, then the table lookups
+		std::vector<float> row(3 * static_cast<size_t>(width));
+		const float* in = reinterpret_cast<const float*>(c + static_cast<size_t>(y) * width);
+		int n = 3 * width;
+		if (op == Tonemap::clamp)
+			for (int i = 0; i < n; i++)
+				row[i] = in[i] * k;
+		else if (op == Tonemap::reinhard)
+			for (int i = 0; i < n; i++) {
+				float v = std::max(in[i] * k, 0.0f);
+				row[i] = v / (1.0f + v);
+			}
+		else
+			for (int i = 0; i < n; i++) {
+				float v = std::max(in[i] * k, 0.0f);
+				row[i] = (v * (2.51f * v + 0.03f)) / (v * (2.43f * v + 0.59f) + 0.14f);
+			}
+
+		uint8_t* out = data.data() + stride * y;
+		for (int x = 0; x < width; x++)
+		{
+			out[3 * x + 0] = gamma(row[3 * x + 2]);
+			out[3 * x + 1] = gamma(row[3 * x + 1]);
+			out[3 * x + 2] = gamma(row[3 * x + 0]);
+		}
+	}
+}
+
+bool savePFM(const std::string& fileName, const Vec image[], int width, int height)
+{
+	std::ofstream file(fileName, std::ios::binary);
+	if (!file) {
+		std::cerr << "can't open" << fileName << std::endl;
+		return false;
+	}
+	// a negative scale means little endian. pfm rows go from the bottom up, as c does
+	uint16_t one = 1;
+	bool little = *reinterpret_cast<unsigned char*>(&one) == 1;
+	std::string header = "PF\n" + std::to_string(width) + " " + std::to_string(height) + "\n" + (little ? "-1.0" : "1.0") + "\n";
+	file.write(header.data(), header.size());
+	static_assert(sizeof(Vec) == 3 * sizeof(float), "Vec is written as raw floats");
+	file.write(reinterpret_cast<const char*>(image), static_cast<size_t>(width) * height * sizeof(Vec));
+	return static_cast<bool>(file.flush());
+}
+
+
+// OpenEXR's RLE_COMPRESSION of one block: the bytes are split into the even and the odd ones (low and high bytes of
+// the halves), replaced by differences to the previous byte, and then run length encoded. false if that isn't smaller
+static bool exrRleCompress(const std::vector<unsigned char>& in, std::vector<unsigned char>& out)
+{
+	size_t n = in.size();
+	std::vector<unsigned char> tmp(n);
+	size_t half = (n + 1) / 2;
+	for (size_t i = 0; i < n; i++)
+		tmp[(i & 1) ? half + i / 2 : i / 2] = in[i];
+	for (size_t i = n - 1; i > 0; i--)
+		tmp[i] = static_cast<unsigned char>(tmp[i] - tmp[i - 1] + 128);
+
+	// a run of 3 to 128 equal bytes is (count - 1, byte), anything else goes as (-count, count bytes) of up to 127
+	const size_t minRun = 3, maxRun = 127;
+	out.clear();
+	size_t start = 0;
+	while (start < n)
+	{
+		size_t end = start + 1;
+		while (end < n && tmp[end] == tmp[start] && end - start - 1 < maxRun)
+			end++;
+		if (end - start >= minRun) {
+			out.push_back(static_cast<unsigned char>(end - start - 1));
+			out.push_back(tmp[start]);
+		}
+		else {
+			while (end < n && (end + 1 >= n || tmp[end] != tmp[end + 1] || end + 2 >= n || tmp[end + 1] != tmp[end + 2]) &&
+				end - start < maxRun)
+				end++;
+			out.push_back(static_cast<unsigned char>(-static_cast<int>(end - start)));
+			out.insert(out.end(), tmp.begin() + start, tmp.begin() + end);
+		}
+		start = end;
+		if (out.size() >= n)
+			return false;
+	}
+	return true;
+}
+
+template <typename T>
+static void put(std::vector<unsigned char>& out, T value)
+{
+	// exr is little endian throughout
+	for (size_t i = 0; i < sizeof(T); i++)
+		out.push_back(static_cast<unsigned char>(static_cast<uint64_t>(value) >> (8 * i)));
+}
+
+static void putFloat(std::vector<unsigned char>& out, float f)
+{
+	uint32_t bits;
+	memcpy(&bits, &f, sizeof(bits));
+	put(out, bits);
+}
+
+static void putAttribute(std::vector<unsigned char>& out, const char* name, const char* type, const std::vector<unsigned char>& value)
+{
+	out.insert(out.end(), name, name + strlen(name) + 1);
+	out.insert(out.end(), type, type + strlen(type) + 1);
+	put(out, static_cast<int32_t>(value.size()));
+	out.insert(out.end(), value.begin(), value.end());
+}
+
+bool saveEXR(const std::string& fileName, const Vec image[], int width, int height, bool compress)
+{
+	std::vector<unsigned char> header, value;
+	put(header, static_cast<uint32_t>(20000630));	// magic
+	put(header, static_cast<uint32_t>(2));			// version 2, single part scanline
+
+	// channels are listed by name, so b g r: half, linear, x and y sampling 1
+	for (const char* channel : { "B", "G", "R" }) {
+		value.insert(value.end(), channel, channel + 2);
+		put(value, static_cast<int32_t>(1));
+		put(value, static_cast<uint32_t>(0));
+		put(value, static_cast<int32_t>(1));
+		put(value, static_cast<int32_t>(1));
+	}
+	value.push_back(0);
+	putAttribute(header, "channels", "chlist", value);
+	putAttribute(header, "compression", "compression", std::vector<unsigned char>(1, compress ? 1 : 0));
+	value.clear();
+	for (int32_t v : { 0, 0, width - 1, height - 1 })
+		put(value, v);
+	putAttribute(header, "dataWindow", "box2i", value);
+	putAttribute(header, "displayWindow", "box2i", value);
+	putAttribute(header, "lineOrder", "lineOrder", std::vector<unsigned char>(1, 0));
+	value.clear();
+	putFloat(value, 1.0f);
+	putAttribute(header, "pixelAspectRatio", "float", value);
+	value.clear();
+	putFloat(value, 0.0f);
+	putFloat(value, 0.0f);
+	putAttribute(header, "screenWindowCenter", "v2f", value);
+	value.clear();
+	putFloat(value, 1.0f);
+	putAttribute(header, "screenWindowWidth", "float", value);
+	header.push_back(0);
+
+	// a chunk per scanline: y, size and the halves of b, g and r of the line. exr lines go from the top down
+	std::vector<std::vector<unsigned char>> chunks(height);
+#pragma omp parallel for schedule(dynamic)
+	for (int y = 0; y < height; y++)
+	{
+		const Vec* row = image + static_cast<size_t>(height - 1 - y) * width;
+		std::vector<unsigned char> raw;
+		raw.reserve(static_cast<size_t>(width) * 6);
+		for (int channel = 2; channel >= 0; channel--)
+			for (int x = 0; x < width; x++)
+				put(raw, floatToHalf(channel == 0 ? row[x].x : channel == 1 ? row[x].y : row[x].z));
+
+		std::vector<unsigned char> packed;
+		bool packedSmaller = compress && exrRleCompress(raw, packed);
+		const std::vector<unsigned char>& data = packedSmaller ? packed : raw;
+		std::vector<unsigned char>& chunk = chunks[y];
+		chunk.reserve(8 + data.size());
+		put(chunk, static_cast<int32_t>(y));
+		put(chunk, static_cast<int32_t>(data.size()));
+		chunk.insert(chunk.end(), data.begin(), data.end());
+	}
+
+	std::vector<unsigned char> offsets;
+	uint64_t offset = header.size() + static_cast<uint64_t>(height) * sizeof(uint64_t);
+	for (auto& chunk : chunks) {
+		put(offsets, offset);
+		offset += chunk.size();
+	}
+
+	std::ofstream file(fileName, std::ios::binary);
+	if (!file) {
+		std::cerr << "can't open" << fileName << std::endl;
+		return false;
+	}
+	file.write(reinterpret_cast<const char*>(header.data()), header.size());
+	file.write(reinterpret_cast<const char*>(offsets.data()), offsets.size());
+	for (auto& chunk : chunks)
+		file.write(reinterpret_cast<const char*>(chunk.data()), chunk.size());
+	return static_cast<bool>(file.flush());
+}
+
+std::string imageName(int modelSelect)
+{
+	if (modelSelect == 1) return "Acornell_box";
+	else if (modelSelect == 2) return "Aveach_mis";
+	else if (modelSelect == 3) return "Astaircase";
+	else if (modelSelect == 4) return "Atest";
+	return "unclear_image";
+}
+
+bool saveHdr(int modelSelect, HdrFormat format, const Vec image[], int width, int height, bool compress, const std::string& suffix)
+{
+	if (format == HdrFormat::none)
+		return true;
+	std::string filename = imageName(modelSelect) + suffix;
+
+	bool saved = format == HdrFormat::pfm ? savePFM(filename + ".pfm", image, width, height) :
+		saveEXR(filename + ".exr", image, width, height, compress);
+	if (saved)
+		std::cout << "  " << filename << (format == HdrFormat::pfm ? ".pfm" : ".exr") << " saved!";
+	return saved;
+}
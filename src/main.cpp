@@ -1,201 +1,27 @@
 #pragma once
+#include "checkpoint.h"
+#include "aov.h"
+#include "camera.h"
+#include "denoise.h"
+#include "distributed.h"
+#include "heatmap.h"
+#include "region.h"
+#include "stats.h"
 #include "objLoader.h"
+#include "pathTracer.h"
+#include "sceneCache.h"
+#include "textureCache.h"
+#include "textureLoader.h"
 
+#include <chrono>
 #include <math.h>
+#include <string.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 //#define _DEBUG_
 
-/*
-* DONE:
-*	Ka, Kd, Ke, Ks, Ni
-*	Tr: Transmittance
-*   Ns: shininess
-*   dissolve:
-*   map_Kd: texture mapping in diffuse
-* TODO:
-*   illum:
-*/
-inline Vec sampleAllLight(const Ray& r, const BVHTree& bvh, const std::vector<Object*>& lightObjects) {
-	Vec ret;
-	for (auto obj : lightObjects)
-	{
-		float sampleLight = obj->sampleLight(r.origin + r.direction * 1e-3, bvh);
-		auto objMat = obj->material;
-		auto& objAmbient = objMat->ambient;
-		auto& objEmission = objMat->emission;
-		ret = ret + (Vec(objMat->ambient) + objMat->emission) * sampleLight;
-	}
-	return ret;
-}
-
-inline float caculatePdf(Intersection& intersection, Object* lightObject)
-{
-	if (lightObject->getType() != objectType::sph)
-		return 0;
-
-	float area = lightObject->getArea();
-	float avergEmission = (lightObject->material->emission[0] +
-		lightObject->material->emission[1] +
-		lightObject->material->emission[2]
-		) / 3.0f;
-	float dis;
-	float cos;
-	Vec randPoint, normal;
-	if (lightObject->getType() == objectType::sph) {
-		Vec line = intersection.point - (static_cast<Sphere*>(lightObject)->center);
-		dis = line.length();
-		cos = std::abs((line * -1).normalized().dot(intersection.normal));
-	}
-	else
-	{
-		Vec line = intersection.point - (static_cast<Triangle*>(lightObject)->v1);
-		dis = line.length();
-		cos = std::abs((line * -1).normalized().dot(intersection.normal));
-	}
-	float tmp = area * dis * dis * cos * 1e4 * 2;
-	tmp = (tmp == 0.0f) ? 1e-10 : tmp;
-	tmp = avergEmission / tmp;
-
-	return tmp < 1e-3 ? 0 : (tmp > 0.99999) ? 1.000001 : tmp;
-}
-
-
-Vec radiance(const Ray& r, int depth, BVHTree& bvh, std::vector<Object*>& lightObjects) {
-
-	Vec ret;
-	Intersection intersection;
-
-	if (++depth > 3)
-	{
-		if (depth > 5 || floatrand() > 0.5)
-		{
-			return ret + sampleAllLight(r, bvh, lightObjects);
-		}
-	}
-
-	if (bvh.intersect(r, intersection) == 0)
-	{
-		// sampling the light
-		if (depth != 1)
-		{
-			ret = ret + sampleAllLight(r, bvh, lightObjects);
-		}
-		return ret;
-	}
-
-	auto material = intersection.material;
-
-
-	const auto& ambient = material->ambient;
-	const auto& emission = material->emission;
-	const auto& transmittance = material->transmittance;
-	const auto dissolve = material->dissolve;
-	const auto shininess = material->shininess;
-	const auto& specular = material->specular;
-	const float specularMax = floatMax(specular);
-	const float ambientMax = floatMax(ambient);
-	const float emissionMax = floatMax(emission);
-	const float transmittanceMax = floatMax(transmittance);
-
-	ret = Vec(emission) + ambient;
-
-	// stop if hit the light
-	if (emissionMax != 0 || ambientMax > 1.0)
-		return ret;
-
-	Vec n = intersection.normal;
-	Vec nl = n.dot(r.direction) < 0 ? n : n * -1;
-
-	// reflect probality reflectance
-	Vec refelDir = (r.direction - n * 2 * n.dot(r.direction)).normalized();
-
-	if (transmittanceMax != 0)
-	{
-		bool into = r.direction.dot(n) < 0 ? true : false;
-		float ior = material->ior;
-		float nnt = into ? 1.0f / ior : ior;
-		float ddn = r.direction.dot(nl);
-		float cos2t = 1.0f - nnt * nnt * (1.0f - ddn * ddn);
-
-		if (cos2t < 0)
-		{
-			return ret + radiance(Ray(intersection.point, refelDir), depth, bvh, lightObjects).mult(transmittance);
-		}
-
-		Vec transDir = (r.direction * nnt - n * ((into ? 1 : -1) * (ddn * nnt + sqrt(cos2t)))).normalized();
-		float a = ior - 1, b = ior + 1, R0 = a * a / (b * b), c = 1 - (into ? -ddn : transDir.dot(n));
-		float fresnel = R0 + (1 - R0) * c * c * c * c * c;
-		float transmitProbability = 1 - fresnel;
-
-		// Probablity
-		float  P = .25 + .5 * fresnel, RP = fresnel / P, TP = transmitProbability / (1 - P);
-
-		if (floatrand() < transmitProbability)
-		{
-			float recipTransProb = (transmitProbability != 0.0f ? 1. / transmitProbability : 1e-6);
-			return ret + radiance(Ray(intersection.point, transDir), depth, bvh, lightObjects).mult(transmittance) * TP;
-		}
-		else
-		{
-			return ret + radiance(Ray(intersection.point, refelDir), depth, bvh, lightObjects).mult(transmittance) * RP;
-		}
-	}
-
-	auto diffuse = Vec(material->diffuse);
-	float diffuseMax = vecMax(diffuse);
-	if (intersection.object->texture != nullptr)
-	{
-		auto  texture = intersection.object->getTextureByPoint(intersection.point);
-		diffuse = diffuse.mult(texture);
-	}
-
-	float diffuseProbability = diffuseMax / (diffuseMax + specularMax);
-	if (specularMax == 0 || floatrand() < diffuseProbability)
-	{
-
-		// w,u,v is perpendicular to each other
-		Vec w = nl;
-		Vec u = ((fabs(w.x) > .1 ? Vec(0, 1) : Vec(1)).cross(w)).normalized();
-		Vec v = w.cross(u);
-		// r1:(0-2pi)~U, r2:(0-1)~U, r2s
-		float theta = PI * floatrand(2);
-		float phi = PI * floatrand(0.5);
-		float sinphi = std::sin(phi);
-		// a random reflection ray
-
-		Vec randDir = u * std::cos(theta) * sinphi + v * std::sin(theta) * sinphi + w * std::cos(phi);
-		float recipDiffProb = (diffuseProbability != 0.0f ? 1. / diffuseProbability : 0.);
-		return ret + radiance(Ray(intersection.point, randDir), depth, bvh, lightObjects).mult(diffuse) * recipDiffProb;
-	}
-	else
-	{
-		// specular
-		int lightObj = rand() % lightObjects.size();
-		// probality of Sample this light
-
-		float pdf = 0;
-		//caculatePdf(intersection, lightObjects[lightObj]);
-		if (pdf != 0 && floatrand(0.999) < pdf) {
-			return  ret + sampleAllLight(Ray(intersection.point, intersection.normal), bvh, lightObjects) * (1.0f / pdf);
-		}
-		// perpendicular to each other
-		Vec refelRandDir;
-		//Bsdf
-		Vec u = ((fabs(refelDir.x) > .1 ? Vec(0, 1) : Vec(1)).cross(refelDir)).normalized();
-		Vec v = refelDir.cross(u).normalized();
-		float theta = floatrand(2) * PI;
-		refelRandDir = (refelDir + (u * std::cos(theta) + v * std::sin(theta)) * floatrand(0.2)).normalized();
-		float recipSpecProb = 1.0f / ((1.0f - diffuseProbability) * (1 - pdf));
-		Vec radi = radiance(Ray(intersection.point, refelRandDir), depth, bvh, lightObjects) * recipSpecProb;
-		// if(1.0f - pdf >1e-6)
-		return  ret + radi.mult(specular) * std::pow(refelRandDir.dot(refelDir), shininess);
-
-
-	}
-}
-
-
-
 int main(int argc, char* argv[]) {
 	int w, h;
 	float fovy;
@@ -216,129 +42,254 @@ int main(int argc, char* argv[]) {
 	modelSelect = 3;
 	detailPrint = 1;
 	samps = 4096;
-
-	if (!objLoader(modelSelect, shapes, materials, detailPrint) ||
-		!xmlCameraAndCorrectMaterial(modelSelect, w, h, fovy, cam, camUp, materials, detailPrint))
+	// 0: full precision BVH nodes, 8 or 16: nodes with quantized child boxes
+	int bvhQuantBits = 0;
+	// reuse tmpData/<scene>.sceneCache while none of the scene files changed
+	bool useSceneCache = true;
+	// e.g. "tmpData/staircase.bvh": written by the first run, then mapped and traversed in place,
+	// so every render process of the scene shares one copy of the nodes through the page cache
+	std::string bvhFile = "";
+	// build the triangles while the obj is parsed instead of going through tinyobj shapes, which keeps the peak
+	// memory of loading close to the size of the scene itself
+	bool streamGeometry = true;
+	// nearest reads the full resolution texel under the hit, the others pick mip levels from the ray cone footprint
+	TextureFilter textureFilter = TextureFilter::trilinear;
+	// tiled: textures are stored in 4x4 texel tiles, a tile per cache line, scanline: as the images are decoded
+	TextureLayout textureLayout = TextureLayout::scanline;
+	// times texel fetches from both layouts once the textures are loaded
+	bool benchmarkTextures = false;
+	// 0 keeps every texture in memory. otherwise textures are converted to tile files in tmpData and read on demand,
+	// keeping at most this many MB of tiles in memory (for scenes with more texture data than fits, the scene cache is off)
+	size_t textureCacheMB = 0;
+	// seeds rand() for the first sample pass, a resumed render continues from renderSeed + the passes already done.
+	// checkpoints remember it and are only resumed with the same seed
+	unsigned int renderSeed = 1;
+	// only these pixels are rendered and saved, e.g. { { 320, 0, 640, 360 } } for a part of the left bottom quarter
+	// of a 1280x720 frame (see Region). the checkpoint keeps the frame, so a crop resumes or merges with full renders
+	std::vector<Region> renderRegions;
+	// tonemapping and exposure of the bitmap, and whether the linear image is also written as A<scene>.pfm or .exr
+	OutputSettings output;
+	output.tonemap = Tonemap::clamp;
+	output.exposure = 0.0f;
+	output.hdr = HdrFormat::none;
+	// albedo, normal, depth, material and primitive id of the first hits, written next to the image at the end
+	bool renderAovs = false;
+	// also writes A<scene>.denoised.bmp (and the hdr format), filtered with the aovs and the noise of every pixel.
+	// meant for previews at 64 - 256 spp. the aovs and the noise are not in the checkpoint, they only cover the passes
+	// of this run, so a render resumed from a checkpoint is not denoised (and its aovs are only written if it ran a pass)
+	bool denoiseOutput = false;
+	// the time of every stage and the ray and bvh counters of the render are printed at the end (with detailPrint)
+	// and written to this json file, e.g. "tmpData/staircase.stats.json". "" writes none
+	std::string statsFile = "";
+	// debug mode: instead of the image, writes how many bvh nodes and primitives the rays of every pixel visit
+	// (see TraversalHeatmap), averaged over heatmapSamples samples. primary rays alone are cheap enough for 1 spp
+	HeatmapRays heatmap = HeatmapRays::none;
+	int heatmapSamples = 1;
+
+	// --worker <seed> <passes> <checkpoint> [threads]: renders passes sample passes seeded with seed into checkpoint,
+	//     without bitmaps. started by --distribute, or by hand on other machines
+	// --distribute <workers> <passes> [threads]: runs that many workers of this program, seeded from renderSeed,
+	//     and merges their checkpoints as they finish
+	// --merge <output> <checkpoint>...: merges checkpoints of one scene rendered with different seeds
+	std::string workerCheckpoint;
+	if (argc >= 5 && strcmp(argv[1], "--worker") == 0)
+	{
+		renderSeed = static_cast<unsigned int>(strtoul(argv[2], nullptr, 10));
+		samps = atoi(argv[3]);
+		workerCheckpoint = argv[4];
+#ifdef _OPENMP
+		if (argc >= 6 && atoi(argv[5]) > 0)
+			omp_set_num_threads(atoi(argv[5]));
+#endif
+	}
+	else if (argc >= 4 && strcmp(argv[1], "--distribute") == 0)
+		return runDistributed(argv[0], modelSelect, atoi(argv[2]), atoi(argv[3]), renderSeed, argc >= 5 ? atoi(argv[4]) : 0) ? 0 : 1;
+	else if (argc >= 4 && strcmp(argv[1], "--merge") == 0)
+	{
+		std::vector<Vec> image;
+		CheckpointInfo info;
+		if (!mergeCheckpoints(std::vector<std::string>(argv + 3, argv + argc), argv[2], image, info))
+			return 1;
+		printf("%d spp merged into %s\n", info.samples, argv[2]);
+		save_bitmap(modelSelect, image.data(), info.width, info.height, 1.0f, "", output);
+		saveHdr(modelSelect, output.hdr, image.data(), info.width, info.height, output.hdrCompress);
 		return 0;
+	}
 
-	std::vector<Object*> objects;
-	std::vector<Object*> lightObjects;
-	transferTinyobjToTriangle(shapes, objects, lightObjects, materials, detailPrint);
-
+	RenderStats stats;
+	stats.begin("load");
+	PrimitiveStore prims;
+	prims.textureFilter = textureFilter;
+	prims.textureLayout = textureLayout;
+	std::vector<PrimRef> lightObjects;
+	std::vector<LinearBVHNode> bvhNodes;
+	std::unique_ptr<TextureCache> textureCache(textureCacheMB != 0 ? new TextureCache(textureCacheMB << 20) : nullptr);
+	// decodes the textures in the background while the geometry and the bvh are built
+	TextureLoader textureLoader(0, textureCache.get());
+	bool cached = useSceneCache && !textureCache &&
+		loadSceneCache(modelSelect, w, h, fovy, cam, camUp, materials, prims, lightObjects, bvhNodes, detailPrint);
+	if (!cached && streamGeometry)
+	{
+		if (!objStreamLoader(modelSelect, materials, prims, textureLoader, detailPrint) ||
+			!xmlCameraAndCorrectMaterial(modelSelect, w, h, fovy, cam, camUp, materials, detailPrint))
+			return 0;
+		collectLights(prims, lightObjects);
+	}
+	else if (!cached)
+	{
+		if (!objLoader(modelSelect, shapes, materials, detailPrint) ||
+			!xmlCameraAndCorrectMaterial(modelSelect, w, h, fovy, cam, camUp, materials, detailPrint))
+			return 0;
+		transferTinyobjToTriangle(shapes, prims, lightObjects, materials, textureLoader, detailPrint);
+	}
 
 
-	BVHTree bvh{ objects };
+	stats.begin("bvh build");
+	BVHTree bvh{ prims, bvhNodes, bvhFile };
+	stats.begin("load");
+	textureLoader.finish(prims, detailPrint);
+	stats.end();
+	if (benchmarkTextures)
+		benchmarkTexelFetch(prims);
+	if (useSceneCache && !cached)
+	{
+		stats.begin("io");
+		bvh.flatten(bvhNodes);
+		saveSceneCache(modelSelect, w, h, fovy, cam, camUp, materials, prims, lightObjects, bvhNodes);
+		stats.end();
+	}
 	if (detailPrint)
 	{
 		int maxdepth = 0, alldepth = 0;
 		bvh.depthInfo(bvh.root, 0, maxdepth, alldepth);
-		printf("dfs object num : %zd, max depth:%d, average depth:%f\n\n",
-			objects.size(), maxdepth, static_cast<float>(alldepth) / static_cast<float>(objects.size()));
+		printf("dfs object num : %zd, max depth:%d, average depth:%f\n",
+			prims.size(), maxdepth, static_cast<float>(alldepth) / static_cast<float>(prims.size()));
+		printf("bvh node memory: %.2f MB, texture memory: %.2f MB\n",
+			bvh.nodeMemoryBytes() / (1024.0 * 1024.0), prims.arena.bytesUsed() / (1024.0 * 1024.0));
+		if (bvh.isMapped())
+			printf("bvh nodes mapped from %s\n", bvhFile.c_str());
 	}
+	stats.begin("bvh build");
+	if (bvhQuantBits && bvh.quantize(bvhQuantBits) && detailPrint)
+		printf("quantized bvh (%d bit) node memory: %.2f MB\n", bvhQuantBits, bvh.nodeMemoryBytes() / (1024.0 * 1024.0));
+	stats.end();
+	if (detailPrint)
+		printf("\n");
 #ifdef _DEBUG_
 	w /= 4;
 	h /= 4;
 #endif // DEBUF_
-	// xyz increment;
-	Vec cyIncure, cxIncure, czIncure;
+	PinholeCamera camera(cam, camUp, fovy, w, h);
+
+	if (heatmap != HeatmapRays::none)
 	{
-		Vec cv = cam.direction;
-		Vec cu = camUp - cv * (camUp.dot(cv));
-		Vec _aaa = cu.dot(cv);
-		Vec cw = cv.cross(cu).normalized();
-		float near = 0.1f;
-		float tanFovy = std::tan(fovy * PI / 180.0f);
-		czIncure = cv * near;
-		cyIncure = cu * (tanFovy * near / static_cast<float>(h));
-		cxIncure = cw * cyIncure.length();
+		std::vector<PixelSpan> spans = regionSpans(renderRegions, w, h);
+		int spanNum = static_cast<int>(spans.size());
+		TraversalHeatmap costs(w, h);
+		srand(renderSeed);
+		printf("Tracing the %s rays of %d spp for the heatmap\n", heatmap == HeatmapRays::primary ? "camera" : "path", heatmapSamples);
+		stats.begin("render");
+		for (int s = 0; s < heatmapSamples; s++) {
+#pragma omp parallel for schedule(dynamic)
+			for (int i = 0; i < spanNum; i++) {
+				int y = spans[i].y;
+				for (int x = spans[i].x0; x < spans[i].x1; x++) {
+					Ray ray = camera.ray(x, y);
+					RenderCounters before = threadCounters();
+					if (heatmap == HeatmapRays::primary)
+					{
+						Intersection first;
+						threadCounters().countRay(RayKind::camera);
+						bvh.intersect(ray, first);
+					}
+					else
+						radiance(ray, 0, bvh, lightObjects);
+					costs.add(y * w + x, before);
+				}
+			}
+		}
+		stats.begin("io");
+		costs.save(modelSelect, spanBounds(spans));
+		stats.end();
+		if (detailPrint)
+			stats.print();
+		return 0;
 	}
 
+	stats.begin("io");
 	Vec* c = new Vec[w * h];
+	std::vector<uint32_t> pixelSamples(static_cast<size_t>(w) * h, 0);
 	int spp = 1 * samps;
 	float recipSpp = 1.0 / spp;
 
 	int s = 1;
+	// checkpoints and progress bitmaps are written in the background from a copy of c
+	CheckpointWriter checkpointWriter;
+	std::string checkpointFile = workerCheckpoint.empty() ? checkpointPath(modelSelect, w, h) : workerCheckpoint;
+	CheckpointInfo checkpoint;
+	checkpoint.width = w;
+	checkpoint.height = h;
+	checkpoint.sceneHash = checkpointSceneHash(modelSelect, fovy, cam, camUp, materials, prims);
+	checkpoint.seed = renderSeed;
+	checkpoint.smax = spp;
 
 #ifdef _DEBUG_
 	srand(0);
+	checkpointFile.clear();
 	if (0)
 #endif // _DEBUG_
-		if (readArrFromFile(modelSelect, c, s, spp, w, h))
-			printf("Rendering begin with read data file! now spp: %d \n", s);
-		else
-			printf("Rendering begin!!!! \n");
-
-#define CUTPHOTO 1 // --------------------------------------------------------------------
-
-#ifdef _DEBUG_
-	int xmin = 0, xmax = w - 1, ymin = 0, ymax = h - 1;
-	if (CUTPHOTO) {
-		/*
-		xmin = w / 2 - w / 16;
-		xmax = w / 2 + w / 16;
-		*/
-
-		xmin = w / 4;
-		xmax = w / 2;
-		//ymin = 1;
-		ymax = h / 2;
-
-		int a = 1;
-		for (int y = ymin; y < ymax; y++)
+		if (readCheckpoint(checkpointFile, checkpoint, checkpoint, c, pixelSamples.data()))
 		{
-			if (xmin > 0)
-				c[y * w + xmin - 1].x = 10.0f;
-			if (xmax < w - 1)
-				c[y * w + xmax + 1].x = 10.0f;
+			s = checkpoint.samples + 1;
+			checkpoint.smax = spp;
+			srand(renderSeed + checkpoint.samples);
+			printf("Rendering begin with read data file! now spp: %d \n", s);
 		}
-		for (int x = xmin; x < xmax; x++)
+		else
 		{
-			if (ymin > 0)
-				c[(ymin - 1) * w + x].x = 10.0f;
-			if (ymax < w - 1)
-				c[(ymax + 1) * w + x].x = 10.0f;
+			srand(renderSeed);
+			printf("Rendering begin!!!! \n");
 		}
-	}
 
-	printf("DEBUG Rendring begin ,x:(%d-%d), y(%d-%d),w: %d,h: %d\n", xmin, xmax, ymin, ymax, w, h);
-#endif //DEBUF_
+	// the pixels of the regions as row runs, each pass goes over them
+	std::vector<PixelSpan> spans = regionSpans(renderRegions, w, h);
+	Region bounds = spanBounds(spans);
+	std::unique_ptr<AovBuffers> aovs(renderAovs || denoiseOutput ? new AovBuffers(w, h, materials, prims) : nullptr);
+	if (!renderRegions.empty())
+		printf("Rendering %zd regions, x:(%d-%d), y:(%d-%d) of %dx%d\n",
+			renderRegions.size(), bounds.x0, bounds.x1 - 1, bounds.y0, bounds.y1 - 1, w, h);
+	int firstPass = s;
 
+	stats.begin("render");
 
 	for (s; s <= samps; s++) {
 		if (s % 4 == 0) {
 			printf("Rendering (%d spp) %5.2f%%", spp, 100. * s / (samps));
 			// save file  per 16 spp;
 			if (s % 16 == 0) {
-#ifdef _DEBUG_
-				if (0)
-#endif // _DEBUG_
-					writeArrToFile(modelSelect, c, s, spp, w, h);
-				save_bitmap(modelSelect, c, w, h, static_cast<float>(s) / static_cast<float>(samps));
+				checkpoint.samples = s - 1;
+				CheckpointWriter::Saved saveBitmap = [=](const CheckpointInfo& info, const Vec snapshot[], const uint32_t samples[]) {
+					saveRegionImage(modelSelect, snapshot, samples, info.smax, w, bounds, output);
+				};
+				checkpointWriter.submit(checkpointFile, checkpoint, c, pixelSamples.data(),
+					workerCheckpoint.empty() ? saveBitmap : CheckpointWriter::Saved());
 			}
 			printf("\n");
 		}
-#pragma omp parallel for
-#ifdef _DEBUG_
-		for (int y = ymin; y < h; y++) {
-
-			if (y > ymax)
-				continue;
-#else
-		for (int y = 0; y < h; y++) {
-#endif //_DEBUG_
-			for (int x = 0; x < w; x++) {
-#ifdef _DEBUG_
-				if (x < xmin)
-					continue;
-				else if (x > xmax)
-					continue;
-#endif //_DEBUG_
-				float r1 = floatrand(1) - 0.5;
-				float r2 = floatrand(1) - 0.5;
-				Vec d = cxIncure * (r1 + x - w / 2) +
-					cyIncure * (r2 + y - h / 2) + czIncure;
-				Vec r = radiance(Ray(cam.origin + d, d.normalized()), 0, bvh, lightObjects);
+		int spanNum = static_cast<int>(spans.size());
+#pragma omp parallel for schedule(dynamic)
+		for (int i = 0; i < spanNum; i++) {
+			int y = spans[i].y;
+			RenderCounters& counters = threadCounters();
+			for (int x = spans[i].x0; x < spans[i].x1; x++) {
+				uint64_t traced = counters.rays[0] + counters.rays[1];
+				AovSample first;
+				Vec r = radiance(camera.ray(x, y), 0, bvh, lightObjects, aovs ? &first : nullptr);
+				counters.countPath(counters.rays[0] + counters.rays[1] - traced);
 				c[y * w + x] = c[y * w + x] + r * recipSpp;
+				pixelSamples[y * w + x]++;
+				if (aovs)
+					aovs->add(y * w + x, first, r);
 #ifdef _DEBUG_
 				if (std::fpclassify(r.x) > 0 || std::fpclassify(r.y) > 0 || std::fpclassify(r.z) > 0)
 				{
@@ -366,6 +317,51 @@ int main(int argc, char* argv[]) {
 	printf("min:%7f------max:%7f \n", cmin, cmax);
 #endif //_DEBUG_
 
-	save_bitmap(modelSelect, c, w, h);
+	// the finished render, for resuming with more samples or merging with other ones
+	stats.begin("io");
+	checkpoint.samples = s - 1;
+	checkpointWriter.submit(checkpointFile, checkpoint, c, pixelSamples.data());
+	checkpointWriter.wait();
+	// the checkpoints and progress bitmaps of the render were written on the writer thread, meanwhile
+	stats.add("background io", checkpointWriter.milliseconds(), static_cast<int>(checkpointWriter.writes()));
+	if (workerCheckpoint.empty())
+	{
+		saveRegionImage(modelSelect, c, pixelSamples.data(), spp, w, bounds, output);
+		if (renderAovs && firstPass <= samps)
+			aovs->save(modelSelect, bounds, output);
+		else if (renderAovs)
+			printf("\nno pass rendered after the checkpoint, no aovs written\n");
+	}
+	if (denoiseOutput && workerCheckpoint.empty() && firstPass > 1)
+		printf("\nnot denoised: resumed from a checkpoint with %d spp, the aovs and the noise only cover the passes of this run\n",
+			firstPass - 1);
+	else if (denoiseOutput && workerCheckpoint.empty())
+	{
+		stats.begin("denoise");
+		auto start = std::chrono::steady_clock::now();
+		std::vector<Vec> denoised;
+		denoise(regionMeans(c, pixelSamples.data(), spp, w, bounds), *aovs, bounds, denoised);
+		printf("\ndenoised in %.1f ms\n", std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+		int bw = bounds.x1 - bounds.x0, bh = bounds.y1 - bounds.y0;
+		stats.begin("io");
+		save_bitmap(modelSelect, denoised.data(), bw, bh, 1.0f, imageName(modelSelect) + ".denoised.bmp", output);
+		saveHdr(modelSelect, output.hdr, denoised.data(), bw, bh, output.hdrCompress, ".denoised");
+	}
+	stats.end();
+	if (textureCache)
+		textureCache->printStats();
+
+	stats.set("scene", imageName(modelSelect).substr(1));
+	stats.set("width", w);
+	stats.set("height", h);
+	size_t pixels = 0;
+	for (auto& span : spans)
+		pixels += span.x1 - span.x0;
+	stats.set("passes", s - firstPass);
+	stats.set("pixelsPerPass", static_cast<double>(pixels));
+	if (detailPrint)
+		stats.print();
+	if (!statsFile.empty() && !stats.writeJson(statsFile))
+		printf("failed to write %s\n", statsFile.c_str());
 	return 0;
 		}
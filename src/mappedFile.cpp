@@ -0,0 +1,221 @@
+#include "mappedFile.h"
+
+#include <algorithm>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <process.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+std::string tmpFileName(const std::string& path)
+{
+#ifdef _WIN32
+	int pid = _getpid();
+#else
+	int pid = static_cast<int>(getpid());
+#endif
+	return path + "." + std::to_string(pid) + ".tmp";
+}
+
+#ifdef _WIN32
+
+bool MappedFile::open(const std::string& path)
+{
+	close();
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+		CloseHandle(file);
+		return false;
+	}
+
+	HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	// the mapping keeps the file alive, the file handle is not needed any more
+	CloseHandle(file);
+	if (mapping == nullptr)
+		return false;
+
+	void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (view == nullptr) {
+		CloseHandle(mapping);
+		return false;
+	}
+
+	ptr = static_cast<const char*>(view);
+	length = static_cast<size_t>(fileSize.QuadPart);
+	handle = mapping;
+	return true;
+}
+
+void MappedFile::close()
+{
+	if (ptr != nullptr)
+		UnmapViewOfFile(ptr);
+	if (handle != nullptr)
+		CloseHandle(static_cast<HANDLE>(handle));
+	ptr = nullptr;
+	length = 0;
+	handle = nullptr;
+}
+
+void MappedFile::release(size_t offset, size_t size)
+{
+	if (ptr == nullptr || offset >= length)
+		return;
+	// unlocking pages that are not locked takes them out of the working set
+	VirtualUnlock(const_cast<char*>(ptr) + offset, std::min(size, length - offset));
+}
+
+bool RandomAccessFile::open(const std::string& path)
+{
+	close();
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	handle = file;
+	return true;
+}
+
+void RandomAccessFile::close()
+{
+	if (handle != nullptr)
+		CloseHandle(static_cast<HANDLE>(handle));
+	handle = nullptr;
+}
+
+bool RandomAccessFile::read(uint64_t offset, size_t size, void* out) const
+{
+	if (handle == nullptr)
+		return false;
+	char* dst = static_cast<char*>(out);
+	while (size > 0) {
+		// a synchronous handle reads at the offset of the OVERLAPPED, several threads can read through it at once
+		OVERLAPPED at = {};
+		at.Offset = static_cast<DWORD>(offset);
+		at.OffsetHigh = static_cast<DWORD>(offset >> 32);
+		DWORD chunk = static_cast<DWORD>(std::min<size_t>(size, 1u << 30));
+		DWORD got = 0;
+		if (!ReadFile(static_cast<HANDLE>(handle), dst, chunk, &got, &at) || got == 0)
+			return false;
+		dst += got;
+		offset += got;
+		size -= got;
+	}
+	return true;
+}
+
+bool fileStamp(const std::string& path, uint64_t& size, int64_t& mtime)
+{
+	struct _stat64 st;
+	if (_stat64(path.c_str(), &st) != 0)
+		return false;
+	size = static_cast<uint64_t>(st.st_size);
+	mtime = static_cast<int64_t>(st.st_mtime);
+	return true;
+}
+
+#else
+
+bool MappedFile::open(const std::string& path)
+{
+	close();
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		::close(fd);
+		return false;
+	}
+
+	void* view = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+	// the mapping keeps the file alive, the descriptor is not needed any more
+	::close(fd);
+	if (view == MAP_FAILED)
+		return false;
+
+	ptr = static_cast<const char*>(view);
+	length = static_cast<size_t>(st.st_size);
+	return true;
+}
+
+void MappedFile::close()
+{
+	if (ptr != nullptr)
+		munmap(const_cast<char*>(ptr), length);
+	ptr = nullptr;
+	length = 0;
+	handle = nullptr;
+}
+
+void MappedFile::release(size_t offset, size_t size)
+{
+	if (ptr == nullptr || offset >= length)
+		return;
+	// madvise wants a page aligned start, the partial pages at both ends are kept
+	size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+	size_t begin = (offset + page - 1) / page * page;
+	size_t end = std::min(offset + size, length) / page * page;
+	if (begin < end)
+		madvise(const_cast<char*>(ptr) + begin, end - begin, MADV_DONTNEED);
+}
+
+bool RandomAccessFile::open(const std::string& path)
+{
+	close();
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	handle = reinterpret_cast<void*>(static_cast<intptr_t>(fd) + 1);
+	return true;
+}
+
+void RandomAccessFile::close()
+{
+	if (handle != nullptr)
+		::close(static_cast<int>(reinterpret_cast<intptr_t>(handle) - 1));
+	handle = nullptr;
+}
+
+bool RandomAccessFile::read(uint64_t offset, size_t size, void* out) const
+{
+	if (handle == nullptr)
+		return false;
+	int fd = static_cast<int>(reinterpret_cast<intptr_t>(handle) - 1);
+	char* dst = static_cast<char*>(out);
+	while (size > 0) {
+		ssize_t got = pread(fd, dst, size, static_cast<off_t>(offset));
+		if (got <= 0)
+			return false;
+		dst += got;
+		offset += static_cast<uint64_t>(got);
+		size -= static_cast<size_t>(got);
+	}
+	return true;
+}
+
+bool fileStamp(const std::string& path, uint64_t& size, int64_t& mtime)
+{
+	struct stat st;
+	if (stat(path.c_str(), &st) != 0)
+		return false;
+	size = static_cast<uint64_t>(st.st_size);
+	mtime = static_cast<int64_t>(st.st_mtime);
+	return true;
+}
+
+#endif
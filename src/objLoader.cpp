@@ -1,31 +1,42 @@
-#define TINYOBJLOADER_IMPLEMENTATION
 #include "third/tinyobjloader/tiny_obj_loader.h"
 
-#define STB_IMAGE_IMPLEMENTATION
-#include "third/stb/stb_image.h"
-
 #include "objLoader.h"
+#include "objParser.h"
+#include "checkpoint.h"
+#include "distributed.h"
+#include "mappedFile.h"
+#include "textureLoader.h"
 
+#include <chrono>
 #include <fstream>
 #include <map>
 #include <iostream>
 #include <algorithm>
+#include <cassert>
 
 
 
 
-bool xmlCameraAndCorrectMaterial(int modelSelect, int& width, int& height, float& fovy, Ray& cam, Vec& camUp, std::vector<tinyobj::material_t>& materials, int detailPrint) {
+bool scenePaths(int modelSelect, std::string& objFile, std::string& basePath, std::string& xmlFile)
+{
+	if (modelSelect == 1) basePath = "./scenes/cornell-box/", objFile = "cornell-box.obj", xmlFile = "cornell-box.xml";
+	else if (modelSelect == 2) basePath = "./scenes/veach-mis/", objFile = "veach-mis.obj", xmlFile = "veach-mis.xml";
+	else if (modelSelect == 3) basePath = "./scenes/staircase/", objFile = "stairscase.obj", xmlFile = "staircase.xml";
+	else if (modelSelect == 4) basePath = "./scenes/test/", objFile = "test.obj", xmlFile = "test.xml";
+	else return false;
+
+	objFile = basePath + objFile;
+	xmlFile = basePath + xmlFile;
+	return true;
+}
 
+bool xmlCameraAndCorrectMaterial(int modelSelect, int& width, int& height, float& fovy, Ray& cam, Vec& camUp, std::vector<tinyobj::material_t>& materials, int detailPrint) {
 
-	const char* filename;
-	if (modelSelect == 1) filename = "./scenes/cornell-box/cornell-box.xml";
-	else if (modelSelect == 2)filename = "./scenes/veach-mis/veach-mis.xml";
-	else if (modelSelect == 3)filename = "./scenes/staircase/staircase.xml";
-	else if (modelSelect == 4)filename = "./scenes/test/test.xml";
-	else  return false;
 
-	if (filename == nullptr)
+	std::string objFile, basePath, filename;
+	if (!scenePaths(modelSelect, objFile, basePath, filename))
 		return false;
+
 	std::ifstream File(filename);
 	// ȡ XML ļ
 	std::string xmlText;
@@ -123,26 +134,12 @@ bool objLoader(int modelSelect,
 	std::vector<tinyobj::material_t>& materials,
 	int detailPrint)
 {
-	if (modelSelect == 1)
-	{
-		loadObj("./scenes/cornell-box/cornell-box.obj", shapes, materials, "./scenes/cornell-box/", detailPrint);
-	}
-	else if (modelSelect == 2)
-	{
-		loadObj("./scenes/veach-mis/veach-mis.obj", shapes, materials, "./scenes/veach-mis/", detailPrint);
-	}
-	else if (modelSelect == 3)
-	{
-		loadObj("./scenes/staircase/stairscase.obj", shapes, materials, "./scenes/staircase/", detailPrint);
-	}
-	else if (modelSelect == 4)
-	{
-		loadObj("./scenes/test/test.obj", shapes, materials, "./scenes/test/", detailPrint);
-	}
-	else
+	std::string objFile, basePath, xmlFile;
+	if (!scenePaths(modelSelect, objFile, basePath, xmlFile))
 	{
 		fprintf(stderr, "please input a right number!"); return 0;
 	}
+	loadObj(objFile.c_str(), shapes, materials, basePath.c_str(), detailPrint);
 	return 1;
 }
 
@@ -152,11 +149,21 @@ bool loadObj(
 	std::vector<tinyobj::material_t>& materials,
 	const char* basePath,
 	int detailPrint,
-	unsigned int flags)
+	unsigned int flags,
+	bool parallelParse)
 {
 	std::cout << "Loading " << fileName << std::endl;
 	std::string err;
-	bool ret = tinyobj::LoadObj(shapes, materials, err, fileName, basePath, flags);
+	auto start = std::chrono::steady_clock::now();
+	bool ret = parallelParse ? parallelLoadObj(shapes, materials, err, fileName, basePath, flags) :
+		tinyobj::LoadObj(shapes, materials, err, fileName, basePath, flags);
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	uint64_t fileSize = 0;
+	int64_t mtime;
+	if (ret && fileStamp(fileName, fileSize, mtime) && seconds > 0)
+		printf("Parsed %.2f MB in %.1f ms (%.1f MB/s, %s)\n", fileSize / (1024.0 * 1024.0), seconds * 1000,
+			fileSize / (1024.0 * 1024.0) / seconds, parallelParse ? "parallel" : "tinyobj");
 
 	if (!err.empty()) {
 		std::cerr << err << std::endl;
@@ -182,24 +189,44 @@ bool loadObj(
 }
 
 
-bool transferTinyobjToTriangle(std::vector<tinyobj::shape_t>& shapes, std::vector<Object*>& objects,
-	std::vector<Object*>& lightObjects, std::vector<tinyobj::material_t>& materials, int detailPrint) {
+bool transferTinyobjToTriangle(std::vector<tinyobj::shape_t>& shapes, PrimitiveStore& prims,
+	std::vector<PrimRef>& lightObjects, std::vector<tinyobj::material_t>& materials, TextureLoader& textures, int detailPrint) {
+
+	size_t faceNum = 0, vertexNum = 0;
+	for (auto& shape : shapes)
+	{
+		faceNum += shape.mesh.indices.size() / 3;
+		vertexNum += shape.mesh.positions.size() / 3;
+	}
+	prims.triangles.reserve(faceNum);
+	prims.mesh.positions.reserve(vertexNum);
+	prims.mesh.texcoords.reserve(vertexNum * 2);
 
 	std::map<int, Texture*> tex;
 	for (auto& shape : shapes)
 	{
 		auto& mesh = shape.mesh;
 		bool mlight = mesh.indices.size() == 6996 ? 1 : 0;
+		bool hasUV = mesh.texcoords.size() / 2 == mesh.positions.size() / 3;
+
+		// copy the shape's vertices into the shared buffers once, triangles only keep indices
+		uint32_t base = static_cast<uint32_t>(prims.mesh.positions.size());
+		for (size_t v = 0; v < mesh.positions.size() / 3; v++)
+		{
+			if (hasUV)
+				prims.mesh.addVertex(&mesh.positions[3 * v], mesh.texcoords[2 * v], mesh.texcoords[2 * v + 1]);
+			else
+				prims.mesh.addVertex(&mesh.positions[3 * v]);
+		}
 
 		for (size_t f = 0; f < mesh.indices.size() / 3; f++)
 		{
 			int matid = mesh.material_ids[f];
 			if (mlight == false || matid < 5)
 			{
-				if (mesh.texcoords.size() / 2 == mesh.positions.size() / 3)
+				Texture* texData = nullptr;
+				if (hasUV)
 				{
-					Texture* texData = nullptr;
-
 					// texture
 					if (materials[matid].diffuse_texname.size() != 0)
 					{
@@ -214,12 +241,7 @@ bool transferTinyobjToTriangle(std::vector<tinyobj::shape_t>& shapes, std::vecto
 						*/
 						if (tex.find(matid) == tex.end())
 						{
-							int width, height, channels;
-							unsigned char* data = stbi_load(materials[matid].diffuse_texname.c_str(), &width, &height, &channels, 0);
-							texData = new Texture{
-								width,height,channels,
-								data
-							};
+							texData = textures.request(materials[matid].diffuse_texname, prims);
 							tex[matid] = texData;
 						}
 						else
@@ -228,94 +250,91 @@ bool transferTinyobjToTriangle(std::vector<tinyobj::shape_t>& shapes, std::vecto
 						}
 					}
 
-					objects.push_back(new Triangle(
-						&mesh.positions[3 * mesh.indices[3 * f + 0]],
-						&mesh.positions[3 * mesh.indices[3 * f + 1]],
-						&mesh.positions[3 * mesh.indices[3 * f + 2]],
-						Vec(mesh.texcoords[2 * mesh.indices[3 * f + 0] + 0], mesh.texcoords[2 * mesh.indices[3 * f + 0] + 1], 0),
-						Vec(mesh.texcoords[2 * mesh.indices[3 * f + 1] + 0], mesh.texcoords[2 * mesh.indices[3 * f + 1] + 1], 0),
-						Vec(mesh.texcoords[2 * mesh.indices[3 * f + 2] + 0], mesh.texcoords[2 * mesh.indices[3 * f + 2] + 1], 0),
-						&materials[matid], texData
-					));
-
-				}
-				else
-				{
-					objects.push_back(new Triangle(
-						&mesh.positions[3 * mesh.indices[3 * f + 0]],
-						&mesh.positions[3 * mesh.indices[3 * f + 1]],
-						&mesh.positions[3 * mesh.indices[3 * f + 2]],
-						&materials[matid]
-					));
 				}
 
+				prims.add(Triangle(
+					base + mesh.indices[3 * f + 0],
+					base + mesh.indices[3 * f + 1],
+					base + mesh.indices[3 * f + 2],
+					&materials[matid], texData
+				));
+
 				// if obj is a light
 				if (floatMax(materials[matid].emission) != 0 || floatMax(materials[matid].ambient) > 1)
 				{
 					// if obj is bright enough or big erough
-					if (objects.back()->getArea() > 1 || floatMax(objects.back()->material->emission) > 20)
-						lightObjects.push_back(objects.back());
+					if (prims.triangles.back().getArea(prims.mesh) > 1 || floatMax(prims.triangles.back().material->emission) > 20)
+						lightObjects.push_back(PrimRef(objectType::tri, static_cast<int>(prims.triangles.size()) - 1));
 				}
 			}
 		}
 
 		if (mlight)
 		{
-			objects.push_back(new Sphere(Vec(0.0, 6.5, 2.7), 0.05, &materials[5]));
-			objects.push_back(new Sphere(Vec(0.0, 6.5, 0.0), 0.5, &materials[6]));
-			objects.push_back(new Sphere(Vec(0.0, 6.5, -2.8), 1, &materials[7]));
+			PrimRef s0 = prims.add(Sphere(Vec(0.0, 6.5, 2.7), 0.05, &materials[5]));
+			PrimRef s1 = prims.add(Sphere(Vec(0.0, 6.5, 0.0), 0.5, &materials[6]));
+			PrimRef s2 = prims.add(Sphere(Vec(0.0, 6.5, -2.8), 1, &materials[7]));
 
-			lightObjects.push_back(objects[objects.size() - 1]);
-			lightObjects.push_back(objects[objects.size() - 2]);
-			lightObjects.push_back(objects[objects.size() - 3]);
+			lightObjects.push_back(s2);
+			lightObjects.push_back(s1);
+			lightObjects.push_back(s0);
 		}
 	}
 
 
 
-	printf("Transfer over!\n  object num: %zd\n  light num: %zd\n", objects.size(), lightObjects.size());
+	printf("Transfer over!\n  object num: %zd\n  light num: %zd\n", prims.size(), lightObjects.size());
+	printf("  vertex num: %zd, mesh memory: %.2f MB (vertex buffers %.2f MB, triangles %.2f MB)\n",
+		prims.mesh.positions.size(),
+		(prims.mesh.memoryBytes() + prims.triangles.size() * sizeof(Triangle)) / (1024.0 * 1024.0),
+		prims.mesh.memoryBytes() / (1024.0 * 1024.0),
+		prims.triangles.size() * sizeof(Triangle) / (1024.0 * 1024.0));
 	if (detailPrint == 2)
 	{
-		for (size_t i = 0; i < objects.size(); i++)
+		for (size_t i = 0; i < prims.size(); i++)
 		{
-			auto box = (objects[i])->getBoundingBox();
-			if (objects[i]->getType() == objectType::tri) {
-				Triangle* tri = static_cast<Triangle*> (objects[i]);
-				Vec e1 = tri->v1 - tri->v0;
-				Vec e2 = tri->v2 - tri->v0;
-				Vec normal = e1.cross(e2).normalized();
+			PrimRef ref = i < prims.triangles.size() ? PrimRef(objectType::tri, static_cast<int>(i)) :
+				PrimRef(objectType::sph, static_cast<int>(i - prims.triangles.size()));
+			auto box = prims.getBoundingBox(ref);
+			if (ref.type == objectType::tri) {
+				const Triangle* tri = &prims.triangles[ref.index];
+				const Vec& v0 = prims.mesh.position(tri->idx[0]);
+				const Vec& v1 = prims.mesh.position(tri->idx[1]);
+				const Vec& v2 = prims.mesh.position(tri->idx[2]);
+				Vec normal = tri->getNormal(prims.mesh);
 
 				printf("normal: (%6.2f,%6.2f,%6.2f)",
 					normal.x, normal.y, normal.z
 				);
 
 				printf("object[%zd]: (%6.2f,%6.2f,%6.2f), (%6.2f,%6.2f,%6.2f), (%6.2f,%6.2f,%6.2f);\tmat:%s ;bound_box: (%6.2f,%6.2f,%6.2f), (%6.2f,%6.2f,%6.2f)\n", i,
-					tri->v0.x, tri->v0.y, tri->v0.z,
-					tri->v1.x, tri->v1.y, tri->v1.z,
-					tri->v2.x, tri->v2.y, tri->v2.z,
+					v0.x, v0.y, v0.z,
+					v1.x, v1.y, v1.z,
+					v2.x, v2.y, v2.z,
 					tri->material->name.c_str(),
 					box.min.x, box.min.y, box.min.z, box.max.x, box.max.y, box.max.z
 				);
-				if (static_cast<Triangle*>(objects[i])->texture != nullptr)
+				if (tri->texture != nullptr)
 				{
 
-					auto text = static_cast<Triangle*> (objects[i])->texture;
-					printf("  texture:img width:%d, height:%d,channels:%d; uv:(%6.2f,%6.2f), (%6.2f,%6.2f), (%6.2f,%6.2f)\n",
-						text->w, text->h, text->c,
-						tri->uv0.x, tri->uv0.y,
-						tri->uv1.x, tri->uv1.y,
-						tri->uv2.x, tri->uv2.y
+					// the texture is only requested so far, TextureLoader::finish prints its size once it is decoded
+					Vec uv0 = prims.mesh.uv(tri->idx[0]), uv1 = prims.mesh.uv(tri->idx[1]), uv2 = prims.mesh.uv(tri->idx[2]);
+					printf("  texture:%s; uv:(%6.2f,%6.2f), (%6.2f,%6.2f), (%6.2f,%6.2f)\n",
+						tri->material->diffuse_texname.c_str(),
+						uv0.x, uv0.y,
+						uv1.x, uv1.y,
+						uv2.x, uv2.y
 					);
 				}
 			}
 			else {
-				auto box = (objects[i])->getBoundingBox();
+				const Sphere* sph = &prims.spheres[ref.index];
 				printf("object[%zd]: ---sphere--- center (%6.2f,%6.2f,%6.2f) ,radius:%6.2f,\tmat:%s ;bound_box: (%6.2f,%6.2f,%6.2f), (%6.2f,%6.2f,%6.2f)\n", i,
-					static_cast<Sphere*> (objects[i])->center.x,
-					static_cast<Sphere*> (objects[i])->center.y,
-					static_cast<Sphere*> (objects[i])->center.z,
-					static_cast<Sphere*> (objects[i])->radius,
-					static_cast<Sphere*> (objects[i])->material->name.c_str(),
+					sph->center.x,
+					sph->center.y,
+					sph->center.z,
+					sph->radius,
+					sph->material->name.c_str(),
 					box.min.x, box.min.y, box.min.z, box.max.x, box.max.y, box.max.z
 				);
 			}
@@ -326,6 +345,94 @@ bool transferTinyobjToTriangle(std::vector<tinyobj::shape_t>& shapes, std::vecto
 }
 
 
+bool objStreamLoader(int modelSelect, std::vector<tinyobj::material_t>& materials, PrimitiveStore& prims,
+	TextureLoader& textures, int detailPrint)
+{
+	std::string objFile, basePath, xmlFile;
+	if (!scenePaths(modelSelect, objFile, basePath, xmlFile))
+	{
+		fprintf(stderr, "please input a right number!"); return 0;
+	}
+	std::cout << "Loading " << objFile << std::endl;
+
+	auto loadTexture = [&](int matid) {
+		return textures.request(basePath + materials[matid].diffuse_texname, prims);
+	};
+
+	std::string err;
+	std::vector<size_t> shapeStart;
+	auto start = std::chrono::steady_clock::now();
+	bool ret = streamObjToPrimitives(objFile.c_str(), basePath.c_str(), materials, prims, shapeStart, err, loadTexture);
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	uint64_t fileSize = 0;
+	int64_t mtime;
+	if (ret && fileStamp(objFile, fileSize, mtime) && seconds > 0)
+		printf("Parsed %.2f MB in %.1f ms (%.1f MB/s, streaming)\n", fileSize / (1024.0 * 1024.0), seconds * 1000,
+			fileSize / (1024.0 * 1024.0) / seconds);
+
+	if (!err.empty()) {
+		std::cerr << err << std::endl;
+	}
+
+	if (!ret) {
+		std::cout << "failed to load " << objFile << std::endl;
+		return false;
+	}
+	for (auto& material : materials)
+	{
+		if (material.diffuse_texname.size() != 0)
+		{
+			material.diffuse_texname = basePath + material.diffuse_texname;
+		}
+	}
+
+	// the light shape of veach-mis, replaced by spheres as in transferTinyobjToTriangle
+	for (size_t s = shapeStart.size(); s-- > 0;)
+	{
+		size_t begin = shapeStart[s];
+		size_t end = s + 1 < shapeStart.size() ? shapeStart[s + 1] : prims.triangles.size();
+		if ((end - begin) * 3 != 6996)
+			continue;
+		auto kept = std::remove_if(prims.triangles.begin() + begin, prims.triangles.begin() + end,
+			[&](const Triangle& tri) { return tri.material - materials.data() >= 5; });
+		prims.triangles.erase(kept, prims.triangles.begin() + end);
+
+		prims.add(Sphere(Vec(0.0, 6.5, 2.7), 0.05, &materials[5]));
+		prims.add(Sphere(Vec(0.0, 6.5, 0.0), 0.5, &materials[6]));
+		prims.add(Sphere(Vec(0.0, 6.5, -2.8), 1, &materials[7]));
+	}
+
+	printf("Transfer over!\n  object num: %zd\n", prims.size());
+	printf("  vertex num: %zd, mesh memory: %.2f MB (vertex buffers %.2f MB, triangles %.2f MB)\n",
+		prims.mesh.positions.size(),
+		(prims.mesh.memoryBytes() + prims.triangles.size() * sizeof(Triangle)) / (1024.0 * 1024.0),
+		prims.mesh.memoryBytes() / (1024.0 * 1024.0),
+		prims.triangles.size() * sizeof(Triangle) / (1024.0 * 1024.0));
+	if (detailPrint != 0)
+		printf("  materials: %zd, textures: %zd\n", materials.size(), prims.textures.size());
+	return true;
+}
+
+void collectLights(const PrimitiveStore& prims, std::vector<PrimRef>& lightObjects)
+{
+	for (size_t i = 0; i < prims.triangles.size(); i++)
+	{
+		const Triangle& tri = prims.triangles[i];
+		// if obj is a light
+		if (floatMax(tri.material->emission) != 0 || floatMax(tri.material->ambient) > 1)
+		{
+			// if obj is bright enough or big erough
+			if (tri.getArea(prims.mesh) > 1 || floatMax(tri.material->emission) > 20)
+				lightObjects.push_back(PrimRef(objectType::tri, static_cast<int>(i)));
+		}
+	}
+	// spheres only come from the veach-mis light shape, listed last to first like transferTinyobjToTriangle does
+	for (int i = static_cast<int>(prims.spheres.size()) - 1; i >= 0; i--)
+		lightObjects.push_back(PrimRef(objectType::sph, i));
+	printf("  light num: %zd\n", lightObjects.size());
+}
+
 bool printInfo(const std::vector<tinyobj::shape_t>& shapes, const std::vector<tinyobj::material_t>& materials, bool triangulate, int detail)
 {
 	std::cout << "# of shapes    : " << shapes.size() << std::endl;
@@ -454,82 +561,8 @@ bool printInfo(const std::vector<tinyobj::shape_t>& shapes, const std::vector<ti
 
 
 
-void writeArrToFile(const int modelSelect, const Vec c[], const int spp, const int smax, const int width, const int height, std::string fileName)
-{
-
-	std::string filename;
-	if (modelSelect == 1) filename = "tmpData/cornell_box";
-	else if (modelSelect == 2) filename = "tmpData/veach_mis";
-	else if (modelSelect == 3) filename = "tmpData/staircase";
-	else if (modelSelect == 4) filename = "tmpData/test";
-	else filename = "unclear_image";
-	filename += "W" + std::to_string(width);
-	filename += "H" + std::to_string(height);
-	filename += ".tmpData";
-
-	if (fileName != "")
-		filename = fileName;
-
-	std::ofstream file(filename, std::ios::binary);
-	if (!file) {
-		std::cerr << "can't open" << filename << std::endl;
-		return;
-	}
-	file.write(reinterpret_cast<const char*>(&spp), sizeof(spp));
-	file.write(reinterpret_cast<const char*>(&smax), sizeof(smax));
-	file.write(reinterpret_cast<const char*>(c), width * height * sizeof(Vec));
-	file.close();
-}
-
-
-
-bool readArrFromFile(const int modelSelect, Vec c[], int& spp, int& smax, const int width, const int height, std::string fileName)
-{
-	std::string filename;
-	if (modelSelect == 1) filename = "tmpData/cornell_box";
-	else if (modelSelect == 2) filename = "tmpData/veach_mis";
-	else if (modelSelect == 3) filename = "tmpData/staircase";
-	else if (modelSelect == 4) filename = "tmpData/test";
-	else filename = "tmpData/unclear_image";
-
-	filename += "W" + std::to_string(width);
-	filename += "H" + std::to_string(height);
-	filename += ".tmpData";
-
-	if (fileName != "")
-		filename = fileName;
-
-	std::ifstream file(filename, std::ios::binary);
-	if (!file) {
-		return false;
-	}
-
-	int premax = smax;
-
-	file.read(reinterpret_cast<char*>(&spp), sizeof(spp));
-	file.read(reinterpret_cast<char*>(&premax), sizeof(premax));
-	file.read(reinterpret_cast<char*>(c), width * height * sizeof(Vec));
-	file.close();
-
-
-	if (spp > smax)
-	{
-		std::cout << "warning:finish read spp is" << spp << ", but spp max setting is " << smax
-			<< ", modified to" << premax << std::endl;
-		smax = premax;
-	}
-
-	float recipMax = static_cast<float>(premax) / static_cast<float>(smax);
-
-	for (int i = 0; i < width * height; i++)
-		c[i] = c[i] * recipMax;
-
-	return true;
-}
-
-
-
-void save_bitmap(const int modelSelect, const Vec c[], const int width, const int height, float completePercent, std::string fileName) {
+void save_bitmap(const int modelSelect, const Vec c[], const int width, const int height, float completePercent, std::string fileName,
+	const OutputSettings& settings) {
 
 
 	std::string filename;
@@ -548,113 +581,43 @@ void save_bitmap(const int modelSelect, const Vec c[], const int width, const in
 		return;
 	}
 
+	std::vector<uint8_t> data;
+	encodeBitmap(c, width, height, 1 / completePercent, settings, data);
+
 	Bitmap bitmap;
-	bitmap.file_header.size = sizeof(BitmapFileHeader) + sizeof(BitmapInfoHeader) + width * height * 3;
+	bitmap.file_header.size = static_cast<uint32_t>(sizeof(BitmapFileHeader) + sizeof(BitmapInfoHeader) + data.size());
 	bitmap.file_header.offset = sizeof(BitmapFileHeader) + sizeof(BitmapInfoHeader);
 	bitmap.info_header.size = sizeof(BitmapInfoHeader);
 	bitmap.info_header.width = width;
 	bitmap.info_header.height = height;
 	bitmap.info_header.bit_count = 24;
-	bitmap.data = new uint8_t[width * height * 3];
-
-	float recipCP = 1 / completePercent;
-
-	for (int i = 0; i < width * height; ++i) {
-		bitmap.data[i * 3 + 0] = (toInt(c[i].z * recipCP)) & 0xFF;
-		bitmap.data[i * 3 + 1] = (toInt(c[i].y * recipCP)) & 0xFF;
-		bitmap.data[i * 3 + 2] = (toInt(c[i].x * recipCP)) & 0xFF;
-	}
-
-
 
 	file.write(reinterpret_cast<char*>(&bitmap.file_header), sizeof(BitmapFileHeader));
 	file.write(reinterpret_cast<char*>(&bitmap.info_header), sizeof(BitmapInfoHeader));
-	file.write(reinterpret_cast<char*>(bitmap.data), width * height * 3);
+	file.write(reinterpret_cast<const char*>(data.data()), data.size());
 
 	std::cout << "  " << filename << " saved!";
-
-	delete[] bitmap.data;
-
 }
 
-void fixFile(const int modelSelect, int smax, float completePercent)
+void fixFile(const int modelSelect, const int width, const int height)
 {
-
-	Vec* c = new Vec[1024 * 1024];
-	int s;
-	readArrFromFile(modelSelect, c, s, smax, 1024, 1024);
-
-	save_bitmap(modelSelect, c, 1024, 1024, completePercent);
-	delete[] c;
+	std::string fileName = checkpointPath(modelSelect, width, height);
+	CheckpointInfo info;
+	if (!readCheckpointInfo(fileName, info))
+		return;
+	std::vector<Vec> c(static_cast<size_t>(width) * height);
+	std::vector<uint32_t> pixelSamples(c.size());
+	CheckpointInfo expect = info;
+	if (readCheckpoint(fileName, expect, info, c.data(), pixelSamples.data()))
+		save_bitmap(modelSelect, c.data(), width, height, static_cast<float>(info.samples) / static_cast<float>(info.smax));
 }
 
-bool mergeFile(const char* file1, const char* file2, const char* outputFile, const int width, const  int height, int& smax, float completePercent)
+bool mergeFile(const char* file1, const char* file2, const char* outputFile)
 {
-	Vec* c1 = new Vec[width * height];
-	int s1, s1premax;
-
-
-	std::ifstream fileR(file1, std::ios::binary);
-	if (!fileR) {
+	std::vector<Vec> image;
+	CheckpointInfo info;
+	if (!mergeCheckpoints({ file1, file2 }, outputFile, image, info))
 		return false;
-	}
-	int premax;
-
-	fileR.read(reinterpret_cast<char*>(&s1), sizeof(s1));
-	fileR.read(reinterpret_cast<char*>(&s1premax), sizeof(s1premax));
-	fileR.read(reinterpret_cast<char*>(c1), width * height * sizeof(Vec));
-	fileR.close();
-
-
-	Vec* c2 = new Vec[width * height];
-	int s2, s2premax;
-
-	std::ifstream fileR2(file1, std::ios::binary);
-	if (!fileR2) {
-		std::cerr << "can't open" << file1 << std::endl;
-		return false;
-	}
-	fileR2.read(reinterpret_cast<char*>(&s2), sizeof(s2));
-	fileR2.read(reinterpret_cast<char*>(&s2premax), sizeof(s2premax));
-	fileR2.read(reinterpret_cast<char*>(c2), width * height * sizeof(Vec));
-	fileR2.close();
-
-
-	int spp = s1 + s2;
-
-	if (smax < spp)
-	{
-		smax = std::max(s1premax, s2premax);
-		if (smax < spp)
-			smax *= 2;
-		printf("warning: smax is too small to contain two file, now modify to %d\n", smax);
-	}
-
-	if (smax == 0 || spp == 0)
-	{
-		printf("no data to merge\n");
-		return false;
-	}
-	float recipS1Max = static_cast<float>(s1premax) / static_cast<float>(smax);
-	float recipS2Max = static_cast<float>(s2premax) / static_cast<float>(smax);
-
-
-	for (int i = 0; i < width + height; i++)
-		c1[i] = c1[i] * recipS1Max + c2[i] * recipS2Max;
-
-	save_bitmap(-1, c1, width, height, static_cast<float>(spp) / static_cast<float>(smax));
-
-	std::ofstream fileW(outputFile, std::ios::binary);
-	if (!fileW) {
-		std::cerr << "can't open" << outputFile << std::endl;
-		return false;
-	}
-	fileW.write(reinterpret_cast<const char*>(&spp), sizeof(spp));
-	fileW.write(reinterpret_cast<const char*>(&smax), sizeof(smax));
-	fileW.write(reinterpret_cast<const char*>(c1), width * height * sizeof(Vec));
-	fileW.close();
-
-	delete[] c1;
-	delete[] c2;
-
+	save_bitmap(-1, image.data(), info.width, info.height);
+	return true;
 }
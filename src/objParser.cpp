@@ -0,0 +1,700 @@
+#define TINYOBJLOADER_IMPLEMENTATION
+#include "third/tinyobjloader/tiny_obj_loader.h"
+
+#include "objParser.h"
+#include "mappedFile.h"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <thread>
+#include <unordered_map>
+
+
+namespace {
+
+// a line that is neither a vertex nor a face (g, o, usemtl, mtllib, t), replayed in file order when stitching
+struct ObjStatement {
+	size_t faceNum; // faces of the chunk in front of this line
+	std::string line; // starting at the command
+};
+
+struct ObjChunk {
+	const char* begin;
+	const char* end;
+	// v, vn and vt lines, counted before parsing so relative indices resolve as in a sequential read
+	size_t vNum, vnNum, vtNum;
+	// triangles of the f lines cut into fans, counted with the vertices
+	size_t triangleNum;
+	// the same counts for all the chunks before this one, where its vertices go in the arrays of the whole file
+	size_t vBase, vnBase, vtBase;
+	// corners of every face, faceSizes tells how many belong to each face
+	std::vector<tinyobj::vertex_index> corners;
+	std::vector<unsigned int> faceSizes;
+	std::vector<ObjStatement> statements;
+
+	ObjChunk(const char* begin, const char* end) :
+		begin(begin), end(end), vNum(0), vnNum(0), vtNum(0), triangleNum(0), vBase(0), vnBase(0), vtBase(0) {}
+};
+
+// a mapped obj cut into chunks and counted. after parseChunks it has the vertex data of the whole file and the faces
+// and statements of the parsed chunks
+struct ParsedObj {
+	MappedFile file;
+	std::vector<ObjChunk> parts;
+	std::vector<float> v, vn, vt;
+};
+
+// a face group tinyobj would export into the current shape, see ObjStitcher::deferExports
+struct ObjExportJob {
+	size_t shapeId;
+	std::vector<std::vector<tinyobj::vertex_index> > faceGroup;
+	int material;
+	std::string name;
+	tinyobj::shape_t result;
+};
+
+// state of tinyobj::LoadObj while it walks the file, fed with faces and statements in file order
+struct ObjStitcher {
+	std::vector<tinyobj::shape_t>& shapes;
+	std::vector<tinyobj::material_t>& materials;
+	std::string& err;
+	unsigned int flags;
+	tinyobj::MaterialFileReader readMatFn;
+
+	const std::vector<float>& v;
+	const std::vector<float>& vn;
+	const std::vector<float>& vt;
+	std::vector<tinyobj::tag_t> tags;
+	std::vector<std::vector<tinyobj::vertex_index> > faceGroup;
+	std::string name;
+	std::map<std::string, int> material_map;
+	std::map<tinyobj::vertex_index, unsigned int> vertexCache;
+	int material;
+	tinyobj::shape_t shape;
+
+	// every export starts from an empty vertex cache, so the face groups can be exported independently
+	// and appended to their shape afterwards. not done with tags (they are swapped in and out of the shape)
+	// or with calculated normals (they depend on the whole shape)
+	bool deferExports;
+	// counts shape resets, the exports of one shape share an id
+	size_t shapeId;
+	std::vector<ObjExportJob> jobs;
+	std::vector<size_t> keptShapes;
+
+	ObjStitcher(const ParsedObj& parsed, std::vector<tinyobj::shape_t>& shapes, std::vector<tinyobj::material_t>& materials,
+		std::string& err, unsigned int flags, const std::string& basePath, bool deferExports) :
+		shapes(shapes), materials(materials), err(err), flags(flags), readMatFn(basePath),
+		v(parsed.v), vn(parsed.vn), vt(parsed.vt), material(-1), deferExports(deferExports), shapeId(0) {}
+
+	// tinyobj::exportFaceGroupToShape into the current shape, or queued for finish()
+	bool exportGroup() {
+		if (!deferExports)
+			return tinyobj::exportFaceGroupToShape(shape, vertexCache, v, vn, vt, faceGroup, tags,
+				material, name, true, flags, err);
+		if (faceGroup.empty())
+			return false;
+		jobs.push_back(ObjExportJob());
+		ObjExportJob& job = jobs.back();
+		job.shapeId = shapeId;
+		job.faceGroup.swap(faceGroup);
+		job.material = material;
+		job.name = name;
+		return true;
+	}
+
+	void flushGroup() {
+		if (!exportGroup())
+			return;
+		if (deferExports)
+			keptShapes.push_back(shapeId);
+		else
+			shapes.push_back(shape);
+	}
+
+	void newShape() {
+		shape = tinyobj::shape_t();
+		shapeId++;
+	}
+
+	void face(const tinyobj::vertex_index* corners, unsigned int n) {
+		faceGroup.push_back(std::vector<tinyobj::vertex_index>(corners, corners + n));
+	}
+	// same handling as the matching branches of tinyobj::LoadObj, false stops the load
+	bool statement(const char* token);
+	// run the deferred exports in parallel and assemble the kept shapes
+	void finish();
+};
+
+// turns faces into triangles of a PrimitiveStore as they come, see streamObjToPrimitives
+struct ObjStreamer {
+	const std::vector<float>& v;
+	const std::vector<float>& vt;
+	std::vector<tinyobj::material_t>& materials;
+	PrimitiveStore& prims;
+	std::vector<size_t>& shapeStart;
+	std::string& err;
+	const std::function<Texture*(int)>& loadTexture;
+	tinyobj::MaterialFileReader readMatFn;
+	std::map<std::string, int> material_map;
+	int material;
+
+	// vertex of prims.mesh made first from every position and the texcoord index (or -1) it was made with,
+	// the vertices of further texcoords of a position by (position index, texcoord index or -1)
+	std::vector<uint32_t> positionVertex;
+	std::vector<int> positionTexcoord;
+	std::unordered_map<uint64_t, uint32_t> vertexIds;
+	// material of every triangle by index, made into pointers once materials stops growing
+	std::vector<int> triangleMaterial;
+	// loadTexture result by material, asked for the first time a textured triangle uses the material
+	std::vector<Texture*> textures;
+	std::vector<bool> textureAsked;
+	size_t skippedFaces;
+
+	ObjStreamer(const ParsedObj& parsed, std::vector<tinyobj::material_t>& materials, PrimitiveStore& prims,
+		std::vector<size_t>& shapeStart, std::string& err, const std::function<Texture*(int)>& loadTexture, const std::string& basePath) :
+		v(parsed.v), vt(parsed.vt), materials(materials), prims(prims), shapeStart(shapeStart), err(err),
+		loadTexture(loadTexture), readMatFn(basePath), material(-1),
+		positionVertex(parsed.v.size() / 3, UINT32_MAX), positionTexcoord(parsed.v.size() / 3, -1), skippedFaces(0) {}
+
+	bool validUV(const tinyobj::vertex_index& i) const {
+		return i.vt_idx >= 0 && static_cast<size_t>(2 * i.vt_idx + 1) < vt.size();
+	}
+
+	uint32_t vertex(const tinyobj::vertex_index& i, bool withUV) {
+		int texcoord = withUV ? i.vt_idx : -1;
+		uint32_t& first = positionVertex[i.v_idx];
+		if (first != UINT32_MAX && positionTexcoord[i.v_idx] == texcoord)
+			return first;
+		uint64_t key = static_cast<uint64_t>(static_cast<uint32_t>(i.v_idx)) << 32 | static_cast<uint32_t>(texcoord);
+		if (first != UINT32_MAX) {
+			auto it = vertexIds.find(key);
+			if (it != vertexIds.end())
+				return it->second;
+		}
+		uint32_t id = withUV ? prims.mesh.addVertex(&v[3 * static_cast<size_t>(i.v_idx)], vt[2 * i.vt_idx], vt[2 * i.vt_idx + 1]) :
+			prims.mesh.addVertex(&v[3 * static_cast<size_t>(i.v_idx)]);
+		if (first == UINT32_MAX) {
+			first = id;
+			positionTexcoord[i.v_idx] = texcoord;
+		}
+		else
+			vertexIds[key] = id;
+		return id;
+	}
+
+	// a polygon is cut into a triangle fan, as tinyobj does with the triangulation flag
+	void face(const tinyobj::vertex_index* corners, unsigned int n) {
+		bool valid = material >= 0 && n >= 3;
+		for (unsigned int k = 0; k < n && valid; k++)
+			valid = corners[k].v_idx >= 0 && static_cast<size_t>(3 * corners[k].v_idx + 2) < v.size();
+		if (!valid) {
+			skippedFaces++;
+			return;
+		}
+
+		for (unsigned int k = 2; k < n; k++) {
+			const tinyobj::vertex_index* tri[3] = { &corners[0], &corners[k - 1], &corners[k] };
+			bool hasUV = validUV(*tri[0]) && validUV(*tri[1]) && validUV(*tri[2]);
+			prims.add(Triangle(vertex(*tri[0], hasUV), vertex(*tri[1], hasUV), vertex(*tri[2], hasUV), nullptr,
+				hasUV ? texture(material) : nullptr));
+			triangleMaterial.push_back(material);
+		}
+	}
+
+	bool statement(const char* token);
+
+	Texture* texture(int id) {
+		if (textureAsked.size() <= static_cast<size_t>(id)) {
+			textureAsked.resize(materials.size(), false);
+			textures.resize(materials.size(), nullptr);
+		}
+		if (!textureAsked[id]) {
+			textureAsked[id] = true;
+			if (!materials[id].diffuse_texname.empty())
+				textures[id] = loadTexture(id);
+		}
+		return textures[id];
+	}
+
+	void finish() {
+		for (size_t i = 0; i < prims.triangles.size(); i++)
+			prims.triangles[i].material = &materials[triangleMaterial[i]];
+		if (skippedFaces != 0)
+			err += "WARN: " + std::to_string(skippedFaces) + " faces without a material or with a bad index were skipped\n";
+	}
+};
+
+}
+
+
+bool ObjStitcher::statement(const char* token)
+{
+	char namebuf[TINYOBJ_SSCANF_BUFFER_SIZE];
+
+	if ((0 == strncmp(token, "usemtl", 6)) && IS_SPACE((token[6]))) {
+		token += 7;
+#ifdef _MSC_VER
+		sscanf_s(token, "%s", namebuf, (unsigned)sizeof(namebuf));
+#else
+		sscanf(token, "%s", namebuf);
+#endif
+
+		int newMaterialId = -1;
+		if (material_map.find(namebuf) != material_map.end())
+			newMaterialId = material_map[namebuf];
+
+		if (newMaterialId != material) {
+			// per-face material, the faces so far stay in the current shape
+			exportGroup();
+			faceGroup.clear();
+			material = newMaterialId;
+		}
+		return true;
+	}
+
+	if ((0 == strncmp(token, "mtllib", 6)) && IS_SPACE((token[6]))) {
+		token += 7;
+#ifdef _MSC_VER
+		sscanf_s(token, "%s", namebuf, (unsigned)sizeof(namebuf));
+#else
+		sscanf(token, "%s", namebuf);
+#endif
+
+		std::string err_mtl;
+		bool ok = readMatFn(namebuf, materials, material_map, err_mtl);
+		err += err_mtl;
+		if (!ok) {
+			faceGroup.clear();
+			return false;
+		}
+		return true;
+	}
+
+	if (token[0] == 'g' && IS_SPACE((token[1]))) {
+		flushGroup();
+		newShape();
+		faceGroup.clear();
+
+		std::vector<std::string> names;
+		while (!IS_NEW_LINE(token[0])) {
+			names.push_back(tinyobj::parseString(token));
+			token += strspn(token, " \t\r");
+		}
+		// names[0] is the 'g' itself
+		name = names.size() > 1 ? names[1] : "";
+		return true;
+	}
+
+	if (token[0] == 'o' && IS_SPACE((token[1]))) {
+		flushGroup();
+		faceGroup.clear();
+		newShape();
+
+		token += 2;
+#ifdef _MSC_VER
+		sscanf_s(token, "%s", namebuf, (unsigned)sizeof(namebuf));
+#else
+		sscanf(token, "%s", namebuf);
+#endif
+		name = std::string(namebuf);
+		return true;
+	}
+
+	if (token[0] == 't' && IS_SPACE(token[1])) {
+		tinyobj::tag_t tag;
+		token += 2;
+#ifdef _MSC_VER
+		sscanf_s(token, "%s", namebuf, (unsigned)sizeof(namebuf));
+#else
+		sscanf(token, "%s", namebuf);
+#endif
+		tag.name = std::string(namebuf);
+		token += tag.name.size() + 1;
+
+		tinyobj::tag_sizes ts = tinyobj::parseTagTriple(token);
+
+		tag.intValues.resize(static_cast<size_t>(ts.num_ints));
+		for (size_t i = 0; i < static_cast<size_t>(ts.num_ints); ++i) {
+			tag.intValues[i] = atoi(token);
+			token += strcspn(token, "/ \t\r") + 1;
+		}
+
+		tag.floatValues.resize(static_cast<size_t>(ts.num_floats));
+		for (size_t i = 0; i < static_cast<size_t>(ts.num_floats); ++i) {
+			tag.floatValues[i] = tinyobj::parseFloat(token);
+			token += strcspn(token, "/ \t\r") + 1;
+		}
+
+		tag.stringValues.resize(static_cast<size_t>(ts.num_strings));
+		for (size_t i = 0; i < static_cast<size_t>(ts.num_strings); ++i) {
+#ifdef _MSC_VER
+			sscanf_s(token, "%s", namebuf, (unsigned)sizeof(namebuf));
+#else
+			sscanf(token, "%s", namebuf);
+#endif
+			tag.stringValues[i] = namebuf;
+			token += tag.stringValues[i].size() + 1;
+		}
+
+		tags.push_back(tag);
+	}
+	return true;
+}
+
+void ObjStitcher::finish()
+{
+	if (!deferExports)
+		return;
+
+	// exports into a shape that is dropped later (tinyobj keeps a shape only if its last group is not empty) are skipped
+	std::vector<char> kept(shapeId + 1, 0);
+	for (size_t id : keptShapes)
+		kept[id] = 1;
+
+	int jobNum = static_cast<int>(jobs.size());
+#pragma omp parallel for schedule(dynamic)
+	for (int i = 0; i < jobNum; i++) {
+		ObjExportJob& job = jobs[i];
+		if (!kept[job.shapeId])
+			continue;
+		std::vector<tinyobj::tag_t> noTags;
+		std::string jobErr;
+		tinyobj::exportFaceGroupToShape(job.result, vertexCache, v, vn, vt, job.faceGroup, noTags,
+			job.material, job.name, true, flags, jobErr);
+		std::vector<std::vector<tinyobj::vertex_index> >().swap(job.faceGroup);
+	}
+
+	// a shape is its exports one after the other, the indices of each one shifted past the vertices before it
+	size_t j = 0;
+	for (size_t id : keptShapes) {
+		tinyobj::shape_t merged;
+		for (; j < jobs.size() && jobs[j].shapeId <= id; j++) {
+			if (jobs[j].shapeId != id)
+				continue;
+			tinyobj::mesh_t& dst = merged.mesh;
+			const tinyobj::mesh_t& src = jobs[j].result.mesh;
+			unsigned int offset = static_cast<unsigned int>(dst.positions.size() / 3);
+			dst.positions.insert(dst.positions.end(), src.positions.begin(), src.positions.end());
+			dst.normals.insert(dst.normals.end(), src.normals.begin(), src.normals.end());
+			dst.texcoords.insert(dst.texcoords.end(), src.texcoords.begin(), src.texcoords.end());
+			for (unsigned int index : src.indices)
+				dst.indices.push_back(offset + index);
+			dst.num_vertices.insert(dst.num_vertices.end(), src.num_vertices.begin(), src.num_vertices.end());
+			dst.material_ids.insert(dst.material_ids.end(), src.material_ids.begin(), src.material_ids.end());
+			merged.name = jobs[j].result.name;
+			jobs[j].result = tinyobj::shape_t();
+		}
+		shapes.push_back(merged);
+	}
+}
+
+
+// next line of [cur, end) the way safeGetline cuts it: at \n, \r or \r\n
+static bool nextLine(const char*& cur, const char* end, std::string& line)
+{
+	if (cur >= end)
+		return false;
+	const char* p = cur;
+	while (p < end && *p != '\n' && *p != '\r')
+		p++;
+	line.assign(cur, p);
+	if (p + 1 < end && p[0] == '\r' && p[1] == '\n')
+		p++;
+	cur = p < end ? p + 1 : p;
+	return true;
+}
+
+static void countVertices(ObjChunk& chunk)
+{
+	const char* p = chunk.begin;
+	while (p < chunk.end) {
+		while (p < chunk.end && (*p == ' ' || *p == '\t'))
+			p++;
+		if (chunk.end - p >= 2 && p[0] == 'f' && IS_SPACE(p[1])) {
+			size_t corners = 0;
+			for (p++; p < chunk.end && *p != '\n' && *p != '\r'; p++)
+				if (IS_SPACE(p[-1]) && !IS_SPACE(p[0]))
+					corners++;
+			chunk.triangleNum += corners >= 3 ? corners - 2 : 0;
+		}
+		else if (chunk.end - p >= 2 && p[0] == 'v') {
+			if (IS_SPACE(p[1]))
+				chunk.vNum++;
+			else if (chunk.end - p >= 3 && p[1] == 'n' && IS_SPACE(p[2]))
+				chunk.vnNum++;
+			else if (chunk.end - p >= 3 && p[1] == 't' && IS_SPACE(p[2]))
+				chunk.vtNum++;
+		}
+		while (p < chunk.end && *p != '\n' && *p != '\r')
+			p++;
+		p++;
+	}
+}
+
+// the vertex and face branches of tinyobj::LoadObj. vertices are written straight into the arrays of the whole file,
+// normals are only counted when vn is nullptr
+static void parseChunk(ObjChunk& chunk, float* v, float* vn, float* vt)
+{
+	size_t nv = 0, nvn = 0, nvt = 0;
+	std::string line;
+	const char* cur = chunk.begin;
+	while (nextLine(cur, chunk.end, line)) {
+		const char* token = line.c_str();
+		token += strspn(token, " \t");
+		if (token[0] == '\0' || token[0] == '#')
+			continue;
+
+		if (token[0] == 'v' && IS_SPACE((token[1]))) {
+			token += 2;
+			float x, y, z;
+			tinyobj::parseFloat3(x, y, z, token);
+			// countVertices saw the same lines, the check only guards against a file changed in between
+			if (nv < chunk.vNum) {
+				float* dst = v + 3 * (chunk.vBase + nv);
+				dst[0] = x;
+				dst[1] = y;
+				dst[2] = z;
+				nv++;
+			}
+			continue;
+		}
+		if (token[0] == 'v' && token[1] == 'n' && IS_SPACE((token[2]))) {
+			token += 3;
+			if (nvn < chunk.vnNum) {
+				if (vn != nullptr) {
+					float* dst = vn + 3 * (chunk.vnBase + nvn);
+					tinyobj::parseFloat3(dst[0], dst[1], dst[2], token);
+				}
+				nvn++;
+			}
+			continue;
+		}
+		if (token[0] == 'v' && token[1] == 't' && IS_SPACE((token[2]))) {
+			token += 3;
+			float x, y;
+			tinyobj::parseFloat2(x, y, token);
+			if (nvt < chunk.vtNum) {
+				float* dst = vt + 2 * (chunk.vtBase + nvt);
+				dst[0] = x;
+				dst[1] = y;
+				nvt++;
+			}
+			continue;
+		}
+		if (token[0] == 'f' && IS_SPACE((token[1]))) {
+			token += 2;
+			token += strspn(token, " \t");
+			unsigned int n = 0;
+			while (!IS_NEW_LINE(token[0])) {
+				chunk.corners.push_back(tinyobj::parseTriple(token,
+					static_cast<int>(chunk.vBase + nv),
+					static_cast<int>(chunk.vnBase + nvn),
+					static_cast<int>(chunk.vtBase + nvt)));
+				n++;
+				token += strspn(token, " \t\r");
+			}
+			chunk.faceSizes.push_back(n);
+			continue;
+		}
+
+		if ((0 == strncmp(token, "usemtl", 6) && IS_SPACE(token[6])) ||
+			(0 == strncmp(token, "mtllib", 6) && IS_SPACE(token[6])) ||
+			((token[0] == 'g' || token[0] == 'o' || token[0] == 't') && IS_SPACE(token[1])))
+		{
+			ObjStatement statement;
+			statement.faceNum = chunk.faceSizes.size();
+			statement.line = token;
+			chunk.statements.push_back(statement);
+		}
+	}
+}
+
+// map the file, cut it into chunks right after a '\n', count the lines of the chunks in parallel and size the vertex
+// arrays of the whole file. chunkBytes > 0 cuts chunks of about that size instead of a number of them
+static bool cutObjFile(const char* fileName, int chunks, size_t chunkBytes, bool keepNormals, ParsedObj& parsed, std::string& err)
+{
+	MappedFile& file = parsed.file;
+	if (!file.open(fileName)) {
+		uint64_t size;
+		int64_t mtime;
+		// an empty file can't be mapped but is a valid obj
+		if (fileStamp(fileName, size, mtime) && size == 0)
+			return true;
+		err = std::string("Cannot open file [") + fileName + "]\n";
+		return false;
+	}
+
+	if (chunks <= 0)
+		chunks = 4 * std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+	if (chunkBytes > 0)
+		chunks = std::max(chunks, static_cast<int>(file.size() / chunkBytes + 1));
+	// small files are not worth cutting
+	const size_t minChunkBytes = 64 * 1024;
+	chunks = static_cast<int>(std::min(static_cast<size_t>(chunks), file.size() / minChunkBytes + 1));
+
+	std::vector<ObjChunk>& parts = parsed.parts;
+	const char* begin = file.data();
+	const char* fileEnd = file.data() + file.size();
+	for (int i = 1; i <= chunks && begin < fileEnd; i++) {
+		const char* end = i == chunks ? fileEnd : file.data() + file.size() / chunks * i;
+		if (end < begin)
+			end = begin;
+		end = std::find(end, fileEnd, '\n');
+		if (end < fileEnd)
+			end++;
+		parts.push_back(ObjChunk(begin, end));
+		begin = end;
+	}
+	int partNum = static_cast<int>(parts.size());
+
+#pragma omp parallel for schedule(dynamic)
+	for (int i = 0; i < partNum; i++)
+		countVertices(parts[i]);
+
+	size_t vNum = 0, vnNum = 0, vtNum = 0;
+	for (auto& part : parts) {
+		part.vBase = vNum;
+		part.vnBase = vnNum;
+		part.vtBase = vtNum;
+		vNum += part.vNum;
+		vnNum += part.vnNum;
+		vtNum += part.vtNum;
+	}
+	parsed.v.resize(3 * vNum);
+	parsed.vn.resize(keepNormals ? 3 * vnNum : 0);
+	parsed.vt.resize(2 * vtNum);
+	return true;
+}
+
+// parse the chunks [first, last) in parallel, their vertices go into the arrays of the whole file
+static void parseChunks(ParsedObj& parsed, size_t first, size_t last)
+{
+	float* v = parsed.v.data();
+	float* vn = parsed.vn.empty() ? nullptr : parsed.vn.data();
+	float* vt = parsed.vt.data();
+	int partNum = static_cast<int>(last - first);
+#pragma omp parallel for schedule(dynamic)
+	for (int i = 0; i < partNum; i++)
+		parseChunk(parsed.parts[first + i], v, vn, vt);
+}
+
+// feed the faces and statements of a parsed chunk to handler in file order and free its corners.
+// handler.face(corners, n) takes one face and handler.statement(line) returns false to stop
+template <typename Handler>
+static bool replayChunk(ObjChunk& part, Handler& handler)
+{
+	size_t face = 0;
+	const tinyobj::vertex_index* corner = part.corners.data();
+	auto takeFaces = [&](size_t faceNum) {
+		for (; face < faceNum; face++) {
+			handler.face(corner, part.faceSizes[face]);
+			corner += part.faceSizes[face];
+		}
+	};
+	for (auto& statement : part.statements) {
+		takeFaces(statement.faceNum);
+		if (!handler.statement(statement.line.c_str()))
+			return false;
+	}
+	takeFaces(part.faceSizes.size());
+
+	std::vector<tinyobj::vertex_index>().swap(part.corners);
+	std::vector<unsigned int>().swap(part.faceSizes);
+	std::vector<ObjStatement>().swap(part.statements);
+	return true;
+}
+
+
+bool parallelLoadObj(std::vector<tinyobj::shape_t>& shapes, std::vector<tinyobj::material_t>& materials, std::string& err,
+	const char* fileName, const char* mtlBasePath, unsigned int flags, int chunks)
+{
+	shapes.clear();
+
+	ParsedObj parsed;
+	if (!cutObjFile(fileName, chunks, 0, true, parsed, err))
+		return false;
+	parseChunks(parsed, 0, parsed.parts.size());
+
+	bool hasTags = false;
+	for (auto& part : parsed.parts)
+		for (auto& statement : part.statements)
+			hasTags = hasTags || statement.line[0] == 't';
+	bool deferExports = !hasTags && (flags & tinyobj::calculate_normals) == 0;
+
+	ObjStitcher stitcher(parsed, shapes, materials, err, flags, mtlBasePath ? mtlBasePath : "", deferExports);
+	for (auto& part : parsed.parts)
+		if (!replayChunk(part, stitcher))
+			return false;
+
+	stitcher.flushGroup();
+	stitcher.faceGroup.clear();
+	stitcher.finish();
+	return true;
+}
+
+
+bool ObjStreamer::statement(const char* token)
+{
+	char namebuf[TINYOBJ_SSCANF_BUFFER_SIZE];
+
+	if ((0 == strncmp(token, "usemtl", 6)) && IS_SPACE((token[6]))) {
+		token += 7;
+#ifdef _MSC_VER
+		sscanf_s(token, "%s", namebuf, (unsigned)sizeof(namebuf));
+#else
+		sscanf(token, "%s", namebuf);
+#endif
+		auto it = material_map.find(namebuf);
+		material = it != material_map.end() ? it->second : -1;
+		return true;
+	}
+
+	if ((0 == strncmp(token, "mtllib", 6)) && IS_SPACE((token[6]))) {
+		token += 7;
+#ifdef _MSC_VER
+		sscanf_s(token, "%s", namebuf, (unsigned)sizeof(namebuf));
+#else
+		sscanf(token, "%s", namebuf);
+#endif
+		std::string err_mtl;
+		bool ok = readMatFn(namebuf, materials, material_map, err_mtl);
+		err += err_mtl;
+		return ok;
+	}
+
+	// a new shape, the material carries over as in tinyobj
+	if ((token[0] == 'g' || token[0] == 'o') && IS_SPACE((token[1])))
+		shapeStart.push_back(prims.triangles.size());
+	return true;
+}
+
+bool streamObjToPrimitives(const char* fileName, const char* mtlBasePath, std::vector<tinyobj::material_t>& materials,
+	PrimitiveStore& prims, std::vector<size_t>& shapeStart, std::string& err, const std::function<Texture*(int)>& loadTexture, int chunks)
+{
+	// chunks of about 1 MB of text, parsed a batch of one per thread at a time and replayed before the next batch,
+	// so only the faces of one batch are held on top of the vertex arrays and the primitives made so far
+	const size_t streamChunkBytes = 1024 * 1024;
+	ParsedObj parsed;
+	if (!cutObjFile(fileName, chunks, streamChunkBytes, false, parsed, err))
+		return false;
+
+	size_t triangleNum = 0;
+	for (auto& part : parsed.parts)
+		triangleNum += part.triangleNum;
+	prims.triangles.reserve(prims.triangles.size() + triangleNum);
+
+	shapeStart.assign(1, prims.triangles.size());
+	ObjStreamer streamer(parsed, materials, prims, shapeStart, err, loadTexture, mtlBasePath ? mtlBasePath : "");
+	size_t batch = std::max(1u, std::thread::hardware_concurrency());
+	for (size_t first = 0; first < parsed.parts.size(); first += batch) {
+		size_t last = std::min(first + batch, parsed.parts.size());
+		parseChunks(parsed, first, last);
+		for (size_t i = first; i < last; i++)
+			if (!replayChunk(parsed.parts[i], streamer))
+				return false;
+		parsed.file.release(parsed.parts[first].begin - parsed.file.data(), parsed.parts[last - 1].end - parsed.parts[first].begin);
+	}
+	streamer.finish();
+	return true;
+}
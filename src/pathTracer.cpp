@@ -0,0 +1,215 @@
+#include "pathTracer.h"
+#include "objLoader.h"
+#include "stats.h"
+
+#include <math.h>
+
+
+/*
+* DONE:
+*	Ka, Kd, Ke, Ks, Ni
+*	Tr: Transmittance
+*   Ns: shininess
+*   dissolve:
+*   map_Kd: texture mapping in diffuse
+* TODO:
+*   illum:
+*/
+inline Vec sampleAllLight(const Ray& r, const BVHTree& bvh, const std::vector<PrimRef>& lightObjects) {
+	Vec ret;
+	for (auto obj : lightObjects)
+	{
+		float sampleLight = bvh.prims->sampleLight(obj, r.origin + r.direction * 1e-3, bvh);
+		auto objMat = bvh.prims->get(obj).material;
+		ret = ret + (Vec(objMat->ambient) + objMat->emission) * sampleLight;
+	}
+	return ret;
+}
+
+inline float caculatePdf(Intersection& intersection, const PrimitiveStore& prims, PrimRef lightObject)
+{
+	if (lightObject.type != objectType::sph)
+		return 0;
+
+	float area = prims.getArea(lightObject);
+	const tinyobj::material_t* lightMaterial = prims.get(lightObject).material;
+	float avergEmission = (lightMaterial->emission[0] +
+		lightMaterial->emission[1] +
+		lightMaterial->emission[2]
+		) / 3.0f;
+	float dis;
+	float cos;
+	Vec randPoint, normal;
+	if (lightObject.type == objectType::sph) {
+		Vec line = intersection.point - prims.spheres[lightObject.index].center;
+		dis = line.length();
+		cos = std::abs((line * -1).normalized().dot(intersection.normal));
+	}
+	else
+	{
+		Vec line = intersection.point - prims.mesh.position(prims.triangles[lightObject.index].idx[1]);
+		dis = line.length();
+		cos = std::abs((line * -1).normalized().dot(intersection.normal));
+	}
+	float tmp = area * dis * dis * cos * 1e4 * 2;
+	tmp = (tmp == 0.0f) ? 1e-10 : tmp;
+	tmp = avergEmission / tmp;
+
+	return tmp < 1e-3 ? 0 : (tmp > 0.99999) ? 1.000001 : tmp;
+}
+
+
+// how much wider the ray cone gets at a diffuse or glossy bounce (radians), so the hits after one read coarse mip levels
+const float diffuseConeSpread = 0.2f;
+
+Vec radiance(const Ray& r, int depth, BVHTree& bvh, std::vector<PrimRef>& lightObjects, AovSample* aov) {
+
+	Vec ret;
+	Intersection intersection;
+
+	if (++depth > 3)
+	{
+		if (depth > 5 || floatrand() > 0.5)
+		{
+			return ret + sampleAllLight(r, bvh, lightObjects);
+		}
+	}
+
+	threadCounters().countRay(depth == 1 ? RayKind::camera : RayKind::extension);
+	if (bvh.intersect(r, intersection) == 0)
+	{
+		// sampling the light
+		if (depth != 1)
+		{
+			ret = ret + sampleAllLight(r, bvh, lightObjects);
+		}
+		return ret;
+	}
+
+	auto material = intersection.material;
+	// the ray cone where it hits the surface
+	float coneWidth = r.coneWidth + r.coneSpread * intersection.t;
+	if (aov != nullptr)
+	{
+		aov->hit = true;
+		aov->depth = intersection.t;
+		aov->normal = intersection.normal.dot(r.direction) < 0 ? intersection.normal : intersection.normal * -1;
+		aov->material = material;
+		aov->prim = intersection.prim;
+	}
+
+
+	const auto& ambient = material->ambient;
+	const auto& emission = material->emission;
+	const auto& transmittance = material->transmittance;
+	const auto shininess = material->shininess;
+	const auto& specular = material->specular;
+	const float specularMax = floatMax(specular);
+	const float ambientMax = floatMax(ambient);
+	const float emissionMax = floatMax(emission);
+	const float transmittanceMax = floatMax(transmittance);
+
+	ret = Vec(emission) + ambient;
+
+	// stop if hit the light
+	if (emissionMax != 0 || ambientMax > 1.0)
+	{
+		if (aov != nullptr)
+			aov->albedo = clamp(ret);
+		return ret;
+	}
+
+	Vec n = intersection.normal;
+	Vec nl = n.dot(r.direction) < 0 ? n : n * -1;
+
+	// reflect probality reflectance
+	Vec refelDir = (r.direction - n * 2 * n.dot(r.direction)).normalized();
+
+	if (transmittanceMax != 0)
+	{
+		if (aov != nullptr)
+			aov->albedo = Vec(transmittance);
+		bool into = r.direction.dot(n) < 0 ? true : false;
+		float ior = material->ior;
+		float nnt = into ? 1.0f / ior : ior;
+		float ddn = r.direction.dot(nl);
+		float cos2t = 1.0f - nnt * nnt * (1.0f - ddn * ddn);
+
+		if (cos2t < 0)
+		{
+			return ret + radiance(Ray(intersection.point, refelDir).cone(coneWidth, r.coneSpread), depth, bvh, lightObjects).mult(transmittance);
+		}
+
+		Vec transDir = (r.direction * nnt - n * ((into ? 1 : -1) * (ddn * nnt + sqrt(cos2t)))).normalized();
+		float a = ior - 1, b = ior + 1, R0 = a * a / (b * b), c = 1 - (into ? -ddn : transDir.dot(n));
+		float fresnel = R0 + (1 - R0) * c * c * c * c * c;
+		float transmitProbability = 1 - fresnel;
+
+		// Probablity
+		float  P = .25 + .5 * fresnel, RP = fresnel / P, TP = transmitProbability / (1 - P);
+
+		if (floatrand() < transmitProbability)
+		{
+			return ret + radiance(Ray(intersection.point, transDir).cone(coneWidth, r.coneSpread), depth, bvh, lightObjects).mult(transmittance) * TP;
+		}
+		else
+		{
+			return ret + radiance(Ray(intersection.point, refelDir).cone(coneWidth, r.coneSpread), depth, bvh, lightObjects).mult(transmittance) * RP;
+		}
+	}
+
+	auto diffuse = Vec(material->diffuse);
+	float diffuseMax = vecMax(diffuse);
+	if (bvh.prims->get(intersection.prim).texture != nullptr)
+	{
+		// the cone is stretched along the surface when it hits at a grazing angle
+		float footprint = coneWidth / std::max(std::fabs(r.direction.dot(n)), 0.05f);
+		auto  texture = bvh.prims->getTexture(intersection, footprint);
+		diffuse = diffuse.mult(texture);
+	}
+	if (aov != nullptr)
+		aov->albedo = diffuseMax != 0 ? diffuse : Vec(specular);
+
+	float diffuseProbability = diffuseMax / (diffuseMax + specularMax);
+	if (specularMax == 0 || floatrand() < diffuseProbability)
+	{
+
+		// w,u,v is perpendicular to each other
+		Vec w = nl;
+		Vec u = ((fabs(w.x) > .1 ? Vec(0, 1) : Vec(1)).cross(w)).normalized();
+		Vec v = w.cross(u);
+		// r1:(0-2pi)~U, r2:(0-1)~U, r2s
+		float theta = PI * floatrand(2);
+		float phi = PI * floatrand(0.5);
+		float sinphi = std::sin(phi);
+		// a random reflection ray
+
+		Vec randDir = u * std::cos(theta) * sinphi + v * std::sin(theta) * sinphi + w * std::cos(phi);
+		float recipDiffProb = (diffuseProbability != 0.0f ? 1. / diffuseProbability : 0.);
+		return ret + radiance(Ray(intersection.point, randDir).cone(coneWidth, r.coneSpread + diffuseConeSpread), depth, bvh, lightObjects).mult(diffuse) * recipDiffProb;
+	}
+	else
+	{
+		// specular
+		// probality of Sample this light
+
+		float pdf = 0;
+		//caculatePdf(intersection, *bvh.prims, lightObjects[rand() % lightObjects.size()]);
+		if (pdf != 0 && floatrand(0.999) < pdf) {
+			return  ret + sampleAllLight(Ray(intersection.point, intersection.normal), bvh, lightObjects) * (1.0f / pdf);
+		}
+		// perpendicular to each other
+		Vec refelRandDir;
+		//Bsdf
+		Vec u = ((fabs(refelDir.x) > .1 ? Vec(0, 1) : Vec(1)).cross(refelDir)).normalized();
+		Vec v = refelDir.cross(u).normalized();
+		float theta = floatrand(2) * PI;
+		refelRandDir = (refelDir + (u * std::cos(theta) + v * std::sin(theta)) * floatrand(0.2)).normalized();
+		float recipSpecProb = 1.0f / ((1.0f - diffuseProbability) * (1 - pdf));
+		Vec radi = radiance(Ray(intersection.point, refelRandDir).cone(coneWidth, r.coneSpread + diffuseConeSpread), depth, bvh, lightObjects) * recipSpecProb;
+		// if(1.0f - pdf >1e-6)
+		return  ret + radi.mult(specular) * std::pow(refelRandDir.dot(refelDir), shininess);
+
+
+	}
+}
@@ -0,0 +1,76 @@
+#include "region.h"
+#include "objLoader.h"
+
+#include <algorithm>
+
+
+std::vector<PixelSpan> regionSpans(const std::vector<Region>& regions, int width, int height)
+{
+	std::vector<PixelSpan> spans;
+	if (regions.empty())
+	{
+		for (int y = 0; y < height; y++)
+			spans.push_back(PixelSpan{ y, 0, width });
+		return spans;
+	}
+
+	std::vector<PixelSpan> row;
+	for (int y = 0; y < height; y++)
+	{
+		row.clear();
+		for (auto& r : regions)
+		{
+			int x0 = std::max(r.x0, 0), x1 = std::min(r.x1, width);
+			if (y >= r.y0 && y < r.y1 && x0 < x1)
+				row.push_back(PixelSpan{ y, x0, x1 });
+		}
+		// overlapping or touching runs of a row become one
+		std::sort(row.begin(), row.end(), [](const PixelSpan& a, const PixelSpan& b) { return a.x0 < b.x0; });
+		for (auto& span : row)
+		{
+			if (!spans.empty() && spans.back().y == y && span.x0 <= spans.back().x1)
+				spans.back().x1 = std::max(spans.back().x1, span.x1);
+			else
+				spans.push_back(span);
+		}
+	}
+	return spans;
+}
+
+Region spanBounds(const std::vector<PixelSpan>& spans)
+{
+	if (spans.empty())
+		return Region{ 0, 0, 0, 0 };
+	Region bounds{ spans[0].x0, spans.front().y, spans[0].x1, spans.back().y + 1 };
+	for (auto& span : spans)
+	{
+		bounds.x0 = std::min(bounds.x0, span.x0);
+		bounds.x1 = std::max(bounds.x1, span.x1);
+	}
+	return bounds;
+}
+
+std::vector<Vec> regionMeans(const Vec c[], const uint32_t pixelSamples[], int smax, int width, const Region& bounds)
+{
+	int w = std::max(bounds.x1 - bounds.x0, 0), h = std::max(bounds.y1 - bounds.y0, 0);
+	std::vector<Vec> image(static_cast<size_t>(w) * h);
+	for (int y = 0; y < h; y++)
+		for (int x = 0; x < w; x++)
+		{
+			size_t i = static_cast<size_t>(bounds.y0 + y) * width + bounds.x0 + x;
+			if (pixelSamples[i] != 0)
+				image[static_cast<size_t>(y) * w + x] = c[i] * (static_cast<float>(smax) / static_cast<float>(pixelSamples[i]));
+		}
+	return image;
+}
+
+void saveRegionImage(int modelSelect, const Vec c[], const uint32_t pixelSamples[], int smax, int width, const Region& bounds,
+	const OutputSettings& settings)
+{
+	int w = bounds.x1 - bounds.x0, h = bounds.y1 - bounds.y0;
+	if (w <= 0 || h <= 0)
+		return;
+	std::vector<Vec> image = regionMeans(c, pixelSamples, smax, width, bounds);
+	save_bitmap(modelSelect, image.data(), w, h, 1.0f, "", settings);
+	saveHdr(modelSelect, settings.hdr, image.data(), w, h, settings.hdrCompress);
+}
@@ -0,0 +1,515 @@
+#include "sceneCache.h"
+#include "mappedFile.h"
+#include "objLoader.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <type_traits>
+
+
+// bump it whenever the layout below changes, older caches are simply rebuilt
+static const uint32_t sceneCacheVersion = 1;
+static const char sceneCacheMagic[8] = { 'M', 'C', 'P', 'T', 'S', 'C', 'N', '\0' };
+// written as a number, reads back differently on a machine with another byte order
+static const uint32_t byteOrderMark = 0x01020304;
+
+static_assert(sizeof(Vec) == 3 * sizeof(float), "Vec is written as raw floats");
+static_assert(sizeof(PrimRef) == 2 * sizeof(int32_t), "PrimRef is written as raw ints");
+static_assert(std::is_trivially_copyable<LinearBVHNode>::value, "LinearBVHNode is written as raw bytes");
+
+struct CacheHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t byteOrder;
+	uint64_t fileSize;
+};
+
+// primitives as indices instead of pointers: material into the material vector, texture into PrimitiveStore::textures, -1 for none
+struct CachedTriangle {
+	uint32_t idx[3];
+	int32_t material;
+	int32_t texture;
+};
+
+struct CachedSphere {
+	float center[3];
+	float radius;
+	int32_t material;
+	int32_t texture;
+};
+
+
+class CacheWriter {
+public:
+	explicit CacheWriter(std::ofstream& file) : file(file) {}
+
+	template <typename T>
+	void pod(const T& value) { file.write(reinterpret_cast<const char*>(&value), sizeof(T)); }
+
+	template <typename T>
+	void array(const std::vector<T>& values) {
+		pod(static_cast<uint64_t>(values.size()));
+		if (!values.empty())
+			file.write(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T));
+	}
+
+	void string(const std::string& s) {
+		pod(static_cast<uint64_t>(s.size()));
+		file.write(s.data(), s.size());
+	}
+
+	void bytes(const void* data, size_t n) { file.write(static_cast<const char*>(data), n); }
+
+private:
+	std::ofstream& file;
+};
+
+// reads from the mapped file, every access is bounds checked and a failed one makes ok() false for good
+class CacheReader {
+public:
+	CacheReader(const char* begin, size_t size) : cur(begin), end(begin + size), good(true) {}
+
+	bool ok() const { return good; }
+
+	template <typename T>
+	bool pod(T& value) {
+		if (!need(sizeof(T)))
+			return false;
+		std::memcpy(&value, cur, sizeof(T));
+		cur += sizeof(T);
+		return true;
+	}
+
+	template <typename T>
+	bool array(std::vector<T>& values) {
+		uint64_t n;
+		if (!pod(n) || n > static_cast<uint64_t>(end - cur) / sizeof(T))
+			return good = false;
+		values.resize(static_cast<size_t>(n));
+		if (n != 0)
+			std::memcpy(values.data(), cur, static_cast<size_t>(n) * sizeof(T));
+		cur += static_cast<size_t>(n) * sizeof(T);
+		return true;
+	}
+
+	bool string(std::string& s) {
+		uint64_t n;
+		if (!pod(n) || !need(n))
+			return false;
+		s.assign(cur, static_cast<size_t>(n));
+		cur += n;
+		return true;
+	}
+
+	// pointer to n bytes inside the mapping, nullptr if the file is too short
+	const char* bytes(uint64_t n) {
+		if (!need(n))
+			return nullptr;
+		const char* ret = cur;
+		cur += n;
+		return ret;
+	}
+
+private:
+	bool need(uint64_t n) {
+		if (!good || n > static_cast<uint64_t>(end - cur))
+			good = false;
+		return good;
+	}
+
+	const char* cur;
+	const char* end;
+	bool good;
+};
+
+
+static std::string sceneCachePath(int modelSelect)
+{
+	std::string filename;
+	if (modelSelect == 1) filename = "tmpData/cornell_box";
+	else if (modelSelect == 2) filename = "tmpData/veach_mis";
+	else if (modelSelect == 3) filename = "tmpData/staircase";
+	else if (modelSelect == 4) filename = "tmpData/test";
+	else filename = "tmpData/unclear_image";
+	return filename + ".sceneCache";
+}
+
+// every file the scene is built from: the obj, the mtl files it names, the xml and the textures
+static std::vector<std::string> sceneInputs(int modelSelect, const std::vector<tinyobj::material_t>& materials)
+{
+	std::vector<std::string> files;
+	std::string objFile, basePath, xmlFile;
+	if (!scenePaths(modelSelect, objFile, basePath, xmlFile))
+		return files;
+	files.push_back(objFile);
+	files.push_back(xmlFile);
+
+	std::ifstream obj(objFile);
+	std::string line;
+	while (getline(obj, line))
+	{
+		if (line.compare(0, 7, "mtllib ") != 0)
+			continue;
+		std::string name = line.substr(7);
+		while (!name.empty() && (name.back() == '\r' || name.back() == ' '))
+			name.pop_back();
+		files.push_back(basePath + name);
+	}
+
+	for (auto& material : materials)
+	{
+		// already prefixed with the base path by loadObj
+		const std::string& tex = material.diffuse_texname;
+		if (!tex.empty() && std::find(files.begin(), files.end(), tex) == files.end())
+			files.push_back(tex);
+	}
+	return files;
+}
+
+static void writeMaterial(CacheWriter& out, const tinyobj::material_t& m)
+{
+	out.string(m.name);
+	out.bytes(m.ambient, sizeof(m.ambient));
+	out.bytes(m.diffuse, sizeof(m.diffuse));
+	out.bytes(m.specular, sizeof(m.specular));
+	out.bytes(m.transmittance, sizeof(m.transmittance));
+	out.bytes(m.emission, sizeof(m.emission));
+	out.pod(m.shininess);
+	out.pod(m.ior);
+	out.pod(m.dissolve);
+	out.pod(m.illum);
+	out.pod(m.dummy);
+	out.string(m.ambient_texname);
+	out.string(m.diffuse_texname);
+	out.string(m.specular_texname);
+	out.string(m.specular_highlight_texname);
+	out.string(m.bump_texname);
+	out.string(m.displacement_texname);
+	out.string(m.alpha_texname);
+	out.pod(static_cast<uint64_t>(m.unknown_parameter.size()));
+	for (auto& it : m.unknown_parameter)
+	{
+		out.string(it.first);
+		out.string(it.second);
+	}
+}
+
+static bool readMaterial(CacheReader& in, tinyobj::material_t& m)
+{
+	in.string(m.name);
+	for (float* f3 : { m.ambient, m.diffuse, m.specular, m.transmittance, m.emission })
+		for (int i = 0; i < 3; i++)
+			in.pod(f3[i]);
+	in.pod(m.shininess);
+	in.pod(m.ior);
+	in.pod(m.dissolve);
+	in.pod(m.illum);
+	in.pod(m.dummy);
+	in.string(m.ambient_texname);
+	in.string(m.diffuse_texname);
+	in.string(m.specular_texname);
+	in.string(m.specular_highlight_texname);
+	in.string(m.bump_texname);
+	in.string(m.displacement_texname);
+	in.string(m.alpha_texname);
+	uint64_t n = 0;
+	in.pod(n);
+	m.unknown_parameter.clear();
+	for (uint64_t i = 0; i < n && in.ok(); i++)
+	{
+		std::string key, value;
+		in.string(key);
+		in.string(value);
+		m.unknown_parameter[key] = value;
+	}
+	return in.ok();
+}
+
+static bool validPrim(PrimRef ref, const PrimitiveStore& prims)
+{
+	if (ref.type == objectType::tri)
+		return ref.index >= 0 && ref.index < static_cast<int>(prims.triangles.size());
+	if (ref.type == objectType::sph)
+		return ref.index >= 0 && ref.index < static_cast<int>(prims.spheres.size());
+	return false;
+}
+
+// depth first layout: the left child follows its parent and the right child comes after it, leaves point at real primitives
+static bool validNodes(const std::vector<LinearBVHNode>& nodes, const PrimitiveStore& prims)
+{
+	int32_t n = static_cast<int32_t>(nodes.size());
+	for (int32_t i = 0; i < n; i++)
+	{
+		const LinearBVHNode& node = nodes[i];
+		if (node.secondChild < 0) {
+			if (!validPrim(PrimRef(static_cast<objectType>(node.primType), node.primIndex), prims))
+				return false;
+		}
+		else if (node.secondChild <= i + 1 || node.secondChild >= n)
+			return false;
+	}
+	return true;
+}
+
+static void clearScene(std::vector<tinyobj::material_t>& materials, PrimitiveStore& prims,
+	std::vector<PrimRef>& lightObjects, std::vector<LinearBVHNode>& bvhNodes)
+{
+	materials.clear();
+	prims.mesh = TriangleMesh();
+	prims.triangles.clear();
+	prims.spheres.clear();
+	prims.textures.clear();
+	prims.arena.release();
+	lightObjects.clear();
+	bvhNodes.clear();
+}
+
+
+bool loadSceneCache(int modelSelect, int& width, int& height, float& fovy, Ray& cam, Vec& camUp,
+	std::vector<tinyobj::material_t>& materials, PrimitiveStore& prims, std::vector<PrimRef>& lightObjects,
+	std::vector<LinearBVHNode>& bvhNodes, int detailPrint)
+{
+	auto start = std::chrono::steady_clock::now();
+	std::string filename = sceneCachePath(modelSelect);
+	MappedFile file;
+	if (!file.open(filename))
+		return false;
+
+	CacheReader in(file.data(), file.size());
+	CacheHeader header;
+	if (!in.pod(header) || std::memcmp(header.magic, sceneCacheMagic, sizeof(sceneCacheMagic)) != 0 ||
+		header.version != sceneCacheVersion || header.byteOrder != byteOrderMark || header.fileSize != file.size())
+	{
+		printf("scene cache %s is from another version or incomplete, rebuilding it\n", filename.c_str());
+		return false;
+	}
+
+	uint64_t inputNum = 0;
+	in.pod(inputNum);
+	for (uint64_t i = 0; i < inputNum && in.ok(); i++)
+	{
+		std::string path;
+		uint64_t size, nowSize;
+		int64_t mtime, nowMtime;
+		in.string(path);
+		in.pod(size);
+		in.pod(mtime);
+		if (in.ok() && (!fileStamp(path, nowSize, nowMtime) || nowSize != size || nowMtime != mtime))
+		{
+			printf("scene cache %s is out of date (%s changed), rebuilding it\n", filename.c_str(), path.c_str());
+			return false;
+		}
+	}
+
+	in.pod(width);
+	in.pod(height);
+	in.pod(fovy);
+	in.pod(cam.origin);
+	in.pod(cam.direction);
+	in.pod(camUp);
+
+	uint64_t materialNum = 0;
+	in.pod(materialNum);
+	if (!in.ok() || materialNum > file.size())
+		return false;
+	materials.resize(static_cast<size_t>(materialNum));
+	for (auto& material : materials)
+		if (!readMaterial(in, material))
+			break;
+
+	in.array(prims.mesh.positions);
+	in.array(prims.mesh.texcoords);
+
+	uint64_t textureNum = 0;
+	in.pod(textureNum);
+	for (uint64_t i = 0; i < textureNum && in.ok(); i++)
+	{
+		int32_t w = 0, h = 0, c = 0;
+		in.pod(w);
+		in.pod(h);
+		in.pod(c);
+		if (w <= 0 || h <= 0 || c <= 0)
+			break;
+		const char* pixels = in.bytes(static_cast<uint64_t>(w) * h * c);
+		if (pixels != nullptr)
+			prims.addTexture(w, h, c, reinterpret_cast<const unsigned char*>(pixels));
+	}
+
+	std::vector<CachedTriangle> triangles;
+	std::vector<CachedSphere> spheres;
+	in.array(triangles);
+	in.array(spheres);
+	in.array(lightObjects);
+	in.array(bvhNodes);
+
+	bool valid = in.ok() && prims.mesh.texcoords.size() == 2 * prims.mesh.positions.size() && prims.textures.size() == textureNum;
+	int32_t materialCount = static_cast<int32_t>(materials.size());
+	int32_t textureCount = static_cast<int32_t>(prims.textures.size());
+	prims.triangles.reserve(triangles.size());
+	for (size_t i = 0; i < triangles.size() && valid; i++)
+	{
+		const CachedTriangle& t = triangles[i];
+		valid = t.idx[0] < prims.mesh.positions.size() && t.idx[1] < prims.mesh.positions.size() && t.idx[2] < prims.mesh.positions.size() &&
+			t.material >= 0 && t.material < materialCount && t.texture >= -1 && t.texture < textureCount;
+		if (valid)
+			prims.add(Triangle(t.idx[0], t.idx[1], t.idx[2], &materials[t.material], t.texture < 0 ? nullptr : prims.textures[t.texture]));
+	}
+	for (size_t i = 0; i < spheres.size() && valid; i++)
+	{
+		const CachedSphere& s = spheres[i];
+		valid = s.material >= 0 && s.material < materialCount && s.texture >= -1 && s.texture < textureCount;
+		if (valid) {
+			Sphere sphere(Vec(s.center), s.radius, &materials[s.material]);
+			sphere.texture = s.texture < 0 ? nullptr : prims.textures[s.texture];
+			prims.add(sphere);
+		}
+	}
+	for (size_t i = 0; i < lightObjects.size() && valid; i++)
+		valid = validPrim(lightObjects[i], prims);
+	valid = valid && !bvhNodes.empty() && validNodes(bvhNodes, prims);
+
+	if (!valid)
+	{
+		printf("scene cache %s is damaged, rebuilding it\n", filename.c_str());
+		clearScene(materials, prims, lightObjects, bvhNodes);
+		return false;
+	}
+
+	double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	printf("Scene cache %s loaded in %.1f ms\n  object num: %zd\n  light num: %zd\n  texture num: %zd, bvh node num: %zd\n",
+		filename.c_str(), ms, prims.size(), lightObjects.size(), prims.textures.size(), bvhNodes.size());
+	if (detailPrint)
+		printf("Image width: %d, height: %d\n", width, height);
+	return true;
+}
+
+
+bool saveSceneCache(int modelSelect, int width, int height, float fovy, const Ray& cam, const Vec& camUp,
+	const std::vector<tinyobj::material_t>& materials, const PrimitiveStore& prims, const std::vector<PrimRef>& lightObjects,
+	const std::vector<LinearBVHNode>& bvhNodes)
+{
+	// the cache holds every texel, textures paged through a TextureCache stay out of memory on purpose
+	for (const Texture* tex : prims.textures)
+		if (tex->cache != nullptr)
+			return false;
+
+	std::string filename = sceneCachePath(modelSelect);
+	// written next to the real one and renamed at the end, a crash never leaves half a cache behind and processes
+	// saving it at once each write their own file, the last rename wins
+	std::string tmpName = tmpFileName(filename);
+	std::ofstream file(tmpName, std::ios::binary);
+	if (!file) {
+		std::cerr << "can't open" << tmpName << std::endl;
+		return false;
+	}
+	CacheWriter out(file);
+
+	CacheHeader header;
+	std::memcpy(header.magic, sceneCacheMagic, sizeof(sceneCacheMagic));
+	header.version = sceneCacheVersion;
+	header.byteOrder = byteOrderMark;
+	header.fileSize = 0; // patched below once the size is known
+	out.pod(header);
+
+	std::vector<std::string> inputs = sceneInputs(modelSelect, materials);
+	out.pod(static_cast<uint64_t>(inputs.size()));
+	for (auto& path : inputs)
+	{
+		uint64_t size = 0;
+		int64_t mtime = 0;
+		// a missing file is recorded with size 0 and invalidates the cache if it shows up later
+		fileStamp(path, size, mtime);
+		out.string(path);
+		out.pod(size);
+		out.pod(mtime);
+	}
+
+	out.pod(width);
+	out.pod(height);
+	out.pod(fovy);
+	out.pod(cam.origin);
+	out.pod(cam.direction);
+	out.pod(camUp);
+
+	out.pod(static_cast<uint64_t>(materials.size()));
+	for (auto& material : materials)
+		writeMaterial(out, material);
+
+	out.array(prims.mesh.positions);
+	out.array(prims.mesh.texcoords);
+
+	std::map<const Texture*, int32_t> textureIndex;
+	out.pod(static_cast<uint64_t>(prims.textures.size()));
+	for (size_t i = 0; i < prims.textures.size(); i++)
+	{
+		const Texture* tex = prims.textures[i];
+		textureIndex[tex] = static_cast<int32_t>(i);
+		out.pod(static_cast<int32_t>(tex->w));
+		out.pod(static_cast<int32_t>(tex->h));
+		out.pod(static_cast<int32_t>(tex->c));
+		// always saved as scanlines, loading lays them out as the PrimitiveStore asks
+		size_t bytes = static_cast<size_t>(tex->w) * tex->h * tex->c;
+		if (tex->tiled())
+		{
+			std::vector<unsigned char> pixels(bytes);
+			tex->copyScanline(pixels.data());
+			out.bytes(pixels.data(), bytes);
+		}
+		else
+			out.bytes(tex->photo, bytes);
+	}
+
+	auto materialOf = [&materials](const tinyobj::material_t* m) {
+		return static_cast<int32_t>(m - materials.data());
+	};
+	auto textureOf = [&textureIndex](const Texture* t) {
+		return t == nullptr ? -1 : textureIndex.at(t);
+	};
+
+	std::vector<CachedTriangle> triangles(prims.triangles.size());
+	for (size_t i = 0; i < triangles.size(); i++)
+	{
+		const Triangle& tri = prims.triangles[i];
+		std::memcpy(triangles[i].idx, tri.idx, sizeof(tri.idx));
+		triangles[i].material = materialOf(tri.material);
+		triangles[i].texture = textureOf(tri.texture);
+	}
+	std::vector<CachedSphere> spheres(prims.spheres.size());
+	for (size_t i = 0; i < spheres.size(); i++)
+	{
+		const Sphere& sph = prims.spheres[i];
+		spheres[i].center[0] = sph.center.x;
+		spheres[i].center[1] = sph.center.y;
+		spheres[i].center[2] = sph.center.z;
+		spheres[i].radius = sph.radius;
+		spheres[i].material = materialOf(sph.material);
+		spheres[i].texture = textureOf(sph.texture);
+	}
+	out.array(triangles);
+	out.array(spheres);
+	out.array(lightObjects);
+	out.array(bvhNodes);
+
+	header.fileSize = static_cast<uint64_t>(file.tellp());
+	file.seekp(0);
+	out.pod(header);
+	file.close();
+	if (!file) {
+		std::cerr << "can't write" << tmpName << std::endl;
+		std::remove(tmpName.c_str());
+		return false;
+	}
+
+	std::remove(filename.c_str());
+	if (std::rename(tmpName.c_str(), filename.c_str()) != 0) {
+		std::cerr << "can't rename" << tmpName << std::endl;
+		return false;
+	}
+	printf("Scene cache %s saved (%.2f MB)\n", filename.c_str(), header.fileSize / (1024.0 * 1024.0));
+	return true;
+}
@@ -0,0 +1,251 @@
+#include "stats.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <mutex>
+
+namespace {
+
+// padded so the counters of two threads never share a cache line
+struct CounterSlot {
+	RenderCounters counters;
+	char padding[64];
+};
+
+std::mutex slotLock;
+// a deque never moves its elements, the threads keep pointers to theirs
+std::deque<CounterSlot> slots;
+
+const char* rayKindNames[3] = { "camera", "extension", "shadow" };
+
+std::string jsonString(const std::string& text)
+{
+	std::string quoted = "\"";
+	for (char ch : text)
+	{
+		if (ch == '"' || ch == '\\')
+			quoted += '\\';
+		if (static_cast<unsigned char>(ch) < 0x20)
+			quoted += ' ';
+		else
+			quoted += ch;
+	}
+	return quoted + "\"";
+}
+
+uint64_t totalRays(const RenderCounters& counters)
+{
+	return counters.rays[0] + counters.rays[1] + counters.rays[2];
+}
+
+}
+
+uint64_t RenderCounters::paths() const
+{
+	uint64_t sum = 0;
+	for (uint64_t n : pathLengths)
+		sum += n;
+	return sum;
+}
+
+RenderCounters& RenderCounters::operator+=(const RenderCounters& other)
+{
+	for (int k = 0; k < 3; k++)
+		rays[k] += other.rays[k];
+	nodesVisited += other.nodesVisited;
+	triangleTests += other.triangleTests;
+	sphereTests += other.sphereTests;
+	for (int k = 0; k <= maxPathLength; k++)
+		pathLengths[k] += other.pathLengths[k];
+	return *this;
+}
+
+RenderCounters& registerThreadCounters()
+{
+	std::lock_guard<std::mutex> guard(slotLock);
+	slots.emplace_back();
+	memset(&slots.back().counters, 0, sizeof(RenderCounters));
+	return slots.back().counters;
+}
+
+std::vector<RenderCounters> allThreadCounters()
+{
+	std::lock_guard<std::mutex> guard(slotLock);
+	std::vector<RenderCounters> counters;
+	for (auto& slot : slots)
+		counters.push_back(slot.counters);
+	return counters;
+}
+
+void resetThreadCounters()
+{
+	std::lock_guard<std::mutex> guard(slotLock);
+	for (auto& slot : slots)
+		memset(&slot.counters, 0, sizeof(RenderCounters));
+}
+
+void RenderStats::begin(const std::string& stage)
+{
+	end();
+	for (current = 0; current < static_cast<int>(stages.size()); current++)
+		if (stages[current].name == stage)
+			break;
+	if (current == static_cast<int>(stages.size()))
+		stages.push_back({ stage, 0.0, 0, false });
+	started = std::chrono::steady_clock::now();
+}
+
+void RenderStats::end()
+{
+	if (current < 0)
+		return;
+	stages[current].milliseconds += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+	stages[current].runs++;
+	current = -1;
+}
+
+void RenderStats::add(const std::string& stage, double milliseconds, int runs)
+{
+	for (auto& known : stages)
+		if (known.name == stage)
+		{
+			known.milliseconds += milliseconds;
+			known.runs += runs;
+			known.background = true;
+			return;
+		}
+	stages.push_back({ stage, milliseconds, runs, true });
+}
+
+double RenderStats::milliseconds(const std::string& stage) const
+{
+	for (auto& known : stages)
+		if (known.name == stage)
+			return known.milliseconds;
+	return 0.0;
+}
+
+void RenderStats::set(const std::string& key, const std::string& value)
+{
+	values.emplace_back(key, jsonString(value));
+}
+
+void RenderStats::set(const std::string& key, double value)
+{
+	char text[32];
+	snprintf(text, sizeof(text), "%.17g", value);
+	values.emplace_back(key, text);
+}
+
+void RenderStats::print() const
+{
+	std::vector<RenderCounters> threads = allThreadCounters();
+	RenderCounters sum;
+	memset(&sum, 0, sizeof(sum));
+	uint64_t busiest = 0, idlest = UINT64_MAX;
+	int busyThreads = 0;
+	for (auto& thread : threads)
+	{
+		sum += thread;
+		// threads that never traced a ray (texture decoders, the checkpoint writer) are left out of the balance
+		if (totalRays(thread) == 0)
+			continue;
+		busyThreads++;
+		busiest = std::max(busiest, totalRays(thread));
+		idlest = std::min(idlest, totalRays(thread));
+	}
+
+	printf("\n---------------- stats ----------------\n");
+	for (auto& value : values)
+		printf("%-24s %s\n", value.first.c_str(), value.second.c_str());
+	double totalTime = 0;
+	for (auto& stage : stages)
+	{
+		printf("%-24s %10.1f ms", (stage.name + " time").c_str(), stage.milliseconds);
+		if (stage.runs > 1)
+			printf(" (%d runs)", stage.runs);
+		printf(stage.background ? " in the background\n" : "\n");
+		if (!stage.background)
+			totalTime += stage.milliseconds;
+	}
+	printf("%-24s %10.1f ms\n", "total time", totalTime);
+
+	uint64_t rays = totalRays(sum);
+	double renderSeconds = milliseconds("render") / 1000.0;
+	for (int k = 0; k < 3; k++)
+		printf("%-24s %14llu\n", (std::string(rayKindNames[k]) + " rays").c_str(), static_cast<unsigned long long>(sum.rays[k]));
+	if (renderSeconds > 0)
+		printf("%-24s %14.2f\n", "Mrays/s (render)", rays / renderSeconds / 1e6);
+	printf("%-24s %14llu (%.1f per ray)\n", "bvh nodes visited", static_cast<unsigned long long>(sum.nodesVisited),
+		rays ? static_cast<double>(sum.nodesVisited) / rays : 0.0);
+	printf("%-24s %14llu (%.1f per ray)\n", "triangle tests", static_cast<unsigned long long>(sum.triangleTests),
+		rays ? static_cast<double>(sum.triangleTests) / rays : 0.0);
+	printf("%-24s %14llu (%.1f per ray)\n", "sphere tests", static_cast<unsigned long long>(sum.sphereTests),
+		rays ? static_cast<double>(sum.sphereTests) / rays : 0.0);
+
+	uint64_t paths = sum.paths();
+	if (paths != 0)
+	{
+		printf("%-24s", "path length");
+		for (int k = 0; k <= RenderCounters::maxPathLength; k++)
+			printf(" %d%s:%.1f%%", k, k == RenderCounters::maxPathLength ? "+" : "", 100.0 * sum.pathLengths[k] / paths);
+		printf("\n");
+	}
+	if (busyThreads > 1)
+		printf("%-24s %d threads, the busiest traced %.2fx the rays of the idlest\n", "thread balance", busyThreads,
+			static_cast<double>(busiest) / idlest);
+	printf("---------------------------------------\n");
+}
+
+bool RenderStats::writeJson(const std::string& path) const
+{
+	std::ofstream file(path, std::ios::binary);
+	if (!file)
+		return false;
+
+	auto counterFields = [](const RenderCounters& counters) {
+		std::string json = "\"rays\": {";
+		for (int k = 0; k < 3; k++)
+			json += std::string(k ? ", " : "") + jsonString(rayKindNames[k]) + ": " + std::to_string(counters.rays[k]);
+		json += "}, \"nodesVisited\": " + std::to_string(counters.nodesVisited) +
+			", \"triangleTests\": " + std::to_string(counters.triangleTests) +
+			", \"sphereTests\": " + std::to_string(counters.sphereTests) +
+			", \"pathLengths\": [";
+		for (int k = 0; k <= RenderCounters::maxPathLength; k++)
+			json += std::string(k ? ", " : "") + std::to_string(counters.pathLengths[k]);
+		return json + "]";
+	};
+
+	std::vector<RenderCounters> threads = allThreadCounters();
+	RenderCounters sum;
+	memset(&sum, 0, sizeof(sum));
+	for (auto& thread : threads)
+		sum += thread;
+
+	file << "{\n";
+	for (auto& value : values)
+		file << "  " << jsonString(value.first) << ": " << value.second << ",\n";
+	file << "  \"stagesMs\": {";
+	for (size_t i = 0; i < stages.size(); i++)
+	{
+		char number[32];
+		snprintf(number, sizeof(number), "%.3f", stages[i].milliseconds);
+		file << (i ? ", " : "") << jsonString(stages[i].name) << ": " << number;
+	}
+	file << "},\n";
+	file << "  \"total\": {" << counterFields(sum) << "},\n";
+	file << "  \"threads\": [";
+	bool first = true;
+	for (auto& thread : threads)
+	{
+		if (totalRays(thread) == 0)
+			continue;
+		file << (first ? "\n" : ",\n") << "    {" << counterFields(thread) << "}";
+		first = false;
+	}
+	file << "\n  ]\n}\n";
+	return static_cast<bool>(file.flush());
+}
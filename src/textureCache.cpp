@@ -0,0 +1,345 @@
+#include "textureCache.h"
+#include "mappedFile.h"
+#include "third/stb/stb_image.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+
+// bump it whenever the layout below changes, older tile files are simply rebuilt
+static const uint32_t tileFileVersion = 1;
+static const char tileFileMagic[8] = { 'M', 'C', 'P', 'T', 'T', 'E', 'X', '\0' };
+// written as a number, reads back differently on a machine with another byte order
+static const uint32_t byteOrderMark = 0x01020304;
+
+// followed by levelNum TileFileLevel and the tiles of every level, rows of tiles from the top
+struct TileFileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t byteOrder;
+	uint64_t fileSize;
+	// size and modification time of the image the file was made from
+	uint64_t sourceSize;
+	int64_t sourceMtime;
+	int32_t w, h, c;
+	int32_t tileSize;
+	int32_t levelNum;
+	int32_t reserved;
+};
+
+struct TileFileLevel {
+	int32_t w, h, tilesX, tilesY;
+	uint64_t offset;
+};
+
+static std::string tileFileName(const std::string& imagePath)
+{
+	// fnv-1a of the whole path, two images with the same name in different folders get different files
+	uint64_t hash = 14695981039346656037ull;
+	for (char ch : imagePath)
+	{
+		hash ^= static_cast<unsigned char>(ch);
+		hash *= 1099511628211ull;
+	}
+	size_t slash = imagePath.find_last_of("/\\");
+	char hex[17];
+	snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(hash));
+	return "tmpData/" + imagePath.substr(slash == std::string::npos ? 0 : slash + 1) + "." + hex + ".tiles";
+}
+
+// header and level table of a tile file, false if it is missing, from another version or cut short
+static bool readTileFile(const std::string& tileFile, TileFileHeader& header, std::vector<TileFileLevel>& levels)
+{
+	std::ifstream file(tileFile, std::ios::binary | std::ios::ate);
+	if (!file)
+		return false;
+	uint64_t size = static_cast<uint64_t>(file.tellg());
+	file.seekg(0);
+	if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+		memcmp(header.magic, tileFileMagic, sizeof(tileFileMagic)) != 0 ||
+		header.version != tileFileVersion || header.byteOrder != byteOrderMark || header.fileSize != size ||
+		header.levelNum <= 0 || header.levelNum > 32 || header.tileSize <= 0 || header.w <= 0 || header.h <= 0 || header.c <= 0)
+		return false;
+
+	levels.resize(header.levelNum);
+	if (!file.read(reinterpret_cast<char*>(levels.data()), levels.size() * sizeof(TileFileLevel)))
+		return false;
+	uint64_t tileBytes = 4ull * header.tileSize * header.tileSize;
+	for (auto& level : levels)
+		if (level.w <= 0 || level.h <= 0 || level.tilesX != (level.w + header.tileSize - 1) / header.tileSize ||
+			level.tilesY != (level.h + header.tileSize - 1) / header.tileSize ||
+			level.offset + static_cast<uint64_t>(level.tilesX) * level.tilesY * tileBytes > size)
+			return false;
+	return true;
+}
+
+
+// the last tiles a thread fetched from a cache, direct mapped by their key
+struct TextureCache::ThreadTiles {
+	uint64_t generation = 0;
+	ThreadStats* stats = nullptr;
+	uint64_t keys[threadTileNum];
+	bool valid[threadTileNum];
+	std::vector<unsigned char> texels;
+};
+
+static std::atomic<uint64_t> cacheGenerations(0);
+
+TextureCache::TextureCache(size_t budgetBytes, int tileSize) :
+	budget(budgetBytes), tileSize(tileSize), tileBytes(4 * static_cast<size_t>(tileSize) * tileSize),
+	generation(++cacheGenerations)
+{
+}
+
+TextureCache::ThreadTiles& TextureCache::threadTiles()
+{
+	thread_local ThreadTiles tiles;
+	return tiles;
+}
+
+bool TextureCache::prepare(const std::string& imagePath, std::string& tileFile)
+{
+	tileFile = tileFileName(imagePath);
+	uint64_t sourceSize;
+	int64_t sourceMtime;
+	if (!fileStamp(imagePath, sourceSize, sourceMtime))
+		return false;
+
+	TileFileHeader header;
+	std::vector<TileFileLevel> levels;
+	if (readTileFile(tileFile, header, levels) && header.sourceSize == sourceSize && header.sourceMtime == sourceMtime &&
+		header.tileSize == tileSize)
+		return true;
+
+	int w, h, c;
+	unsigned char* data = stbi_load(imagePath.c_str(), &w, &h, &c, 0);
+	if (data == nullptr)
+		return false;
+	// the mip levels are built in memory once, as scanlines, and then cut into tiles
+	PrimitiveStore image;
+	image.textureLayout = TextureLayout::scanline;
+	const Texture* texture = image.addTexture(w, h, c, data);
+	stbi_image_free(data);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, tileFileMagic, sizeof(tileFileMagic));
+	header.version = tileFileVersion;
+	header.byteOrder = byteOrderMark;
+	header.sourceSize = sourceSize;
+	header.sourceMtime = sourceMtime;
+	header.w = w;
+	header.h = h;
+	header.c = c;
+	header.tileSize = tileSize;
+	header.levelNum = texture->levelNum;
+
+	levels.resize(texture->levelNum);
+	uint64_t offset = sizeof(TileFileHeader) + levels.size() * sizeof(TileFileLevel);
+	for (int l = 0; l < texture->levelNum; l++)
+	{
+		const MipLevel& level = texture->levels[l];
+		levels[l].w = level.w;
+		levels[l].h = level.h;
+		levels[l].tilesX = (level.w + tileSize - 1) / tileSize;
+		levels[l].tilesY = (level.h + tileSize - 1) / tileSize;
+		levels[l].offset = offset;
+		offset += static_cast<uint64_t>(levels[l].tilesX) * levels[l].tilesY * tileBytes;
+	}
+	header.fileSize = offset;
+
+	// written next to the real one and renamed at the end, a crash never leaves half a file behind and processes
+	// preparing the image at once each write their own file
+	std::string tmpName = tmpFileName(tileFile);
+	std::ofstream out(tmpName, std::ios::binary | std::ios::trunc);
+	if (!out)
+		return false;
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	out.write(reinterpret_cast<const char*>(levels.data()), levels.size() * sizeof(TileFileLevel));
+
+	std::vector<unsigned char> tile(tileBytes);
+	for (int l = 0; l < texture->levelNum; l++)
+	{
+		const MipLevel& level = texture->levels[l];
+		for (int ty = 0; ty < levels[l].tilesY; ty++)
+			for (int tx = 0; tx < levels[l].tilesX; tx++)
+			{
+				// texels past the edge of the level stay 0, they are never fetched
+				std::fill(tile.begin(), tile.end(), 0);
+				for (int y = ty * tileSize; y < std::min(level.h, (ty + 1) * tileSize); y++)
+					for (int x = tx * tileSize; x < std::min(level.w, (tx + 1) * tileSize); x++)
+					{
+						const unsigned char* p = texture->texelAddress(level, x, y);
+						unsigned char* q = tile.data() + 4 * ((y - ty * tileSize) * tileSize + (x - tx * tileSize));
+						if (c >= 3)
+						{
+							q[0] = p[0];
+							q[1] = p[1];
+							q[2] = p[2];
+							q[3] = c == 4 ? p[3] : 255;
+						}
+						else
+						{
+							q[0] = q[1] = q[2] = p[0];
+							q[3] = c == 2 ? p[1] : 255;
+						}
+					}
+				out.write(reinterpret_cast<const char*>(tile.data()), tile.size());
+			}
+	}
+	out.close();
+	if (!out)
+	{
+		std::remove(tmpName.c_str());
+		return false;
+	}
+	std::remove(tileFile.c_str());
+	if (std::rename(tmpName.c_str(), tileFile.c_str()) != 0)
+	{
+		std::remove(tmpName.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool TextureCache::attach(const std::string& tileFile, Texture* texture, PrimitiveStore& prims)
+{
+	TileFileHeader header;
+	std::vector<TileFileLevel> levels;
+	if (!readTileFile(tileFile, header, levels))
+		return false;
+
+	FileInfo info;
+	info.path = tileFile;
+	info.file.reset(new RandomAccessFile());
+	if (!info.file->open(tileFile))
+		return false;
+	MipLevel* mips = prims.arena.allocArray<MipLevel>(levels.size());
+	for (size_t l = 0; l < levels.size(); l++)
+	{
+		info.levels.push_back({ levels[l].w, levels[l].h, levels[l].tilesX, levels[l].offset });
+		mips[l] = { levels[l].w, levels[l].h, 0, nullptr };
+	}
+
+	*texture = Texture(header.w, header.h, header.c, nullptr);
+	texture->levels = mips;
+	texture->levelNum = header.levelNum;
+	texture->cache = this;
+	texture->cacheFile = static_cast<int>(files.size());
+	files.push_back(std::move(info));
+	return true;
+}
+
+void TextureCache::fetch(int file, int level, int x, int y, unsigned char rgba[4])
+{
+	const LevelInfo& info = files[file].levels[level];
+	uint64_t tile = static_cast<uint64_t>(y / tileSize) * info.tilesX + x / tileSize;
+	uint64_t key = static_cast<uint64_t>(file) << 40 | static_cast<uint64_t>(level) << 35 | tile;
+	size_t offset = 4 * (static_cast<size_t>(y % tileSize) * tileSize + x % tileSize);
+
+	ThreadTiles& own = threadTiles();
+	if (own.generation != generation)
+	{
+		// the first fetch of this thread from this cache
+		std::lock_guard<std::mutex> guard(threadLock);
+		threadStats.emplace_back();
+		own.stats = &threadStats.back();
+		own.generation = generation;
+		std::fill(own.valid, own.valid + threadTileNum, false);
+		own.texels.assign(threadTileNum * tileBytes, 0);
+	}
+	own.stats->fetches++;
+	int slot = static_cast<int>((key * 0x9E3779B97F4A7C15ull) >> 32) & (threadTileNum - 1);
+	unsigned char* texels = own.texels.data() + slot * tileBytes;
+	if (own.valid[slot] && own.keys[slot] == key)
+		own.stats->hits++;
+	else
+	{
+		own.valid[slot] = false;
+		loadTile(key, file, info.offset + tile * tileBytes, texels);
+		own.keys[slot] = key;
+		own.valid[slot] = true;
+	}
+	memcpy(rgba, texels + offset, 4);
+}
+
+void TextureCache::loadTile(uint64_t key, int file, uint64_t offset, unsigned char* out)
+{
+	Shard& shard = shards[(key * 0x9E3779B97F4A7C15ull) >> 60];
+	{
+		std::lock_guard<std::mutex> guard(shard.lock);
+		auto it = shard.tiles.find(key);
+		if (it != shard.tiles.end())
+		{
+			shard.hits++;
+			shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+			memcpy(out, it->second->texels.data(), tileBytes);
+			return;
+		}
+		shard.misses++;
+	}
+
+	// read without the lock, other threads may read the same tile meanwhile, the first one in keeps it
+	if (!files[file].file->read(offset, tileBytes, out))
+	{
+		// the file was cut or removed under us, the tile reads black and is tried again next time
+		std::fill(out, out + tileBytes, 0);
+		std::lock_guard<std::mutex> guard(shard.lock);
+		shard.readErrors++;
+		return;
+	}
+
+	std::lock_guard<std::mutex> guard(shard.lock);
+	if (shard.tiles.find(key) != shard.tiles.end())
+		return;
+	// make room, the buffer of an evicted tile is reused
+	std::vector<unsigned char> texels;
+	size_t shardBudget = std::max(tileBytes, budget / shardNum);
+	while (!shard.lru.empty() && shard.bytes + tileBytes > shardBudget)
+	{
+		Tile& old = shard.lru.back();
+		shard.tiles.erase(old.key);
+		texels.swap(old.texels);
+		shard.lru.pop_back();
+		shard.bytes -= tileBytes;
+		shard.evictions++;
+	}
+	texels.assign(out, out + tileBytes);
+
+	shard.lru.push_front(Tile{ key, std::move(texels) });
+	shard.tiles[key] = shard.lru.begin();
+	shard.bytes += tileBytes;
+	shard.peakBytes = std::max(shard.peakBytes, shard.bytes);
+}
+
+void TextureCache::printStats() const
+{
+	uint64_t hits = 0, misses = 0, evictions = 0, readErrors = 0;
+	size_t bytes = 0, peakBytes = 0;
+	for (const auto& shard : shards)
+	{
+		hits += shard.hits;
+		misses += shard.misses;
+		evictions += shard.evictions;
+		readErrors += shard.readErrors;
+		bytes += shard.bytes;
+		peakBytes += shard.peakBytes;
+	}
+	uint64_t fetches = 0, threadHits = 0;
+	for (const auto& thread : threadStats)
+	{
+		fetches += thread.fetches;
+		threadHits += thread.hits;
+	}
+	uint64_t lookups = hits + misses;
+	printf("texture cache: %llu fetches, %.2f%% from the tiles of the thread, %.2f%% of the other %llu from the cache, "
+		"%llu tiles read, %llu evicted, %.2f MB resident (peak %.2f MB, budget %.2f MB)\n",
+		static_cast<unsigned long long>(fetches), fetches ? 100.0 * threadHits / fetches : 0.0,
+		lookups ? 100.0 * hits / lookups : 0.0, static_cast<unsigned long long>(lookups),
+		static_cast<unsigned long long>(misses), static_cast<unsigned long long>(evictions),
+		bytes / (1024.0 * 1024.0), peakBytes / (1024.0 * 1024.0), budget / (1024.0 * 1024.0));
+	if (readErrors != 0)
+		printf("  %llu tiles could not be read from their files\n", static_cast<unsigned long long>(readErrors));
+}
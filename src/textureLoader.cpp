@@ -0,0 +1,212 @@
+#include "textureLoader.h"
+#include "textureCache.h"
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "third/stb/stb_image.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+
+
+TextureLoader::TextureLoader(int threads, TextureCache* cache) :
+	maxThreads(threads > 0 ? threads : std::max(1, static_cast<int>(std::thread::hardware_concurrency()))),
+	cache(cache), doneNum(0), reused(0), stopping(false)
+{
+}
+
+TextureLoader::~TextureLoader()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	queued.notify_all();
+	for (auto& worker : workers)
+		worker.join();
+	// decodes finish() never collected
+	for (auto& job : jobs)
+		if (job->data != nullptr)
+			stbi_image_free(job->data);
+}
+
+Texture* TextureLoader::request(const std::string& path, PrimitiveStore& prims)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	auto it = byPath.find(path);
+	if (it != byPath.end()) {
+		reused++;
+		return it->second->texture;
+	}
+
+	// an empty texture for now, finish() fills it in
+	prims.textures.push_back(prims.arena.create<Texture>(0, 0, 0, nullptr));
+	jobs.emplace_back(new Job{ path, prims.textures.back(), nullptr, 0, 0, 0, "", false, false, false, 0.0 });
+	Job* job = jobs.back().get();
+	byPath[path] = job;
+	queue.push_back(job);
+
+	// one more worker while there are more unfinished decodes than workers
+	if (static_cast<int>(workers.size()) < maxThreads && jobs.size() - doneNum > workers.size())
+		workers.emplace_back(&TextureLoader::work, this);
+	queued.notify_one();
+	return job->texture;
+}
+
+void TextureLoader::work()
+{
+	std::unique_lock<std::mutex> guard(lock);
+	for (;;) {
+		queued.wait(guard, [this] { return stopping || !queue.empty(); });
+		if (queue.empty())
+			return;
+		Job* job = queue.front();
+		queue.pop_front();
+
+		guard.unlock();
+		auto start = std::chrono::steady_clock::now();
+		int w = 0, h = 0, c = 0;
+		unsigned char* data = nullptr;
+		std::string tileFile;
+		bool prepared = cache != nullptr ? cache->prepare(job->path, tileFile) :
+			(data = stbi_load(job->path.c_str(), &w, &h, &c, 0)) != nullptr;
+		double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		guard.lock();
+
+		job->data = data;
+		job->tileFile = tileFile;
+		job->prepared = prepared;
+		job->w = w;
+		job->h = h;
+		job->c = c;
+		job->milliseconds = milliseconds;
+		job->done = true;
+		doneNum++;
+		decoded.notify_all();
+	}
+}
+
+void TextureLoader::finish(PrimitiveStore& prims, int detailPrint)
+{
+	if (jobs.empty())
+		return;
+	auto start = std::chrono::steady_clock::now();
+	std::unique_lock<std::mutex> guard(lock);
+	decoded.wait(guard, [this] { return doneNum == jobs.size(); });
+	double waited = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+	std::vector<Texture*> failed;
+	size_t bytes = 0;
+	double decodeTime = 0;
+	for (auto& job : jobs) {
+		if (job->texture->levelNum != 0 || job->failed)
+			continue;
+		decodeTime += job->milliseconds;
+		if (!job->prepared || (cache != nullptr && !cache->attach(job->tileFile, job->texture, prims))) {
+			printf("failed to load texture %s\n", job->path.c_str());
+			job->failed = true;
+			failed.push_back(job->texture);
+			continue;
+		}
+		if (cache != nullptr)
+			continue;
+		prims.setPixels(job->texture, job->w, job->h, job->c, job->data);
+		stbi_image_free(job->data);
+		job->data = nullptr;
+		bytes += static_cast<size_t>(job->w) * job->h * job->c;
+	}
+
+	if (!failed.empty()) {
+		auto isFailed = [&](const Texture* texture) {
+			return texture != nullptr && std::find(failed.begin(), failed.end(), texture) != failed.end();
+		};
+		for (auto& triangle : prims.triangles)
+			if (isFailed(triangle.texture))
+				triangle.texture = nullptr;
+		for (auto& sphere : prims.spheres)
+			if (isFailed(sphere.texture))
+				sphere.texture = nullptr;
+		prims.textures.erase(std::remove_if(prims.textures.begin(), prims.textures.end(), isFailed), prims.textures.end());
+	}
+
+	if (detailPrint)
+		printf("%s %zd textures (%.2f MB) on %zd threads: %.1f ms of decoding, %.1f ms waited, %zd requests shared a decode\n",
+			cache != nullptr ? "Paged" : "Decoded", jobs.size() - failed.size(), bytes / (1024.0 * 1024.0), workers.size(), decodeTime, waited, reused);
+	if (detailPrint == 2)
+		for (auto& job : jobs)
+			if (!job->failed)
+				printf("  texture %s: width:%d, height:%d, channels:%d\n", job->path.c_str(),
+					job->texture->w, job->texture->h, job->texture->c);
+}
+
+void benchmarkTexelFetch(const PrimitiveStore& prims, int fetches)
+{
+	// xorshift, so the benchmark leaves the rand() sequence of the render alone
+	uint32_t state = 2463534242u;
+	auto next = [&state]() {
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return (state & 0xffffff) / static_cast<float>(0x1000000);
+	};
+
+	printf("texel fetch benchmark, %d fetches per run (Mfetch/s)\n", fetches);
+	printf("  %-14s %-9s %-10s %9s %9s %8s\n", "texture", "filter", "pattern", "scanline", "tiled", "speedup");
+	for (size_t i = 0; i < prims.textures.size(); i++)
+	{
+		const Texture* source = prims.textures[i];
+		std::vector<unsigned char> pixels(static_cast<size_t>(source->w) * source->h * source->c);
+		source->copyScanline(pixels.data());
+		PrimitiveStore layouts[2];
+		layouts[0].textureLayout = TextureLayout::scanline;
+		layouts[1].textureLayout = TextureLayout::tiled;
+		const Texture* tex[2];
+		for (int k = 0; k < 2; k++)
+			tex[k] = layouts[k].addTexture(source->w, source->h, source->c, pixels.data());
+
+		// coherent: the uv walks about a texel per fetch like the hits of neighbouring pixels do, random: anywhere
+		std::vector<float> uv(3 * static_cast<size_t>(fetches));
+		for (int pattern = 0; pattern < 2; pattern++)
+		{
+			float u = next(), v = next();
+			for (int f = 0; f < fetches; f++)
+			{
+				if (pattern == 0)
+				{
+					u += (next() - 0.5f) * 2.0f / source->w;
+					v += (next() - 0.5f) * 2.0f / source->h;
+				}
+				else
+				{
+					u = next();
+					v = next();
+				}
+				uv[3 * f + 0] = u;
+				uv[3 * f + 1] = v;
+				uv[3 * f + 2] = next() * 4.0f;
+			}
+
+			for (TextureFilter filter : { TextureFilter::bilinear, TextureFilter::trilinear })
+			{
+				double rate[2];
+				for (int k = 0; k < 2; k++)
+				{
+					Vec sum;
+					auto start = std::chrono::steady_clock::now();
+					for (int f = 0; f < fetches; f++)
+						sum = sum + tex[k]->sample(uv[3 * f], uv[3 * f + 1], filter == TextureFilter::bilinear ? 0.0f : uv[3 * f + 2], filter);
+					double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+					rate[k] = fetches / seconds / 1e6;
+					// keeps the loop from being optimized away
+					if (sum.x < 0)
+						printf(" ");
+				}
+				char name[16];
+				snprintf(name, sizeof(name), "%zd (%dx%d)", i, source->w, source->h);
+				printf("  %-14s %-9s %-10s %9.1f %9.1f %7.2fx\n", name, filter == TextureFilter::bilinear ? "bilinear" : "trilinear",
+					pattern == 0 ? "coherent" : "random", rate[0], rate[1], rate[1] / rate[0]);
+			}
+		}
+	}
+}